@@ -0,0 +1,531 @@
+// ----- Batched Datagram I/O -----
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <time.h>
+
+#include "batchIO.h"
+#include "cpe464.h"
+
+// Set when sendErr_init() was given a non-zero error rate
+static int lossLayerActive = 0;
+
+void sendmmsgErr_init(double errorRate) {
+	lossLayerActive = (errorRate > 0);
+}
+
+// Sends vlen datagrams, returns how many went out (or -1 on error).
+// *syscalls is bumped by the number of system calls used.
+int sendmmsgErr(int socketNum, struct mmsghdr *msgs, unsigned int vlen, int flags, uint64_t *syscalls) {
+	unsigned int sent = 0;
+
+	if (lossLayerActive) {
+		// One trip through the libcpe464 hook per datagram, which needs
+		// the datagram in one piece
+		uint8_t linear[IP_MAXPACKET];
+		for (sent = 0; sent < vlen; sent++) {
+			struct msghdr *hdr = &msgs[sent].msg_hdr;
+			uint8_t *data = hdr->msg_iov[0].iov_base;
+			size_t dataLen = hdr->msg_iov[0].iov_len;
+			if (hdr->msg_iovlen > 1) {
+				dataLen = 0;
+				for (size_t i = 0; i < hdr->msg_iovlen; i++) {
+					memcpy(linear + dataLen, hdr->msg_iov[i].iov_base, hdr->msg_iov[i].iov_len);
+					dataLen += hdr->msg_iov[i].iov_len;
+				}
+				data = linear;
+			}
+			ssize_t len = sendtoErr(socketNum, data, dataLen, flags & ~MSG_ZEROCOPY,
+				(struct sockaddr *)hdr->msg_name, hdr->msg_namelen);
+			(*syscalls)++;
+			if (len < 0) {
+				return sent ? (int)sent : -1;
+			}
+			msgs[sent].msg_len = len;
+		}
+		return sent;
+	}
+
+	while (sent < vlen) {
+		int ret = sendmmsg(socketNum, msgs + sent, vlen - sent, flags);
+		(*syscalls)++;
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return sent ? (int)sent : -1;
+		}
+		sent += ret;
+	}
+	return sent;
+}
+
+void SendBatch_init(SendBatch *batch, int socketNum, struct sockaddr *addr, socklen_t addrLen, TransferStats *stats) {
+	memset(batch, 0, sizeof(SendBatch));
+	batch->socketNum = socketNum;
+	batch->addr = addr;
+	batch->addrLen = addrLen;
+	batch->stats = stats;
+}
+
+// Scratch space for the next PDU's header, valid until the batch is flushed
+uint8_t *SendBatch_header(SendBatch *batch) {
+	return batch->headers[batch->count];
+}
+
+// Queues a PDU for sending; the PDU memory must stay put until the next flush.
+// Flushes on its own once BATCH_MAX PDUs are queued.
+int SendBatch_add(SendBatch *batch, uint8_t *pdu, int pduLen) {
+	return SendBatch_addv(batch, pdu, pduLen, NULL, 0);
+}
+
+// Same as SendBatch_add for a PDU whose payload is not next to its header
+int SendBatch_addv(SendBatch *batch, uint8_t *header, int headerLen, uint8_t *payload, int payloadLen) {
+	int i = batch->count;
+	struct iovec *iov = &batch->iovs[i * 2];
+
+	// Always two iovecs per PDU (the second may be empty) so a run of
+	// PDUs is one contiguous iovec array for GSO
+	iov[0].iov_base = header;
+	iov[0].iov_len = headerLen;
+	iov[1].iov_base = payload;
+	iov[1].iov_len = payloadLen;
+	batch->pduLens[i] = headerLen + payloadLen;
+	batch->departures[i] = 0;
+	if (batch->pacer != NULL) {
+		batch->departures[i] = Pacer_consume(batch->pacer, headerLen + payloadLen);
+	}
+	batch->count++;
+
+	if (batch->count == BATCH_MAX) {
+		return SendBatch_flush(batch);
+	}
+	return 0;
+}
+
+// Builds one message per datagram, or with GSO one message per run of
+// equal-sized PDUs (only the last of a run may be shorter).  pdusPerMsg
+// gets the number of PDUs in each message.  Returns the message count.
+static int build_messages(SendBatch *batch, int *pdusPerMsg) {
+	int msgCount = 0;
+
+	for (int i = 0; i < batch->count; msgCount++) {
+		int n = 1;
+		int bytes = batch->pduLens[i];
+		if (batch->gso) {
+			while (i + n < batch->count && n < GSO_MAX_SEGMENTS &&
+					batch->pduLens[i + n] <= batch->pduLens[i] &&
+					bytes + batch->pduLens[i + n] <= GSO_MAX_BYTES) {
+				bytes += batch->pduLens[i + n];
+				n++;
+				if (batch->pduLens[i + n - 1] < batch->pduLens[i]) {
+					break; // a short segment ends the run
+				}
+			}
+		}
+
+		struct msghdr *hdr = &batch->msgs[msgCount].msg_hdr;
+		memset(&batch->msgs[msgCount], 0, sizeof(struct mmsghdr));
+		hdr->msg_name = batch->addr;
+		hdr->msg_namelen = batch->addrLen;
+		hdr->msg_iov = &batch->iovs[i * 2];
+		hdr->msg_iovlen = n * 2;
+
+		// Control messages: segment size for a GSO run, departure time when paced
+		size_t controlLen = 0;
+		hdr->msg_control = batch->control[msgCount];
+		hdr->msg_controllen = sizeof(batch->control[msgCount]);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+		if (n > 1) {
+			uint16_t segmentSize = batch->pduLens[i];
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(uint16_t));
+			controlLen += CMSG_SPACE(sizeof(uint16_t));
+			cmsg = CMSG_NXTHDR(hdr, cmsg);
+		}
+		if (batch->departures[i] != 0) {
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_TXTIME;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+			memcpy(CMSG_DATA(cmsg), &batch->departures[i], sizeof(uint64_t));
+			controlLen += CMSG_SPACE(sizeof(uint64_t));
+		}
+		hdr->msg_controllen = controlLen;
+		if (controlLen == 0) {
+			hdr->msg_control = NULL;
+		}
+
+		pdusPerMsg[msgCount] = n;
+		i += n;
+	}
+	return msgCount;
+}
+
+// sendmmsg() through the ring: one SENDMSG per message, submitted (along
+// with anything else queued) in one go.  Same returns as sendmmsg().
+static int uring_sendmmsg(Uring *ring, int socketNum, struct mmsghdr *msgs, unsigned int vlen, int flags, uint64_t *syscalls) {
+	int ids[BATCH_MAX];
+	if (Uring_space(ring) < (int)vlen) {
+		Uring_submit(ring, syscalls);
+	}
+	for (unsigned int i = 0; i < vlen; i++) {
+		ids[i] = Uring_sendmsg(ring, socketNum, &msgs[i].msg_hdr, flags);
+	}
+	if (Uring_submit(ring, syscalls) < 0) {
+		return -1;
+	}
+
+	unsigned int sent = 0;
+	for (; sent < vlen; sent++) {
+		int res = Uring_result(ring, ids[sent]);
+		if (res < 0) {
+			errno = -res;
+			return sent ? (int)sent : -1;
+		}
+		msgs[sent].msg_len = res;
+	}
+	return sent;
+}
+
+// Pushes all queued PDUs to the socket, returns the number sent or -1
+int SendBatch_flush(SendBatch *batch) {
+	int pdusPerMsg[BATCH_MAX];
+	if (batch->count == 0) {
+		return 0;
+	}
+
+	int msgCount = build_messages(batch, pdusPerMsg);
+	int sent;
+	if (batch->ring != NULL && !lossLayerActive) {
+		sent = uring_sendmmsg(batch->ring, batch->socketNum, batch->msgs, msgCount, batch->flags, &batch->stats->syscalls);
+	} else {
+		// The loss layer only sits on the system call path
+		sent = sendmmsgErr(batch->socketNum, batch->msgs, msgCount, batch->flags, &batch->stats->syscalls);
+	}
+	if (sent < 0 && batch->gso) {
+		// Kernel or device refused the offload: send this batch (again)
+		// one datagram per message and leave GSO off from now on
+		perror("sendmmsg (UDP_SEGMENT)");
+		batch->gso = 0;
+		return SendBatch_flush(batch);
+	}
+
+	int pdus = 0;
+	if (sent < 0) {
+		perror("sendmmsg");
+	} else {
+		for (int m = 0; m < sent; m++) {
+			pdus += pdusPerMsg[m];
+			if (pdusPerMsg[m] > 1) {
+				batch->stats->gsoSends++;
+				batch->stats->gsoSegments += pdusPerMsg[m];
+			}
+		}
+		batch->stats->packets += pdus;
+	}
+	batch->count = 0;
+	return sent < 0 ? sent : pdus;
+}
+
+// Turns on SO_ZEROCOPY, returns -1 if the kernel can't do it
+int ZeroCopy_enable(int socketNum) {
+	int one = 1;
+	if (lossLayerActive) {
+		return -1; // sendtoErr() needs its own copy anyway
+	}
+	return setsockopt(socketNum, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+
+// Checks the socket can do UDP_SEGMENT, returns -1 if not (or when the
+// loss layer needs every datagram separately)
+int GSO_enable(int socketNum) {
+	int segmentSize = 0;
+	socklen_t len = sizeof(segmentSize);
+	if (lossLayerActive) {
+		return -1;
+	}
+	return getsockopt(socketNum, SOL_UDP, UDP_SEGMENT, &segmentSize, &len);
+}
+
+// Sets or clears DF for both address families of a dual-stack socket.
+// Probe mode ignores the cached path MTU: a datagram bigger than the
+// interface MTU fails with EMSGSIZE, one bigger than the path's is dropped
+// on the way instead of being fragmented.
+int DontFragment_set(int socketNum, int dontFragment) {
+	int v4 = dontFragment ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+	int v6 = dontFragment ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+	int r4 = setsockopt(socketNum, IPPROTO_IP, IP_MTU_DISCOVER, &v4, sizeof(v4));
+	int r6 = setsockopt(socketNum, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &v6, sizeof(v6));
+	return (r4 == 0 || r6 == 0) ? 0 : -1;
+}
+
+// Grows SO_SNDBUF or SO_RCVBUF to hold bytes (up to SOCKET_BUFFER_MAX),
+// past the sysctl ceiling when we are privileged.  Never shrinks it.
+// Returns the size the kernel reports afterwards.
+int SocketBuffer_reserve(int socketNum, int optname, long bytes) {
+	int size = 0;
+	socklen_t len = sizeof(size);
+	int force = (optname == SO_SNDBUF) ? SO_SNDBUFFORCE : SO_RCVBUFFORCE;
+
+	if (bytes > SOCKET_BUFFER_MAX) {
+		bytes = SOCKET_BUFFER_MAX;
+	}
+	getsockopt(socketNum, SOL_SOCKET, optname, &size, &len);
+	if (size >= bytes) {
+		return size;
+	}
+	size = bytes;
+	if (setsockopt(socketNum, SOL_SOCKET, force, &size, sizeof(size)) < 0) {
+		setsockopt(socketNum, SOL_SOCKET, optname, &size, sizeof(size));
+	}
+	len = sizeof(size);
+	getsockopt(socketNum, SOL_SOCKET, optname, &size, &len);
+	return size;
+}
+
+// Turns on SO_TXTIME so packets can carry a departure time, returns -1
+// if the kernel can't do it.  Only the fq (or etf) qdisc honours it.
+int TxTime_enable(int socketNum) {
+	struct sock_txtime config;
+	if (lossLayerActive) {
+		return -1; // sendtoErr() has no control messages
+	}
+	memset(&config, 0, sizeof(config));
+	config.clockid = CLOCK_MONOTONIC;
+	return setsockopt(socketNum, SOL_SOCKET, SO_TXTIME, &config, sizeof(config));
+}
+
+// Reads MSG_ZEROCOPY completions off the error queue.  Each zero-copy
+// datagram gets the next 32-bit id from the kernel; *completedUpTo is set
+// to one past the highest id the kernel is done with.  Returns the number
+// of notifications read.
+int ZeroCopy_reap(int socketNum, uint32_t *completedUpTo) {
+	int count = 0;
+	uint8_t control[128];
+
+	while (1) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(socketNum, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			break;
+		}
+
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+			      (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+				continue;
+			}
+			struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+				*completedUpTo = err->ee_data + 1; // ids ee_info..ee_data are done
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+int RecvBatch_init(RecvBatch *batch, int socketNum, int bufLen, TransferStats *stats) {
+	memset(batch, 0, sizeof(RecvBatch));
+	batch->buffers = malloc((size_t)BATCH_MAX * bufLen);
+	if (batch->buffers == NULL) {
+		return -1;
+	}
+	batch->bufLen = bufLen;
+	batch->socketNum = socketNum;
+	batch->stats = stats;
+	return 0;
+}
+
+static int split_segments(RecvBatch *batch, int received);
+static int uring_recvmmsg(RecvBatch *batch, int flags);
+
+// Waits for at least one datagram, then takes whatever else is already
+// queued (up to BATCH_MAX).  Returns the number received, 0 if nothing was
+// ready with MSG_DONTWAIT, or -1 on error.  Non-blocking receives go
+// through the ring when the batch has one.
+int RecvBatch_recv(RecvBatch *batch, int flags) {
+	for (int i = 0; i < BATCH_MAX; i++) {
+		batch->iovs[i].iov_base = batch->buffers + (size_t)i * batch->bufLen;
+		batch->iovs[i].iov_len = batch->bufLen;
+		memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+		batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		if (batch->gro) {
+			batch->msgs[i].msg_hdr.msg_control = batch->control[i];
+			batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->control[i]);
+		}
+	}
+
+	int ret;
+	if (batch->ring != NULL && (flags & MSG_DONTWAIT)) {
+		ret = uring_recvmmsg(batch, flags);
+	} else {
+		ret = recvmmsg(batch->socketNum, batch->msgs, BATCH_MAX, flags | MSG_WAITFORONE, NULL);
+		if (batch->stats != NULL) {
+			batch->stats->syscalls++;
+		}
+	}
+	if (ret < 0) {
+		batch->count = 0;
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		perror("recvmmsg");
+		return -1;
+	}
+	batch->count = ret;
+	if (batch->gro) {
+		batch->count = split_segments(batch, ret);
+	}
+	if (batch->stats != NULL) {
+		batch->stats->packets += batch->count;
+	}
+	return batch->count;
+}
+
+// recvmmsg() through the ring: BATCH_MAX non-blocking RECVMSGs, the ones
+// that found a datagram are moved to the front.  Writes queued earlier may
+// still be reading the buffers, so the receives wait for them.
+static int uring_recvmmsg(RecvBatch *batch, int flags) {
+	int ids[BATCH_MAX];
+	uint64_t syscalls = 0;
+	if (Uring_space(batch->ring) < BATCH_MAX) {
+		Uring_submit(batch->ring, &syscalls);
+	}
+	Uring_fence(batch->ring);
+	for (int i = 0; i < BATCH_MAX; i++) {
+		ids[i] = Uring_recvmsg(batch->ring, batch->socketNum, &batch->msgs[i].msg_hdr, flags);
+	}
+	int ret = Uring_submit(batch->ring, &syscalls);
+	if (batch->stats != NULL) {
+		batch->stats->syscalls += syscalls;
+	}
+	if (ret < 0) {
+		return -1;
+	}
+
+	int count = 0;
+	for (int i = 0; i < BATCH_MAX; i++) {
+		int res = Uring_result(batch->ring, ids[i]);
+		if (res < 0) {
+			if (res != -EAGAIN && res != -EWOULDBLOCK && count == 0) {
+				errno = -res;
+				ret = -1;
+			}
+			continue;
+		}
+		if (count != i) {
+			batch->msgs[count] = batch->msgs[i];
+			batch->iovs[count] = batch->iovs[i];
+			batch->addrs[count] = batch->addrs[i];
+			memcpy(batch->control[count], batch->control[i], sizeof(batch->control[i]));
+			batch->msgs[count].msg_hdr.msg_name = &batch->addrs[count];
+			batch->msgs[count].msg_hdr.msg_iov = &batch->iovs[count];
+			if (batch->gro) {
+				batch->msgs[count].msg_hdr.msg_control = batch->control[count];
+			}
+		}
+		batch->msgs[count].msg_len = res;
+		count++;
+	}
+	if (count == 0) {
+		errno = (ret < 0) ? errno : EAGAIN;
+		return -1;
+	}
+	return count;
+}
+
+// Cuts every coalesced receive back into its datagrams: all gso_size
+// bytes long except maybe the last.  Returns the number of datagrams.
+static int split_segments(RecvBatch *batch, int received) {
+	int count = 0;
+
+	for (int m = 0; m < received; m++) {
+		uint8_t *data = batch->iovs[m].iov_base;
+		int len = batch->msgs[m].msg_len;
+		int segmentSize = len;
+
+		struct msghdr *hdr = &batch->msgs[m].msg_hdr;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+				memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+		if (segmentSize <= 0) {
+			segmentSize = len;
+		}
+
+		int pieces = 0;
+		for (int offset = 0; offset < len && count < BATCH_MAX * GSO_MAX_SEGMENTS; offset += segmentSize) {
+			batch->segments[count].data = data + offset;
+			batch->segments[count].len = (len - offset < segmentSize) ? len - offset : segmentSize;
+			batch->segments[count].msg = m;
+			count++;
+			pieces++;
+		}
+		if (pieces > 1 && batch->stats != NULL) {
+			batch->stats->groReceives++;
+			batch->stats->groSegments += pieces;
+		}
+	}
+	return count;
+}
+
+// Lets the kernel hand over several datagrams of a flow in one receive.
+// Returns -1 (and the batch keeps working a datagram at a time) if the
+// kernel doesn't support it.
+int RecvBatch_enable_gro(RecvBatch *batch) {
+	int one = 1;
+	RecvSegment *segments = malloc(sizeof(RecvSegment) * BATCH_MAX * GSO_MAX_SEGMENTS);
+	uint8_t *buffers = malloc((size_t)BATCH_MAX * GRO_BUF_LEN);
+	if (segments == NULL || buffers == NULL ||
+			setsockopt(batch->socketNum, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+		free(segments);
+		free(buffers);
+		return -1;
+	}
+
+	free(batch->buffers);
+	batch->buffers = buffers;
+	batch->bufLen = GRO_BUF_LEN;
+	batch->segments = segments;
+	batch->gro = 1;
+	return 0;
+}
+
+uint8_t *RecvBatch_packet(RecvBatch *batch, int i, int *len) {
+	if (batch->gro) {
+		*len = batch->segments[i].len;
+		return batch->segments[i].data;
+	}
+	*len = batch->msgs[i].msg_len;
+	return batch->iovs[i].iov_base;
+}
+
+// Who sent datagram i
+struct sockaddr_in6 *RecvBatch_addr(RecvBatch *batch, int i) {
+	return &batch->addrs[batch->gro ? batch->segments[i].msg : i];
+}
+
+void RecvBatch_free(RecvBatch *batch) {
+	free(batch->buffers);
+	free(batch->segments);
+	batch->buffers = NULL;
+	batch->segments = NULL;
+}
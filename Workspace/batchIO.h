@@ -0,0 +1,106 @@
+// 
+// Batched datagram I/O built on sendmmsg()/recvmmsg().
+//
+// A SendBatch collects PDUs for one peer and pushes them to the kernel
+// with as few system calls as possible.  A RecvBatch owns a preallocated
+// ring of receive buffers and drains up to BATCH_MAX datagrams per call.
+// sendmmsgErr() is the batched counterpart of sendtoErr(): when the
+// libcpe464 loss layer is active each datagram still goes through
+// sendtoErr() so drops and bit flips keep working, otherwise the whole
+// batch goes out in one sendmmsg().
+//
+// A PDU may be split in two pieces (header + payload living elsewhere,
+// e.g. in an mmap'd file) and a batch can ask for MSG_ZEROCOPY; the
+// ZeroCopy_* calls enable it on a socket and reap its completions.
+//
+// A batch may also carry a Pacer: every PDU added is charged to it, and in
+// txtime mode stamped with its departure time (SCM_TXTIME).
+//
+// Given a Uring, a batch goes to the kernel as io_uring SENDMSG / RECVMSG
+// operations instead, in one io_uring_enter() together with whatever file
+// I/O the caller queued on the same ring.
+
+#ifndef __BATCHIO_H__
+#define __BATCHIO_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "transferStats.h"
+#include "pacer.h"
+#include "uringIO.h"
+
+#define BATCH_MAX 64
+#define GSO_MAX_SEGMENTS 64   // UDP_SEGMENT limit per send
+#define GSO_MAX_BYTES 65000   // stays under the 64 KB datagram limit
+#define GRO_BUF_LEN 65535     // one coalesced receive
+#define SOCKET_BUFFER_MAX (64 << 20) // most a transfer asks the kernel to queue
+
+typedef struct {
+	struct mmsghdr msgs[BATCH_MAX];
+	struct iovec iovs[BATCH_MAX * 2]; // header + payload per PDU
+	uint8_t headers[BATCH_MAX][16];   // headers built just for this batch (7, or 11 with a CRC)
+	int pduLens[BATCH_MAX];
+	uint64_t departures[BATCH_MAX];   // SCM_TXTIME per PDU, 0 = none
+	int count;                        // PDUs queued
+	int socketNum;
+	int flags;                        // extra sendmmsg flags (MSG_ZEROCOPY)
+	int gso;                          // send runs of PDUs as one UDP_SEGMENT message
+	struct sockaddr *addr;
+	socklen_t addrLen;
+	TransferStats *stats;
+	Pacer *pacer;                     // may be NULL
+	Uring *ring;                      // io_uring backend, NULL = sendmmsg()
+	uint8_t control[BATCH_MAX][CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+} SendBatch;
+
+// One datagram inside a (possibly GRO coalesced) receive
+typedef struct {
+	uint8_t *data;
+	int len;
+	int msg;          // which receive it came from
+} RecvSegment;
+
+typedef struct {
+	struct mmsghdr msgs[BATCH_MAX];
+	struct iovec iovs[BATCH_MAX];
+	struct sockaddr_in6 addrs[BATCH_MAX];
+	uint8_t *buffers; // BATCH_MAX buffers of bufLen bytes each
+	int bufLen;
+	int count;        // datagrams (segments) from the last receive
+	int socketNum;
+	TransferStats *stats; // may be NULL
+	int gro;          // UDP_GRO on, receives are split into segments
+	RecvSegment *segments;
+	Uring *ring;      // io_uring backend for non-blocking receives, NULL = recvmmsg()
+	uint8_t control[BATCH_MAX][CMSG_SPACE(sizeof(int))];
+} RecvBatch;
+
+void sendmmsgErr_init(double errorRate);
+int sendmmsgErr(int socketNum, struct mmsghdr *msgs, unsigned int vlen, int flags, uint64_t *syscalls);
+
+void SendBatch_init(SendBatch *batch, int socketNum, struct sockaddr *addr, socklen_t addrLen, TransferStats *stats);
+uint8_t *SendBatch_header(SendBatch *batch);
+int SendBatch_add(SendBatch *batch, uint8_t *pdu, int pduLen);
+int SendBatch_addv(SendBatch *batch, uint8_t *header, int headerLen, uint8_t *payload, int payloadLen);
+int SendBatch_flush(SendBatch *batch);
+
+int ZeroCopy_enable(int socketNum);
+int ZeroCopy_reap(int socketNum, uint32_t *completedUpTo);
+
+int TxTime_enable(int socketNum);
+int GSO_enable(int socketNum);
+int DontFragment_set(int socketNum, int dontFragment);
+int SocketBuffer_reserve(int socketNum, int optname, long bytes);
+
+int RecvBatch_init(RecvBatch *batch, int socketNum, int bufLen, TransferStats *stats);
+int RecvBatch_recv(RecvBatch *batch, int flags);
+int RecvBatch_enable_gro(RecvBatch *batch);
+uint8_t *RecvBatch_packet(RecvBatch *batch, int i, int *len);
+struct sockaddr_in6 *RecvBatch_addr(RecvBatch *batch, int i);
+void RecvBatch_free(RecvBatch *batch);
+
+#endif
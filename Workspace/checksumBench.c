@@ -0,0 +1,181 @@
+// Checksum microbenchmark: libcpe464's in_cksum() against the FastChecksum
+// kernels over PDU sized buffers, the fused copy + checksum against memcpy
+// followed by in_cksum(), and CRC32C with and without SSE4.2.  Last, what
+// re-flagging a PDU for a retransmit costs: recomputing against patching.
+//
+// Usage: checksumBench [seconds per measurement]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "checksum.h"
+#include "fastChecksum.h"
+
+#define MAX_SIZE 65536
+
+static const int sizes[] = { 64, 256, 1407, 9007, 65007 };
+static double runFor = 0.2;
+static volatile uint64_t sink; // keeps the compiler from dropping the work
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// -----Measured operations-----
+typedef enum {
+	OP_IN_CKSUM, OP_SUM, OP_MEMCPY_IN_CKSUM, OP_COPY, OP_CRC32C, OP_UPDATE, OP_CRC32C_UPDATE
+} OP;
+
+static void run_once(OP op, uint8_t *dst, uint8_t *src, int size) {
+	switch (op) {
+		case OP_IN_CKSUM:
+			sink += in_cksum((unsigned short *)src, size);
+			break;
+		case OP_SUM:
+			sink += FastChecksum_fold(FastChecksum_add(0, src, size));
+			break;
+		case OP_MEMCPY_IN_CKSUM:
+			memcpy(dst, src, size);
+			sink += in_cksum((unsigned short *)dst, size);
+			break;
+		case OP_COPY:
+			sink += FastChecksum_fold(FastChecksum_copy(0, dst, src, size));
+			break;
+		case OP_CRC32C:
+			sink += FastChecksum_crc32c(0, src, size);
+			break;
+		case OP_UPDATE:
+			sink += FastChecksum_update(sink, 16, 17);
+			break;
+		case OP_CRC32C_UPDATE:
+			sink += FastChecksum_crc32c_update(sink, 16, 17, size - 7);
+			break;
+	}
+}
+
+// GB/s of payload pushed through op
+static double measure(OP op, uint8_t *dst, uint8_t *src, int size) {
+	long iterations = 0;
+	long batch = 1 + (1 << 20) / size;
+	double start = now();
+	double elapsed;
+	do {
+		for (long i = 0; i < batch; i++) {
+			run_once(op, dst, src, size);
+		}
+		iterations += batch;
+		elapsed = now() - start;
+	} while (elapsed < runFor);
+	return iterations * (double)size / elapsed / 1e9;
+}
+
+// Every kernel must agree with in_cksum() on every length and alignment
+static int verify(uint8_t *dst, uint8_t *src) {
+	const char *names[] = { "scalar", "sse2", "avx2" };
+	for (int k = 0; k < 3; k++) {
+		if (FastChecksum_use(names[k]) < 0) {
+			continue;
+		}
+		for (int len = 0; len < 300; len++) {
+			for (int offset = 0; offset < 4; offset += 2) {
+				uint16_t expected = in_cksum((unsigned short *)(src + offset), len);
+				uint16_t sum = FastChecksum_fold(FastChecksum_add(0, src + offset, len));
+				uint16_t copy = FastChecksum_fold(FastChecksum_copy(0, dst, src + offset, len));
+				if (sum != expected || copy != expected || memcmp(dst, src + offset, len) != 0) {
+					printf("ERROR: %s differs from in_cksum at length %d offset %d\n", names[k], len, offset);
+					return -1;
+				}
+			}
+		}
+	}
+
+	// Patching one word (or byte) has to land where recomputing does
+	for (int len = 8; len < 2000; len += 97) {
+		uint16_t before = FastChecksum_fold(FastChecksum_add(0, src, len));
+		uint32_t crcBefore = FastChecksum_crc32c(0, src, len);
+		uint16_t oldWord, newWord;
+		uint8_t oldByte = src[6];
+		memcpy(&oldWord, src + 6, 2);
+		src[6] ^= 0x5a;
+		memcpy(&newWord, src + 6, 2);
+		int ok = FastChecksum_update(before, oldWord, newWord) == FastChecksum_fold(FastChecksum_add(0, src, len)) &&
+			FastChecksum_crc32c_update(crcBefore, oldByte, src[6], len - 7) == FastChecksum_crc32c(0, src, len);
+		src[6] = oldByte;
+		if (!ok) {
+			printf("ERROR: incremental update differs from recomputing at length %d\n", len);
+			return -1;
+		}
+	}
+
+	// "123456789" is the CRC32C check value from RFC 3720
+	const char *crcNames[] = { "table", "sse4.2" };
+	for (int k = 0; k < 2; k++) {
+		if (FastChecksum_use(crcNames[k]) == 0 &&
+				FastChecksum_crc32c(0, (const uint8_t *)"123456789", 9) != 0xe3069283) {
+			printf("ERROR: crc32c %s gives the wrong check value\n", crcNames[k]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		runFor = atof(argv[1]);
+	}
+
+	uint8_t *src = aligned_alloc(64, MAX_SIZE + 64);
+	uint8_t *dst = aligned_alloc(64, MAX_SIZE + 64);
+	srand(464);
+	for (int i = 0; i < MAX_SIZE + 64; i++) {
+		src[i] = rand();
+	}
+	if (verify(dst, src) < 0) {
+		return 1;
+	}
+
+	printf("GB/s, %.2f s per measurement\n", runFor);
+	printf("%6s %9s %8s %8s %8s | %13s %9s | %9s %9s\n", "size", "in_cksum", "scalar", "sse2",
+		"avx2", "memcpy+cksum", "copy+sum", "crc table", "crc sse42");
+	for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int size = sizes[i];
+		printf("%6d %9.2f", size, measure(OP_IN_CKSUM, dst, src, size));
+
+		const char *names[] = { "scalar", "sse2", "avx2" };
+		for (int k = 0; k < 3; k++) {
+			if (FastChecksum_use(names[k]) < 0) {
+				printf(" %8s", "-");
+			} else {
+				printf(" %8.2f", measure(OP_SUM, dst, src, size));
+			}
+		}
+
+		// Fused copy with the widest kernel, as the PDU path picks it
+		for (int k = 2; k > 0 && FastChecksum_use(names[k]) < 0; k--);
+		printf(" | %13.2f %9.2f", measure(OP_MEMCPY_IN_CKSUM, dst, src, size), measure(OP_COPY, dst, src, size));
+
+		FastChecksum_use("table");
+		printf(" | %9.2f", measure(OP_CRC32C, dst, src, size));
+		if (FastChecksum_use("sse4.2") < 0) {
+			printf(" %9s\n", "-");
+		} else {
+			printf(" %9.2f\n", measure(OP_CRC32C, dst, src, size));
+		}
+	}
+
+	// Re-flagging a default sized PDU for a retransmit, ns per PDU
+	int size = 1407;
+	FastChecksum_use("sse4.2");
+	printf("\nre-flag %d byte PDU (ns): checksum %.1f, RFC 1624 update %.1f | crc32c %.1f, update %.1f\n", size,
+		size / measure(OP_SUM, dst, src, size), size / measure(OP_UPDATE, dst, src, size),
+		size / measure(OP_CRC32C, dst, src, size), size / measure(OP_CRC32C_UPDATE, dst, src, size));
+
+	free(src);
+	free(dst);
+	return 0;
+}
@@ -1,55 +1,129 @@
 // ----- Circular Queue Library -----
+//
+// The packet bytes for every slot live in one contiguous, cache-line
+// aligned arena sized at init time (WindowSize x SlotSize), so insert and
+// remove never allocate.  Big arenas are backed by huge pages when the
+// system has them.  A slot sent with MSG_ZEROCOPY stays busy until the
+// kernel reports the send complete, even after it has been ACKed.
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "circularQueue.h"
 
-int CircularQueue_init(CircularQueue *queue, int windowSize) {
+static uint8_t *arena_alloc(CircularQueue *queue) {
+	void *arena = NULL;
+	queue->HugePages = 0;
+
+	if (queue->ArenaSize >= QUEUE_HUGE_PAGE_SIZE) {
+		// Round up to whole huge pages, try explicit huge pages first
+		// and fall back to transparent huge pages
+		queue->ArenaSize = (queue->ArenaSize + QUEUE_HUGE_PAGE_SIZE - 1) & ~((size_t)QUEUE_HUGE_PAGE_SIZE - 1);
+		arena = mmap(NULL, queue->ArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (arena == MAP_FAILED) {
+			arena = mmap(NULL, queue->ArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (arena != MAP_FAILED) {
+				madvise(arena, queue->ArenaSize, MADV_HUGEPAGE);
+			}
+		}
+		if (arena != MAP_FAILED) {
+			queue->HugePages = 1;
+			return arena;
+		}
+	}
+
+	if (posix_memalign(&arena, QUEUE_CACHE_LINE, queue->ArenaSize) != 0) {
+		return NULL;
+	}
+	return arena;
+}
+
+int CircularQueue_init(CircularQueue *queue, int windowSize, int maxPacketLen) {
 	queue->entries = (QueueEntry *)calloc(windowSize, sizeof(QueueEntry));
 	if (queue->entries == NULL) {
 		return -1;
 	}
 	
+	queue->SlotSize = (maxPacketLen + QUEUE_CACHE_LINE - 1) & ~(QUEUE_CACHE_LINE - 1);
+	queue->ArenaSize = (size_t)windowSize * queue->SlotSize;
+	queue->arena = arena_alloc(queue);
+	if (queue->arena == NULL) {
+		free(queue->entries);
+		queue->entries = NULL;
+		return -1;
+	}
+
 	queue->WindowSize = windowSize;
 	queue->ValidCount = 0;
-	
-	for (int i = 0; i < windowSize; i++) {
-		queue->entries[i].valid = 0;
-		queue->entries[i].packet = NULL;
-	}
+	queue->Base = 1; // data sequence numbers start at 1
+	queue->Next = 1;
+	queue->ZeroCopyNext = 0;
+	queue->ZeroCopyDone = 0;
 	return 0;
 }
 
+// Arena bytes backing sequenceNum's slot; fill it and then call commit
+uint8_t *CircularQueue_slot(CircularQueue *queue, uint32_t sequenceNum) {
+	return queue->arena + (size_t)(sequenceNum % queue->WindowSize) * queue->SlotSize;
+}
 
+// 1 if the slot for sequenceNum can be (re)filled: not holding an unACKed
+// packet and not still referenced by a zero-copy send
+int CircularQueue_slot_ready(CircularQueue *queue, uint32_t sequenceNum) {
+	QueueEntry *entry = &queue->entries[sequenceNum % queue->WindowSize];
+	if (entry->valid) {
+		return 0;
+	}
+	if (entry->zeroCopyBusy && (int32_t)(entry->zeroCopyId - queue->ZeroCopyDone) >= 0) {
+		return 0;
+	}
+	entry->zeroCopyBusy = 0;
+	return 1;
+}
 
-int CircularQueue_insert(CircularQueue *queue, uint32_t sequenceNum, uint8_t *packet, int packetLen) {
+// Records that sequenceNum's slot just went out with MSG_ZEROCOPY
+void CircularQueue_zero_copy_sent(CircularQueue *queue, uint32_t sequenceNum) {
+	QueueEntry *entry = &queue->entries[sequenceNum % queue->WindowSize];
+	entry->zeroCopyId = queue->ZeroCopyNext++;
+	entry->zeroCopyBusy = 1;
+}
+
+// Marks the slot filled in place through CircularQueue_slot() as valid.
+// packetLen is the full PDU length, which can be more than the slot holds
+// when the payload lives elsewhere (zero-copy)
+int CircularQueue_commit(CircularQueue *queue, uint32_t sequenceNum, int packetLen) {
 	if (CircularQueue_is_full(queue)) {
-        	return -1;
-    	}
-    		int index = sequenceNum % queue->WindowSize;
-    	if (queue->entries[index].valid) {
-        	return -1;
-    	}
-    	queue->entries[index].packet = malloc(packetLen);
-    	if (!queue->entries[index].packet) {
 		return -1;
-	
 	}
+	int index = sequenceNum % queue->WindowSize;
+	if (queue->entries[index].valid) {
+		return -1;
+	}
+	queue->entries[index].packetLen = packetLen;
+	queue->entries[index].sequenceNum = sequenceNum;
+	queue->entries[index].valid = 1;
+	queue->entries[index].retransmitted = 0;
+	queue->ValidCount++;
+	if ((int32_t)(sequenceNum - queue->Next) >= 0) {
+		queue->Next = sequenceNum + 1;
+	}
+	return 0;
+}
 
-	memcpy(queue->entries[index].packet, packet, packetLen);
-    	queue->entries[index].packetLen = packetLen;
-    	queue->entries[index].sequenceNum = sequenceNum;
-    	queue->entries[index].valid = 1;
- 	queue->ValidCount++;
-    	return 0;
+int CircularQueue_insert(CircularQueue *queue, uint32_t sequenceNum, uint8_t *packet, int packetLen) {
+	int index = sequenceNum % queue->WindowSize;
+	if (CircularQueue_is_full(queue) || queue->entries[index].valid || packetLen > queue->SlotSize) {
+		return -1;
+	}
+	memcpy(CircularQueue_slot(queue, sequenceNum), packet, packetLen);
+	return CircularQueue_commit(queue, sequenceNum, packetLen);
 }
 
 QueueEntry *CircularQueue_get(CircularQueue *queue, uint32_t sequenceNum) {
 	int index = sequenceNum % queue->WindowSize;
-	// before: !queue->entries[index].valid
-	if (queue->entries[index].valid || queue->entries[index].sequenceNum != sequenceNum) {
+	if (queue->entries[index].valid && queue->entries[index].sequenceNum == sequenceNum) {
 		return &queue->entries[index];
 	}
 	return NULL;
@@ -60,14 +134,31 @@ int CircularQueue_remove(CircularQueue *queue, uint32_t sequenceNum) {
 	if (!queue->entries[index].valid || queue->entries[index].sequenceNum != sequenceNum) {
 		return -1;
 	}
-	free(queue->entries[index].packet);
-	queue->entries[index].packet = NULL;
 	queue->entries[index].valid = 0;
 	queue->ValidCount--;
 	return 0;
 	
 }
 
+// Cumulative ACK: everything below ackSequence is done.  Only walks the
+// newly ACKed slots, so the cost is O(acked) no matter how far into the
+// transfer we are.  Returns the number of slots released.
+int CircularQueue_slide(CircularQueue *queue, uint32_t ackSequence) {
+	int released = 0;
+
+	// Never slide past what has actually been sent
+	if ((int32_t)(ackSequence - queue->Next) > 0) {
+		ackSequence = queue->Next;
+	}
+	while ((int32_t)(ackSequence - queue->Base) > 0) {
+		if (CircularQueue_remove(queue, queue->Base) == 0) {
+			released++;
+		}
+		queue->Base++;
+	}
+	return released;
+}
+
 int CircularQueue_is_full(CircularQueue *queue) {
 	return queue->ValidCount >= queue->WindowSize;
 }
@@ -78,13 +169,10 @@ int CircularQueue_is_empty(CircularQueue *queue) {
 
 int CircularQueue_clear(CircularQueue *queue) {
 	for (int i = 0; i < queue->WindowSize; i++) {
-		if (queue->entries[i].valid) {
-			free(queue->entries[i].packet);
-			queue->entries[i].packet = NULL;
-			queue->entries[i].valid = 0;
-		}
+		queue->entries[i].valid = 0;
 	}
 	queue->ValidCount = 0;
+	queue->Base = queue->Next;
 	return 0;
 }
 
@@ -92,10 +180,14 @@ int CircularQueue_free(CircularQueue *queue) {
 	CircularQueue_clear(queue);
 	free(queue->entries);
 	queue->entries = NULL;
+	if (queue->arena != NULL) {
+		if (queue->HugePages) {
+			munmap(queue->arena, queue->ArenaSize);
+		} else {
+			free(queue->arena);
+		}
+		queue->arena = NULL;
+	}
 	queue->WindowSize = 0;
 	return 0;
 }
-
-
-
-
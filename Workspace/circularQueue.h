@@ -2,24 +2,47 @@
 #define CIRCULAR_QUEUE_H
 
 #include <stdint.h>
+#include <stddef.h>
 
+#define QUEUE_CACHE_LINE 64
+#define QUEUE_HUGE_PAGE_SIZE (2 * 1024 * 1024) // arenas this big try huge pages
+
+// Slot metadata, kept apart from the packet bytes so the
+// valid/sequence checks only walk this compact array
 typedef struct {
-	uint8_t *packet;
-	int packetLen;
+	uint64_t fileOffset;  // where the payload starts in the source file
+	uint64_t sentTime;    // RttEstimator_now() of the first transmission
 	uint32_t sequenceNum;
-	int valid;
+	uint32_t zeroCopyId;  // MSG_ZEROCOPY id of the last send from this slot
+	uint16_t packetLen;
+	uint8_t valid;
+	uint8_t zeroCopyBusy; // kernel may still read the slot
+	uint8_t retransmitted; // sent more than once, no RTT sample (Karn)
 } QueueEntry;
 
 typedef struct {
 	QueueEntry *entries; // Dynamically allocated array
+	uint8_t *arena;      // WindowSize slots of SlotSize bytes, allocated once
+	size_t ArenaSize;
+	int SlotSize;        // max packet length rounded up to a cache line
+	int HugePages;       // arena is an mmap() (huge page) mapping
 	int WindowSize;
 	int ValidCount;
+	uint32_t Base;         // oldest sequence number not yet ACKed
+	uint32_t Next;         // one past the newest sequence number committed
+	uint32_t ZeroCopyNext; // id the kernel gives the next MSG_ZEROCOPY send
+	uint32_t ZeroCopyDone; // every id below this has completed
 } CircularQueue;
 
-int CircularQueue_init(CircularQueue *queue, int windowSize);
+int CircularQueue_init(CircularQueue *queue, int windowSize, int maxPacketLen);
+uint8_t *CircularQueue_slot(CircularQueue *queue, uint32_t sequenceNum);
+int CircularQueue_commit(CircularQueue *queue, uint32_t sequenceNum, int packetLen);
+int CircularQueue_slot_ready(CircularQueue *queue, uint32_t sequenceNum);
+void CircularQueue_zero_copy_sent(CircularQueue *queue, uint32_t sequenceNum);
 int CircularQueue_insert(CircularQueue *queue, uint32_t sequenceNum, uint8_t *packet, int packetLen);
 QueueEntry *CircularQueue_get(CircularQueue *queue, uint32_t sequenceNum);
 int CircularQueue_remove(CircularQueue *queue, uint32_t sequenceNum);
+int CircularQueue_slide(CircularQueue *queue, uint32_t ackSequence);
 int CircularQueue_is_full(CircularQueue *queue);
 int CircularQueue_is_empty(CircularQueue *queue);
 int CircularQueue_clear(CircularQueue *queue);
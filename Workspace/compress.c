@@ -0,0 +1,327 @@
+// ----- On-the-Wire Compression -----
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "compress.h"
+#include "fastChecksum.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5   // a block always ends in literals
+#define MATCH_LIMIT 12    // no match starts this close to the end
+#define HASH_BITS_MAX 12
+
+#define CACHE_MAGIC "RCLZC01"
+#define CACHE_HEADER_LEN 4096     // the cache header's page, regions follow
+#define REGION_MAGIC 0x4c5a4331   // "LZC1"
+
+// ----- LZ Codec -----
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return value;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+	uint64_t value;
+	memcpy(&value, p, 8);
+	return value;
+}
+
+static int put_length(uint8_t *dst, int out, int len) {
+	while (len >= 255) {
+		dst[out++] = 255;
+		len -= 255;
+	}
+	dst[out++] = len;
+	return out;
+}
+
+// Appends literals and (matchLen > 0) the match behind them, -1 if it
+// might not fit in dstCap
+static int put_sequence(uint8_t *dst, int dstCap, int out, const uint8_t *literals, int literalLen, int offset, int matchLen) {
+	if (out + 1 + literalLen / 255 + 1 + literalLen + 2 + matchLen / 255 + 1 > dstCap) {
+		return -1;
+	}
+	uint8_t *token = dst + out++;
+	*token = ((literalLen < 15) ? literalLen : 15) << 4;
+	if (literalLen >= 15) {
+		out = put_length(dst, out, literalLen - 15);
+	}
+	memcpy(dst + out, literals, literalLen);
+	out += literalLen;
+	if (matchLen == 0) {
+		return out;
+	}
+
+	dst[out++] = offset & 0xff;
+	dst[out++] = offset >> 8;
+	int extra = matchLen - MIN_MATCH;
+	*token |= (extra < 15) ? extra : 15;
+	if (extra >= 15) {
+		out = put_length(dst, out, extra - 15);
+	}
+	return out;
+}
+
+// Compresses srcLen bytes into dst, returns the compressed length or 0 if
+// it doesn't come out shorter than the input (or doesn't fit dstCap)
+int Compress_block(uint8_t *dst, int dstCap, const uint8_t *src, int srcLen) {
+	if (srcLen > COMPRESS_MAX_INPUT) {
+		return 0;
+	}
+	uint16_t table[1 << HASH_BITS_MAX]; // last position each hashed 4 bytes were seen at
+	int hashBits = 8;
+	while (hashBits < HASH_BITS_MAX && (1 << hashBits) < srcLen) {
+		hashBits++;
+	}
+	memset(table, 0, sizeof(uint16_t) << hashBits);
+
+	int out = 0;
+	int anchor = 0;  // first byte not yet emitted
+	int misses = 0;
+	int p = 0;
+	while (p < srcLen - MATCH_LIMIT) {
+		uint32_t word = read32(src + p);
+		uint32_t hash = (word * 2654435761u) >> (32 - hashBits);
+		int candidate = table[hash];
+		table[hash] = p;
+		if (candidate >= p || read32(src + candidate) != word) {
+			p += 1 + (misses++ >> 6); // data that doesn't compress is skipped faster
+			continue;
+		}
+		misses = 0;
+
+		// Grow the match back into the pending literals, then forward
+		while (p > anchor && candidate > 0 && src[p - 1] == src[candidate - 1]) {
+			p--;
+			candidate--;
+		}
+		int len = MIN_MATCH;
+		int end = srcLen - LAST_LITERALS;
+		while (p + len + 8 <= end) {
+			uint64_t diff = read64(src + p + len) ^ read64(src + candidate + len);
+			if (diff != 0) {
+				len += __builtin_ctzll(diff) / 8; // first differing byte (little-endian)
+				break;
+			}
+			len += 8;
+		}
+		if (p + len + 8 > end) {
+			while (p + len < end && src[p + len] == src[candidate + len]) {
+				len++;
+			}
+		}
+		out = put_sequence(dst, dstCap, out, src + anchor, p - anchor, p - candidate, len);
+		if (out < 0) {
+			return 0;
+		}
+		p += len;
+		anchor = p;
+
+		// The bytes just before the next search can start a match too
+		if (p < srcLen - MATCH_LIMIT) {
+			table[(read32(src + p - 2) * 2654435761u) >> (32 - hashBits)] = p - 2;
+		}
+	}
+	out = put_sequence(dst, dstCap, out, src + anchor, srcLen - anchor, 0, 0);
+	return (out < 0 || out >= srcLen) ? 0 : out;
+}
+
+static int get_length(const uint8_t *src, int srcLen, int in, int *len) {
+	uint8_t byte;
+	do {
+		if (in >= srcLen) {
+			return -1;
+		}
+		byte = src[in++];
+		*len += byte;
+	} while (byte == 255);
+	return in;
+}
+
+// Expands a Compress_block() block into dst, returns its length or -1 if
+// it is malformed or expands past dstCap
+int Compress_expand(uint8_t *dst, int dstCap, const uint8_t *src, int srcLen) {
+	int in = 0;
+	int out = 0;
+	while (in < srcLen) {
+		int token = src[in++];
+		int literalLen = token >> 4;
+		if (literalLen == 15 && (in = get_length(src, srcLen, in, &literalLen)) < 0) {
+			return -1;
+		}
+		if (literalLen > srcLen - in || literalLen > dstCap - out) {
+			return -1;
+		}
+		memcpy(dst + out, src + in, literalLen);
+		in += literalLen;
+		out += literalLen;
+		if (in == srcLen) {
+			return out; // the last sequence has no match
+		}
+
+		if (srcLen - in < 2) {
+			return -1;
+		}
+		int offset = src[in] | (src[in + 1] << 8);
+		in += 2;
+		int matchLen = token & 15;
+		if (matchLen == 15 && (in = get_length(src, srcLen, in, &matchLen)) < 0) {
+			return -1;
+		}
+		matchLen += MIN_MATCH;
+		if (offset == 0 || offset > out || matchLen > dstCap - out) {
+			return -1;
+		}
+		const uint8_t *from = dst + out - offset;
+		if (offset >= matchLen) {
+			memcpy(dst + out, from, matchLen);
+		} else {
+			for (int i = 0; i < matchLen; i++) {
+				dst[out + i] = from[i]; // overlapping: repeats the last offset bytes
+			}
+		}
+		out += matchLen;
+	}
+	return out;
+}
+
+// ----- Packet Framing -----
+// Writes the payload for rawLen bytes of raw, returns its length (at most
+// rawLen + COMPRESS_HEADER_LEN)
+int Compress_packet(uint8_t *payload, const uint8_t *raw, int rawLen) {
+	uint16_t len = htons(rawLen);
+	memcpy(payload, &len, 2);
+	int packed = Compress_block(payload + COMPRESS_HEADER_LEN, rawLen - 1, raw, rawLen);
+	if (packed == 0) {
+		memcpy(payload + COMPRESS_HEADER_LEN, raw, rawLen);
+		packed = rawLen;
+	}
+	return COMPRESS_HEADER_LEN + packed;
+}
+
+// Expands one packet payload into raw, returns the raw length or -1
+int Compress_packet_expand(uint8_t *raw, int rawCap, const uint8_t *payload, int payloadLen) {
+	if (payloadLen < COMPRESS_HEADER_LEN) {
+		return -1;
+	}
+	int rawLen = Compress_raw_len(payload);
+	int bodyLen = payloadLen - COMPRESS_HEADER_LEN;
+	if (rawLen > rawCap || bodyLen > rawLen) {
+		return -1;
+	}
+	if (bodyLen == rawLen) {
+		memcpy(raw, payload + COMPRESS_HEADER_LEN, rawLen);
+		return rawLen;
+	}
+	return (Compress_expand(raw, rawLen, payload + COMPRESS_HEADER_LEN, bodyLen) == rawLen) ? rawLen : -1;
+}
+
+// File bytes a packet payload stands for
+int Compress_raw_len(const uint8_t *payload) {
+	uint16_t len;
+	memcpy(&len, payload, 2);
+	return ntohs(len);
+}
+
+// ----- Compressed Block Cache -----
+typedef struct {
+	char magic[8];
+	uint64_t sourceSize;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	uint32_t chunk;
+	uint32_t blockSize;
+	uint64_t regionSize;
+} CacheHeader;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t len;
+	uint32_t crc;    // CRC32C of the len bytes behind it
+	uint32_t pad;
+} RegionHeader;
+
+// Opens (or starts over) dir's cache for the file open on fileFd, cut into
+// blocks of blockSize file bytes that encode to at most maxBlockLen bytes
+int CompressCache_open(CompressCache *cache, const char *dir, int fileFd, int chunk, int blockSize, int maxBlockLen) {
+	cache->fd = -1;
+	cache->regionSize = 0;
+	struct stat fileStat;
+	if (dir == NULL || fstat(fileFd, &fileStat) < 0) {
+		return -1;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%llx-%llx-%d.lzc", dir,
+		(unsigned long long)fileStat.st_dev, (unsigned long long)fileStat.st_ino, chunk);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+
+	CacheHeader want;
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, CACHE_MAGIC, sizeof(want.magic));
+	want.sourceSize = fileStat.st_size;
+	want.mtimeSec = fileStat.st_mtim.tv_sec;
+	want.mtimeNsec = fileStat.st_mtim.tv_nsec;
+	want.chunk = chunk;
+	want.blockSize = blockSize;
+	want.regionSize = (sizeof(RegionHeader) + maxBlockLen + 4095) / 4096 * 4096;
+
+	// New, or made for another version of the file: start it over
+	CacheHeader have;
+	if (pread(fd, &have, sizeof(have), 0) != sizeof(have) || memcmp(&have, &want, sizeof(want)) != 0) {
+		if (ftruncate(fd, 0) < 0 || pwrite(fd, &want, sizeof(want), 0) != sizeof(want)) {
+			close(fd);
+			return -1;
+		}
+	}
+	cache->fd = fd;
+	cache->regionSize = want.regionSize;
+	return 0;
+}
+
+// Reads block's packets into dest, returns their length or 0 if the block
+// isn't cached (yet)
+int CompressCache_load(CompressCache *cache, uint32_t block, uint8_t *dest, int cap) {
+	if (cache->fd < 0) {
+		return 0;
+	}
+	off_t offset = CACHE_HEADER_LEN + (off_t)block * cache->regionSize;
+	RegionHeader header;
+	if (pread(cache->fd, &header, sizeof(header), offset) != sizeof(header) ||
+			header.magic != REGION_MAGIC || header.len == 0 || header.len > (uint32_t)cap) {
+		return 0;
+	}
+	if (pread(cache->fd, dest, header.len, offset + sizeof(header)) != (ssize_t)header.len ||
+			FastChecksum_crc32c(0, dest, header.len) != header.crc) {
+		return 0;
+	}
+	return header.len;
+}
+
+// Writes block's packets, the header last so no one loads it half written
+void CompressCache_store(CompressCache *cache, uint32_t block, const uint8_t *data, int len) {
+	if (cache->fd < 0) {
+		return;
+	}
+	off_t offset = CACHE_HEADER_LEN + (off_t)block * cache->regionSize;
+	RegionHeader header = { REGION_MAGIC, len, FastChecksum_crc32c(0, data, len), 0 };
+	if (pwrite(cache->fd, data, len, offset + sizeof(header)) == len) {
+		pwrite(cache->fd, &header, sizeof(header), offset);
+	}
+}
+
+void CompressCache_close(CompressCache *cache) {
+	if (cache->fd >= 0) {
+		close(cache->fd);
+	}
+	cache->fd = -1;
+}
@@ -0,0 +1,49 @@
+//
+// On-the-wire compression (rcopy -k): an LZ codec and its packet framing.
+//
+// The codec is LZ77 with LZ4's sequence layout: a token byte (literal count
+// in the high nibble, match length - 4 in the low one, 15 = more length
+// bytes follow), the literals, then a 2-byte little-endian match offset.
+// It is greedy with one hash table probe per position, so it trades ratio
+// for a few hundred MB/s per core, and blocks stay under 64 KB (offsets
+// and hash table entries are 16 bits).
+//
+// Every data packet is compressed on its own, so any packet can be expanded
+// without the ones before it and SREJ recovery works as before.  A packet
+// payload is the chunk's raw length (uint16, big-endian) followed by the
+// chunk compressed, or the chunk as is when compressing doesn't shrink it
+// (the body is then exactly the raw length).  A chunk is therefore
+// COMPRESS_HEADER_LEN bytes less than the transfer's payload size.
+//
+// CompressCache keeps the packets of whole-file transfers on disk, one
+// region per read-ahead block of the file, so a hot file is compressed once
+// and later transfers of it only read the regions back.  A cache file is
+// tied to the file's device, inode, size and mtime and to the chunk and
+// block size; a region only counts once its CRC32C checks out.
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdint.h>
+
+#define COMPRESS_LZ 1            // codec id in OPT_COMPRESS
+#define COMPRESS_HEADER_LEN 2    // raw length in front of every packet payload
+#define COMPRESS_MAX_INPUT 65535 // longest chunk one block may hold
+
+int Compress_block(uint8_t *dst, int dstCap, const uint8_t *src, int srcLen);
+int Compress_expand(uint8_t *dst, int dstCap, const uint8_t *src, int srcLen);
+int Compress_packet(uint8_t *payload, const uint8_t *raw, int rawLen);
+int Compress_packet_expand(uint8_t *raw, int rawCap, const uint8_t *payload, int payloadLen);
+int Compress_raw_len(const uint8_t *payload);
+
+typedef struct {
+	int fd;                 // -1 = no cache
+	uint64_t regionSize;    // bytes per block, header included (0 = never opened)
+} CompressCache;
+
+int CompressCache_open(CompressCache *cache, const char *dir, int fileFd, int chunk, int blockSize, int maxBlockLen);
+int CompressCache_load(CompressCache *cache, uint32_t block, uint8_t *dest, int cap);
+void CompressCache_store(CompressCache *cache, uint32_t block, const uint8_t *data, int len);
+void CompressCache_close(CompressCache *cache);
+
+#endif
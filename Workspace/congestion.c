@@ -0,0 +1,221 @@
+// ----- Congestion Control -----
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "congestion.h"
+#include "rttEstimator.h"
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+
+// ----- none: the whole window, always -----
+static void none_on_ack(CongestionControl *cc, uint32_t acked, uint64_t now, double srtt) {
+	(void)acked;
+	(void)now;
+	(void)srtt;
+	cc->cwnd = cc->maxCwnd;
+}
+
+static void none_on_event(CongestionControl *cc, uint64_t now) {
+	(void)cc;
+	(void)now;
+}
+
+
+// ----- reno: slow start, +1 packet per RTT, halve on loss -----
+static void reno_on_ack(CongestionControl *cc, uint32_t acked, uint64_t now, double srtt) {
+	(void)now;
+	(void)srtt;
+	if (cc->cwnd < cc->ssthresh) {
+		cc->cwnd += acked;
+	} else {
+		cc->cwnd += (double)acked / cc->cwnd;
+	}
+}
+
+static void reno_on_loss(CongestionControl *cc, uint64_t now) {
+	(void)now;
+	cc->ssthresh = cc->cwnd / 2;
+	if (cc->ssthresh < CC_MIN_CWND) {
+		cc->ssthresh = CC_MIN_CWND;
+	}
+	cc->cwnd = cc->ssthresh;
+}
+
+static void reno_on_timeout(CongestionControl *cc, uint64_t now) {
+	reno_on_loss(cc, now);
+	cc->cwnd = 1;
+}
+
+
+// ----- cubic: W(t) = C (t - K)^3 + Wmax, t since the last reduction -----
+static void cubic_on_ack(CongestionControl *cc, uint32_t acked, uint64_t now, double srtt) {
+	if (cc->cwnd < cc->ssthresh) {
+		cc->cwnd += acked;
+		return;
+	}
+
+	if (cc->epochStart == 0) {
+		cc->epochStart = now;
+		if (cc->cwnd < cc->wMax) {
+			cc->k = cbrt((cc->wMax - cc->cwnd) / CUBIC_C);
+		} else {
+			cc->k = 0;
+			cc->wMax = cc->cwnd;
+		}
+		cc->renoCwnd = cc->cwnd;
+	}
+
+	// Aim for where the curve will be one RTT from now
+	double t = (now - cc->epochStart + srtt) / 1e6 - cc->k;
+	double target = CUBIC_C * t * t * t + cc->wMax;
+	if (target > cc->cwnd) {
+		cc->cwnd += (target - cc->cwnd) * acked / cc->cwnd;
+	} else {
+		cc->cwnd += 0.01 * acked / cc->cwnd;
+	}
+
+	// Never slower than Reno with the same reduction factor
+	cc->renoCwnd += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cc->renoCwnd;
+	if (cc->renoCwnd > cc->cwnd) {
+		cc->cwnd = cc->renoCwnd;
+	}
+}
+
+static void cubic_on_loss(CongestionControl *cc, uint64_t now) {
+	(void)now;
+	// Fast convergence: give up bandwidth sooner if we lost before reaching the old peak
+	if (cc->cwnd < cc->wMax) {
+		cc->wMax = cc->cwnd * (1 + CUBIC_BETA) / 2;
+	} else {
+		cc->wMax = cc->cwnd;
+	}
+	cc->cwnd *= CUBIC_BETA;
+	if (cc->cwnd < CC_MIN_CWND) {
+		cc->cwnd = CC_MIN_CWND;
+	}
+	cc->ssthresh = cc->cwnd;
+	cc->epochStart = 0;
+}
+
+static void cubic_on_timeout(CongestionControl *cc, uint64_t now) {
+	cubic_on_loss(cc, now);
+	cc->cwnd = 1;
+}
+
+
+static const CongestionOps congestionOps[] = {
+	{"none", none_on_ack, none_on_event, none_on_event},
+	{"reno", reno_on_ack, reno_on_loss, reno_on_timeout},
+	{"cubic", cubic_on_ack, cubic_on_loss, cubic_on_timeout},
+};
+
+const CongestionOps *CongestionControl_find(const char *name) {
+	for (size_t i = 0; i < sizeof(congestionOps) / sizeof(congestionOps[0]); i++) {
+		if (strcmp(congestionOps[i].name, name) == 0) {
+			return &congestionOps[i];
+		}
+	}
+	return NULL;
+}
+
+int CongestionControl_init(CongestionControl *cc, const char *name, int windowSize) {
+	const CongestionOps *ops = CongestionControl_find(name);
+	if (ops == NULL) {
+		return -1;
+	}
+
+	memset(cc, 0, sizeof(CongestionControl));
+	cc->ops = ops;
+	cc->maxCwnd = windowSize;
+	cc->ssthresh = windowSize;
+	cc->cwnd = (ops->on_ack == none_on_ack) ? windowSize : CC_INITIAL_CWND;
+	if (cc->cwnd > cc->maxCwnd) {
+		cc->cwnd = cc->maxCwnd;
+	}
+	return 0;
+}
+
+// Packets that may be in flight right now
+uint32_t CongestionControl_window(CongestionControl *cc) {
+	return cc->cwnd < 1 ? 1 : (uint32_t)cc->cwnd;
+}
+
+// Keeps cwnd in range and records it for the summary / trace
+static void record(CongestionControl *cc, uint32_t inflight, int force) {
+	if (cc->cwnd > cc->maxCwnd) {
+		cc->cwnd = cc->maxCwnd;
+	} else if (cc->cwnd < 1) {
+		cc->cwnd = 1;
+	}
+	cc->cwndSum += cc->cwnd;
+	cc->cwndSamples++;
+	if (cc->cwnd > cc->cwndPeak) {
+		cc->cwndPeak = cc->cwnd;
+	}
+
+	// ACK driven changes are thinned to one line per millisecond
+	if (cc->trace != NULL) {
+		uint64_t now = RttEstimator_now();
+		if (force || now - cc->lastTrace >= 1000) {
+			fprintf(cc->trace, "%.3f %.2f %.2f %u\n", (now - cc->traceStart) / 1000.0,
+				cc->cwnd, cc->ssthresh, inflight);
+			cc->lastTrace = now;
+		}
+	}
+}
+
+// acked packets newly covered by the cumulative ACK, srtt in microseconds
+void CongestionControl_on_ack(CongestionControl *cc, uint32_t acked, uint32_t inflight, double srtt) {
+	cc->ops->on_ack(cc, acked, RttEstimator_now(), srtt);
+	record(cc, inflight, 0);
+}
+
+// The receiver reported lostSeq missing.  Only the first loss of a window
+// reduces cwnd, the rest were sent before we reacted (below recoverSeq).
+void CongestionControl_on_loss(CongestionControl *cc, uint32_t lostSeq, uint32_t nextSeq, uint32_t inflight) {
+	if (lostSeq < cc->recoverSeq) {
+		return;
+	}
+	cc->ops->on_loss(cc, RttEstimator_now());
+	cc->recoverSeq = nextSeq;
+	cc->lossEvents++;
+	record(cc, inflight, 1);
+}
+
+void CongestionControl_on_timeout(CongestionControl *cc, uint32_t nextSeq, uint32_t inflight) {
+	cc->ops->on_timeout(cc, RttEstimator_now());
+	cc->recoverSeq = nextSeq;
+	cc->timeouts++;
+	record(cc, inflight, 1);
+}
+
+// Starts logging cwnd over time to path
+int CongestionControl_trace(CongestionControl *cc, const char *path) {
+	cc->trace = fopen(path, "w");
+	if (cc->trace == NULL) {
+		return -1;
+	}
+	fprintf(cc->trace, "# %s: time_ms cwnd ssthresh inflight\n", cc->ops->name);
+	cc->traceStart = RttEstimator_now();
+	cc->lastTrace = 0;
+	record(cc, 0, 1);
+	return 0;
+}
+
+void CongestionControl_print(CongestionControl *cc, const char *who) {
+	double avg = cc->cwndSamples ? cc->cwndSum / cc->cwndSamples : cc->cwnd;
+	printf("[%s] cc: %s  cwnd now/avg/peak: %.1f/%.1f/%.1f  loss events: %llu  timeouts: %llu\n",
+		who, cc->ops->name, cc->cwnd, avg, cc->cwndPeak,
+		(unsigned long long)cc->lossEvents, (unsigned long long)cc->timeouts);
+}
+
+void CongestionControl_free(CongestionControl *cc) {
+	if (cc->trace != NULL) {
+		fclose(cc->trace);
+		cc->trace = NULL;
+	}
+}
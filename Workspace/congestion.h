@@ -0,0 +1,66 @@
+// 
+// Congestion control for the sliding-window sender.
+//
+// The CircularQueue window is the most the receiver will buffer; the
+// congestion window (cwnd, in packets) is how much of it may actually be
+// in flight.  Algorithms are a table of callbacks picked by name per
+// transfer:
+//   none   cwnd pinned at the window size (the original behaviour)
+//   reno   slow start + AIMD, halve on loss
+//   cubic  slow start + cubic growth around the last loss point
+// Every change to cwnd can be logged to a trace file for plotting.
+
+#ifndef __CONGESTION_H__
+#define __CONGESTION_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CC_INITIAL_CWND 10 // packets, like TCP's IW10
+#define CC_MIN_CWND 2
+#define CC_DEFAULT "reno"
+
+typedef struct CongestionControl CongestionControl;
+
+typedef struct {
+	const char *name;
+	void (*on_ack)(CongestionControl *cc, uint32_t acked, uint64_t now, double srtt);
+	void (*on_loss)(CongestionControl *cc, uint64_t now);
+	void (*on_timeout)(CongestionControl *cc, uint64_t now);
+} CongestionOps;
+
+struct CongestionControl {
+	const CongestionOps *ops;
+	double cwnd;          // packets
+	double ssthresh;
+	double maxCwnd;       // the receiver's window, cwnd never goes above
+	uint32_t recoverSeq;  // losses below this belong to the last reduction
+
+	// CUBIC state
+	double wMax;          // cwnd just before the last reduction
+	double k;             // seconds from the epoch until cwnd is back at wMax
+	uint64_t epochStart;  // microseconds, 0 = no epoch yet
+	double renoCwnd;      // what Reno would have by now (TCP-friendly region)
+
+	// Reporting
+	uint64_t lossEvents;   // loss episodes (one per window at most)
+	uint64_t timeouts;
+	double cwndSum;
+	uint64_t cwndSamples;
+	double cwndPeak;
+	FILE *trace;          // "time_ms cwnd ssthresh inflight" lines, optional
+	uint64_t traceStart;
+	uint64_t lastTrace;
+};
+
+const CongestionOps *CongestionControl_find(const char *name);
+int CongestionControl_init(CongestionControl *cc, const char *name, int windowSize);
+uint32_t CongestionControl_window(CongestionControl *cc);
+void CongestionControl_on_ack(CongestionControl *cc, uint32_t acked, uint32_t inflight, double srtt);
+void CongestionControl_on_loss(CongestionControl *cc, uint32_t lostSeq, uint32_t nextSeq, uint32_t inflight);
+void CongestionControl_on_timeout(CongestionControl *cc, uint32_t nextSeq, uint32_t inflight);
+int CongestionControl_trace(CongestionControl *cc, const char *path);
+void CongestionControl_print(CongestionControl *cc, const char *who);
+void CongestionControl_free(CongestionControl *cc);
+
+#endif
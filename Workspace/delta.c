@@ -0,0 +1,484 @@
+// ----- Delta Copies: Signatures and Matching -----
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "delta.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+// ----- Rolling Checksum -----
+void Rolling_init(RollingSum *sum, const uint8_t *data, int len) {
+	sum->a = 0;
+	sum->b = 0;
+	for (int i = 0; i < len; i++) {
+		sum->a += data[i];
+		sum->b += (uint32_t)(len - i) * data[i];
+	}
+}
+
+// Slides the window one byte on: out leaves at the front, in joins at the end
+void Rolling_roll(RollingSum *sum, uint8_t out, uint8_t in, int len) {
+	sum->a += in - out;
+	sum->b += sum->a - (uint32_t)len * out;
+}
+
+uint32_t Rolling_digest(RollingSum *sum) {
+	return (sum->a & 0xffff) | (sum->b << 16);
+}
+
+// ----- Strong Hash -----
+// 64-bit multiply/rotate hash (xxHash64's construction), several GB/s
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t word) {
+	acc += word * PRIME2;
+	return rotl64(acc, 31) * PRIME1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t lane) {
+	acc ^= round64(0, lane);
+	return acc * PRIME1 + PRIME4;
+}
+
+uint64_t Delta_strong(const uint8_t *data, int len) {
+	const uint8_t *p = data;
+	const uint8_t *end = data + len;
+	uint64_t h;
+	uint64_t word;
+
+	if (len >= 32) {
+		// Four independent lanes keep the multipliers busy
+		uint64_t v1 = PRIME1 + PRIME2;
+		uint64_t v2 = PRIME2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -PRIME1;
+		while (p + 32 <= end) {
+			memcpy(&word, p, 8);
+			v1 = round64(v1, le64toh(word));
+			memcpy(&word, p + 8, 8);
+			v2 = round64(v2, le64toh(word));
+			memcpy(&word, p + 16, 8);
+			v3 = round64(v3, le64toh(word));
+			memcpy(&word, p + 24, 8);
+			v4 = round64(v4, le64toh(word));
+			p += 32;
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = PRIME5;
+	}
+	h += len;
+
+	while (p + 8 <= end) {
+		memcpy(&word, p, 8);
+		h ^= round64(0, le64toh(word));
+		h = rotl64(h, 27) * PRIME1 + PRIME4;
+		p += 8;
+	}
+	while (p < end) {
+		h ^= *p++ * PRIME5;
+		h = rotl64(h, 11) * PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+// Writes the SIG_LEN byte signature of one block
+void Delta_signature(uint8_t *sig, const uint8_t *data, int len) {
+	RollingSum sum;
+	Rolling_init(&sum, data, len);
+	uint32_t weak = htobe32(Rolling_digest(&sum));
+	uint64_t strong = htobe64(Delta_strong(data, len));
+	memcpy(sig, &weak, 4);
+	memcpy(sig + 4, &strong, 8);
+}
+
+// rsync's choice: about the square root of the file, so signatures and
+// the data a changed byte costs grow together (a power of two here)
+int Delta_block_size(uint64_t size) {
+	int blockSize = DELTA_MIN_BLOCK;
+	while (blockSize < DELTA_MAX_BLOCK && (double)blockSize < sqrt((double)size)) {
+		blockSize *= 2;
+	}
+	return blockSize;
+}
+
+int Delta_threads(void) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1) {
+		return 1;
+	}
+	return (cores > DELTA_MAX_THREADS) ? DELTA_MAX_THREADS : cores;
+}
+
+// ----- Whole-File Digest -----
+// SHA-256 (FIPS 180-4), so a false block match can't slip through the way
+// it could past the 64-bit strong hash
+static const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+	return (x >> r) | (x << (32 - r));
+}
+
+// One 64-byte block into the state
+static void sha256_block(uint32_t *state, const uint8_t *block) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++) {
+		uint32_t word;
+		memcpy(&word, block + i * 4, 4);
+		w[i] = be32toh(word);
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+		uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+// Writes the DELTA_DIGEST_LEN byte SHA-256 of len bytes of data
+void Delta_sha256(uint8_t *digest, const uint8_t *data, uint64_t len) {
+	uint32_t state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	uint64_t done = 0;
+	for (; done + 64 <= len; done += 64) {
+		sha256_block(state, data + done);
+	}
+
+	// The rest, a 1 bit, zeros and the length in bits fill one or two more
+	uint8_t tail[128] = { 0 };
+	int rest = len - done;
+	memcpy(tail, data + done, rest);
+	tail[rest] = 0x80;
+	int tailLen = (rest < 56) ? 64 : 128;
+	uint64_t bits = htobe64(len * 8);
+	memcpy(tail + tailLen - 8, &bits, 8);
+	for (int i = 0; i < tailLen; i += 64) {
+		sha256_block(state, tail + i);
+	}
+	for (int i = 0; i < 8; i++) {
+		uint32_t word = htobe32(state[i]);
+		memcpy(digest + i * 4, &word, 4);
+	}
+}
+
+typedef struct {
+	uint8_t *leaves;
+	const uint8_t *data;
+	uint64_t len;
+	int blockSize;
+	uint32_t first;       // blocks [first, end) are this thread's
+	uint32_t end;
+} DigestTask;
+
+static void *digest_main(void *arg) {
+	DigestTask *task = arg;
+	for (uint32_t j = task->first; j < task->end; j++) {
+		uint64_t start = (uint64_t)j * task->blockSize;
+		uint64_t piece = (task->len - start < (uint64_t)task->blockSize) ? task->len - start : (uint64_t)task->blockSize;
+		Delta_sha256(task->leaves + (size_t)j * DELTA_DIGEST_LEN, task->data + start, piece);
+	}
+	return NULL;
+}
+
+// The digest of a whole file from its blocks' digests (in block order),
+// which the server's readers produce as they hash the signatures
+void Delta_file_digest(uint8_t *digest, const uint8_t *leaves, uint32_t count) {
+	Delta_sha256(digest, leaves, (uint64_t)count * DELTA_DIGEST_LEN);
+}
+
+// Same digest of len bytes of data cut into blockSize blocks, hashed by
+// threads threads.  Returns -1 if it can't get the memory.
+int Delta_data_digest(uint8_t *digest, const uint8_t *data, uint64_t len, int blockSize, int threads) {
+	uint32_t count = (len + blockSize - 1) / blockSize;
+	uint8_t *leaves = malloc((size_t)count * DELTA_DIGEST_LEN + 1);
+	if (leaves == NULL) {
+		return -1;
+	}
+	if (threads < 1 || threads > DELTA_MAX_THREADS) {
+		threads = 1;
+	}
+
+	DigestTask tasks[DELTA_MAX_THREADS];
+	pthread_t ids[DELTA_MAX_THREADS];
+	uint32_t share = (count + threads - 1) / threads;
+	int started = 0;
+	for (int t = 0; t < threads && (uint64_t)t * share < count; t++) {
+		tasks[t].leaves = leaves;
+		tasks[t].data = data;
+		tasks[t].len = len;
+		tasks[t].blockSize = blockSize;
+		tasks[t].first = t * share;
+		tasks[t].end = (tasks[t].first + share < count) ? tasks[t].first + share : count;
+		if (pthread_create(&ids[t], NULL, digest_main, &tasks[t]) != 0) {
+			digest_main(&tasks[t]);
+			ids[t] = 0;
+		}
+		started = t + 1;
+	}
+	for (int t = 0; t < started; t++) {
+		if (ids[t] != 0) {
+			pthread_join(ids[t], NULL);
+		}
+	}
+	Delta_file_digest(digest, leaves, count);
+	free(leaves);
+	return 0;
+}
+
+// ----- Index -----
+static inline uint32_t weak_hash(uint32_t weak) {
+	return weak * 0x9E3779B1u;
+}
+
+static inline int filter_test(DeltaIndex *index, uint32_t weak) {
+	uint32_t bit = weak_hash(weak) & index->filterMask;
+	return (index->filter[bit >> 6] >> (bit & 63)) & 1;
+}
+
+// Builds the lookup over sigs, the signatures of a sourceSize byte file
+int DeltaIndex_init(DeltaIndex *index, const uint8_t *sigs, uint64_t sourceSize, int blockSize) {
+	memset(index, 0, sizeof(DeltaIndex));
+	uint64_t count = (sourceSize + blockSize - 1) / blockSize;
+	if (count >= UINT32_MAX / 4) {
+		return -1;
+	}
+	index->blockCount = count;
+	index->blockSize = blockSize;
+	index->sourceSize = sourceSize;
+
+	uint32_t tableSize = 1024;
+	while (tableSize < 2 * count) {
+		tableSize *= 2;
+	}
+	uint32_t filterBits = 1 << 16;
+	while (filterBits < 16 * count && filterBits < (1U << 30)) {
+		filterBits *= 2;
+	}
+	index->weak = malloc((count + 1) * sizeof(uint32_t));
+	index->strong = malloc((count + 1) * sizeof(uint64_t));
+	index->alias = malloc((count + 1) * sizeof(uint32_t));
+	index->found = malloc((count + 1) * sizeof(int64_t));
+	index->table = calloc(tableSize, sizeof(uint32_t));
+	index->filter = calloc(filterBits / 64, sizeof(uint64_t));
+	if (!index->weak || !index->strong || !index->alias || !index->found || !index->table || !index->filter) {
+		DeltaIndex_free(index);
+		return -1;
+	}
+	index->tableMask = tableSize - 1;
+	index->filterMask = filterBits - 1;
+
+	for (uint32_t j = 0; j < count; j++) {
+		uint32_t weak;
+		uint64_t strong;
+		memcpy(&weak, sigs + (uint64_t)j * SIG_LEN, 4);
+		memcpy(&strong, sigs + (uint64_t)j * SIG_LEN + 4, 8);
+		index->weak[j] = be32toh(weak);
+		index->strong[j] = be64toh(strong);
+		index->alias[j] = j;
+		index->found[j] = -1;
+
+		// A short last block is only looked for where it is, not rolled for
+		if ((uint64_t)(j + 1) * blockSize > sourceSize) {
+			continue;
+		}
+
+		// Blocks that repeat (zeroed pages...) share one entry
+		uint32_t slot = weak_hash(index->weak[j]) & index->tableMask;
+		while (index->table[slot] != 0) {
+			uint32_t other = index->table[slot] - 1;
+			if (index->weak[other] == index->weak[j] && index->strong[other] == index->strong[j]) {
+				index->alias[j] = other;
+				break;
+			}
+			slot = (slot + 1) & index->tableMask;
+		}
+		if (index->alias[j] == j) {
+			index->table[slot] = j + 1;
+			uint32_t bit = weak_hash(index->weak[j]) & index->filterMask;
+			index->filter[bit >> 6] |= 1ULL << (bit & 63);
+		}
+	}
+	return 0;
+}
+
+typedef struct {
+	DeltaIndex *index;
+	const uint8_t *local;
+	uint64_t localLen;
+	uint64_t start;       // windows starting in [start, end) are this thread's
+	uint64_t end;
+} MatchTask;
+
+// Rolls a block-sized window over the task's part of the local file; on a
+// hit the window jumps a whole block, otherwise it moves on by one byte
+static void *match_main(void *arg) {
+	MatchTask *task = arg;
+	DeltaIndex *index = task->index;
+	const uint8_t *local = task->local;
+	int len = index->blockSize;
+	RollingSum sum;
+	int fresh = 1;
+
+	uint64_t p = task->start;
+	while (p < task->end && p + len <= task->localLen) {
+		if (fresh) {
+			Rolling_init(&sum, local + p, len);
+			fresh = 0;
+		}
+		uint32_t weak = Rolling_digest(&sum);
+		int matched = 0;
+		if (filter_test(index, weak)) {
+			uint64_t strong = 0;
+			int haveStrong = 0;
+			for (uint32_t slot = weak_hash(weak) & index->tableMask; index->table[slot] != 0; slot = (slot + 1) & index->tableMask) {
+				uint32_t j = index->table[slot] - 1;
+				if (index->weak[j] != weak) {
+					continue;
+				}
+				if (!haveStrong) {
+					strong = Delta_strong(local + p, len);
+					haveStrong = 1;
+				}
+				if (index->strong[j] == strong) {
+					// Any copy will do, the other threads may find one too
+					__atomic_store_n(&index->found[j], (int64_t)p, __ATOMIC_RELAXED);
+					matched = 1;
+					break;
+				}
+			}
+		}
+		if (matched) {
+			p += len;
+			fresh = 1;
+			continue;
+		}
+		if (p + len < task->localLen) {
+			Rolling_roll(&sum, local[p], local[p + len], len);
+		}
+		p++;
+	}
+	return NULL;
+}
+
+// Finds every source block in local (localLen bytes) with threads
+// threads, each rolling over its own stretch of the file
+void DeltaIndex_match(DeltaIndex *index, const uint8_t *local, uint64_t localLen, int threads) {
+	MatchTask tasks[DELTA_MAX_THREADS];
+	pthread_t ids[DELTA_MAX_THREADS];
+	if (threads < 1 || threads > DELTA_MAX_THREADS) {
+		threads = 1;
+	}
+	uint64_t share = (localLen + threads - 1) / threads;
+	if (share < (uint64_t)index->blockSize * 16) {
+		share = (uint64_t)index->blockSize * 16; // not worth a thread
+	}
+
+	int started = 0;
+	for (int t = 0; t < threads && (uint64_t)t * share < localLen; t++) {
+		tasks[t].index = index;
+		tasks[t].local = local;
+		tasks[t].localLen = localLen;
+		tasks[t].start = (uint64_t)t * share;
+		tasks[t].end = tasks[t].start + share;
+		if (pthread_create(&ids[t], NULL, match_main, &tasks[t]) != 0) {
+			match_main(&tasks[t]);
+			ids[t] = 0;
+		}
+		started = t + 1;
+	}
+	for (int t = 0; t < started; t++) {
+		if (ids[t] != 0) {
+			pthread_join(ids[t], NULL);
+		}
+	}
+
+	// The short last block, where it would be if the file only changed elsewhere
+	uint32_t last = index->blockCount - 1;
+	uint64_t lastStart = (uint64_t)last * index->blockSize;
+	if (index->blockCount > 0 && index->sourceSize - lastStart < (uint64_t)index->blockSize && index->sourceSize <= localLen) {
+		int lastLen = index->sourceSize - lastStart;
+		RollingSum sum;
+		Rolling_init(&sum, local + lastStart, lastLen);
+		if (Rolling_digest(&sum) == index->weak[last] && Delta_strong(local + lastStart, lastLen) == index->strong[last]) {
+			index->found[last] = lastStart;
+		}
+	}
+}
+
+// Blocks still to fetch, once repeats take their first copy's offset
+uint32_t DeltaIndex_missing(DeltaIndex *index) {
+	uint32_t missing = 0;
+	for (uint32_t j = 0; j < index->blockCount; j++) {
+		if (index->found[j] < 0) {
+			index->found[j] = index->found[index->alias[j]];
+		}
+		if (index->found[j] < 0) {
+			missing++;
+		}
+	}
+	return missing;
+}
+
+void DeltaIndex_free(DeltaIndex *index) {
+	free(index->weak);
+	free(index->strong);
+	free(index->alias);
+	free(index->found);
+	free(index->table);
+	free(index->filter);
+	memset(index, 0, sizeof(DeltaIndex));
+}
@@ -0,0 +1,67 @@
+//
+// Delta copies (rcopy -d): block signatures and finding blocks by them.
+//
+// The source is cut into blocks of one size, each summed up by a signature:
+// rsync's 32-bit rolling checksum (slides along a file one byte at a time
+// for two additions) and a 64-bit hash that confirms what the rolling sum
+// only suggests.  The server streams the signatures of its file, rcopy
+// looks for every block anywhere in the file it already has, shifted or
+// not, and only asks for the ones it can't find.
+//
+// On the wire a signature is SIG_LEN bytes: weak (uint32) then strong
+// (uint64), both big-endian.  Neither is cryptographic; they catch changed
+// data, not forged data.
+//
+// What rcopy puts together is checked end to end before it replaces the
+// old file: the EOF of the signatures carries the SHA-256 of the block
+// SHA-256s of the whole source (the readers hash their blocks in
+// parallel), and rcopy works out the same of its result.
+
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <stdint.h>
+
+#define SIG_LEN 12
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_MAX_THREADS 16
+#define DELTA_DIGEST_LEN 32   // SHA-256
+
+typedef struct {
+	uint32_t a;   // sum of the bytes
+	uint32_t b;   // sum of the bytes weighted by their distance to the end
+} RollingSum;
+
+void Rolling_init(RollingSum *sum, const uint8_t *data, int len);
+void Rolling_roll(RollingSum *sum, uint8_t out, uint8_t in, int len);
+uint32_t Rolling_digest(RollingSum *sum);
+uint64_t Delta_strong(const uint8_t *data, int len);
+void Delta_signature(uint8_t *sig, const uint8_t *data, int len);
+int Delta_block_size(uint64_t size);
+void Delta_sha256(uint8_t *digest, const uint8_t *data, uint64_t len);
+void Delta_file_digest(uint8_t *digest, const uint8_t *leaves, uint32_t count);
+int Delta_data_digest(uint8_t *digest, const uint8_t *data, uint64_t len, int blockSize, int threads);
+int Delta_threads(void);
+
+// rcopy's side: the source's signatures, looked up by rolling sum
+typedef struct {
+	uint32_t blockCount;
+	int blockSize;
+	uint64_t sourceSize;
+	uint32_t *weak;       // per source block
+	uint64_t *strong;
+	uint32_t *alias;      // first block with the same signature, itself if none
+	uint32_t *table;      // open addressing over distinct full blocks, block + 1, 0 = empty
+	uint32_t tableMask;
+	uint64_t *filter;     // one bit per hashed rolling sum, most misses stop here
+	uint32_t filterMask;
+	int64_t *found;       // offset in the local file holding the block, -1 = fetch it
+} DeltaIndex;
+
+int DeltaIndex_init(DeltaIndex *index, const uint8_t *sigs, uint64_t sourceSize, int blockSize);
+void DeltaIndex_match(DeltaIndex *index, const uint8_t *local, uint64_t localLen, int threads);
+uint32_t DeltaIndex_missing(DeltaIndex *index);
+void DeltaIndex_free(DeltaIndex *index);
+
+#endif
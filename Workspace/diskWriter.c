@@ -0,0 +1,198 @@
+// ----- Asynchronous File Writer -----
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "diskWriter.h"
+
+static void *writer_main(void *arg);
+
+// slots is rounded up to a power of two and capped at WRITER_MAX_BYTES
+int DiskWriter_init(DiskWriter *writer, int fd, uint32_t slots, int slotSize) {
+	memset(writer, 0, sizeof(DiskWriter));
+	uint32_t count = WRITER_MIN_SLOTS;
+	while (count < slots && (uint64_t)count * 2 * slotSize <= WRITER_MAX_BYTES) {
+		count *= 2;
+	}
+
+	writer->slots = malloc((size_t)count * slotSize);
+	writer->entries = calloc(count, sizeof(WriteEntry));
+	if (writer->slots == NULL || writer->entries == NULL) {
+		free(writer->slots);
+		free(writer->entries);
+		return -1;
+	}
+	writer->slotCount = count;
+	writer->mask = count - 1;
+	writer->slotSize = slotSize;
+	writer->fd = fd;
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->wake, NULL);
+	if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+		pthread_cond_destroy(&writer->wake);
+		pthread_mutex_destroy(&writer->lock);
+		free(writer->slots);
+		free(writer->entries);
+		writer->slots = NULL;
+		writer->entries = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+// Copies one payload into the ring for the writer, returns -1 (without
+// waiting) if the ring is full
+int DiskWriter_push(DiskWriter *writer, uint64_t offset, const uint8_t *data, int len) {
+	uint32_t head = writer->head;
+	uint32_t depth = head - __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE);
+	if (depth == writer->slotCount || len > writer->slotSize) {
+		writer->refused++;
+		return -1;
+	}
+
+	memcpy(writer->slots + (size_t)(head & writer->mask) * writer->slotSize, data, len);
+	writer->entries[head & writer->mask].offset = offset;
+	writer->entries[head & writer->mask].len = len;
+	if (depth + 1 > writer->peakDepth) {
+		writer->peakDepth = depth + 1;
+	}
+
+	// Publish, then wake the writer if it went to sleep on an empty ring.
+	// Both sides store then load (seq_cst), so one of them sees the other.
+	__atomic_store_n(&writer->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&writer->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&writer->lock);
+		pthread_cond_signal(&writer->wake);
+		pthread_mutex_unlock(&writer->lock);
+	}
+	return 0;
+}
+
+// Entries that can be pushed right now
+uint32_t DiskWriter_space(DiskWriter *writer) {
+	return writer->slotCount - (writer->head - __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE));
+}
+
+// Runs the writer couldn't get onto the disk so far
+uint64_t DiskWriter_errors(DiskWriter *writer) {
+	return __atomic_load_n(&writer->errors, __ATOMIC_ACQUIRE);
+}
+
+// Waits until everything pushed so far is written (end of a transfer)
+void DiskWriter_drain(DiskWriter *writer) {
+	while (__atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE) != writer->head) {
+		usleep(100);
+	}
+}
+
+void DiskWriter_print(DiskWriter *writer, const char *who) {
+	printf("[%s] writer: %llu pwritev  packets/write: %.2f  peak depth: %u of %u  full: %llu\n", who,
+		(unsigned long long)writer->writes,
+		writer->writes ? (double)writer->entriesWritten / writer->writes : 0.0,
+		writer->peakDepth, writer->slotCount, (unsigned long long)writer->refused);
+	if (writer->errors > 0) {
+		printf("ERROR: %llu writes to the output file failed.\n", (unsigned long long)writer->errors);
+	}
+}
+
+// Drains the ring, stops the writer thread and frees the ring
+void DiskWriter_free(DiskWriter *writer) {
+	if (writer->slots == NULL) {
+		return;
+	}
+	DiskWriter_drain(writer);
+	pthread_mutex_lock(&writer->lock);
+	__atomic_store_n(&writer->stop, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&writer->wake);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->wake);
+	free(writer->slots);
+	free(writer->entries);
+	writer->slots = NULL;
+	writer->entries = NULL;
+}
+
+// Writes count entries from tail on that continue each other as one
+// pwritev(), returns how many bytes came up short
+static uint64_t write_run(DiskWriter *writer, uint32_t tail, int count) {
+	struct iovec iovs[WRITER_IOV_MAX];
+	uint64_t total = 0;
+	for (int i = 0; i < count; i++) {
+		uint32_t index = (tail + i) & writer->mask;
+		iovs[i].iov_base = writer->slots + (size_t)index * writer->slotSize;
+		iovs[i].iov_len = writer->entries[index].len;
+		total += iovs[i].iov_len;
+	}
+
+	uint64_t offset = writer->entries[tail & writer->mask].offset;
+	ssize_t written = pwritev(writer->fd, iovs, count, offset);
+	writer->writes++;
+	if (written < 0) {
+		return total;
+	}
+
+	// Short write: carry on from where it stopped
+	uint64_t done = written;
+	int i = 0;
+	uint64_t skipped = 0;
+	while (done < total) {
+		while (skipped + iovs[i].iov_len <= done) {
+			skipped += iovs[i++].iov_len;
+		}
+		uint64_t within = done - skipped;
+		ssize_t more = pwrite(writer->fd, (uint8_t *)iovs[i].iov_base + within, iovs[i].iov_len - within, offset + done);
+		writer->writes++;
+		if (more <= 0) {
+			break;
+		}
+		done += more;
+	}
+	return total - done;
+}
+
+static void *writer_main(void *arg) {
+	DiskWriter *writer = arg;
+	uint32_t tail = writer->tail;
+
+	while (1) {
+		uint32_t head = __atomic_load_n(&writer->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (__atomic_load_n(&writer->stop, __ATOMIC_SEQ_CST)) {
+				break;
+			}
+			// Nothing queued: sleep until a push (or stop) wakes us
+			pthread_mutex_lock(&writer->lock);
+			__atomic_store_n(&writer->sleeping, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&writer->head, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&writer->stop, __ATOMIC_SEQ_CST)) {
+				pthread_cond_wait(&writer->wake, &writer->lock);
+			}
+			__atomic_store_n(&writer->sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&writer->lock);
+			continue;
+		}
+
+		// Everything queued, in runs of adjacent entries
+		while (tail != head) {
+			WriteEntry *first = &writer->entries[tail & writer->mask];
+			uint64_t end = first->offset + first->len;
+			int count = 1;
+			while (tail + count != head && count < WRITER_IOV_MAX && writer->entries[(tail + count) & writer->mask].offset == end) {
+				end += writer->entries[(tail + count) & writer->mask].len;
+				count++;
+			}
+			if (write_run(writer, tail, count) > 0) {
+				__atomic_add_fetch(&writer->errors, 1, __ATOMIC_RELEASE);
+			}
+			writer->entriesWritten += count;
+			tail += count;
+			__atomic_store_n(&writer->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,58 @@
+//
+// Asynchronous file writer for the receiver.
+//
+// The receive loop pushes (offset, payload) entries into a single-producer
+// single-consumer ring and never waits for the disk: a full ring just
+// refuses the entry.  A writer thread takes everything queued, coalesces
+// entries that continue each other into one pwritev() and frees their
+// slots.  Head and tail are each written by one side only, so the ring
+// needs no lock; the mutex is only there to put an idle writer to sleep.
+//
+// Free slots are what the receiver can still take without waiting, so
+// they double as the receive window it advertises.
+
+#ifndef __DISKWRITER_H__
+#define __DISKWRITER_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define WRITER_MAX_BYTES (64 * 1024 * 1024) // ring memory cap
+#define WRITER_MIN_SLOTS 16
+#define WRITER_IOV_MAX 64                  // entries per pwritev()
+
+typedef struct {
+	uint64_t offset;
+	int len;
+} WriteEntry;
+
+typedef struct {
+	uint8_t *slots;         // slotCount payloads of slotSize bytes
+	WriteEntry *entries;
+	uint32_t slotCount;     // power of two
+	uint32_t mask;
+	int slotSize;
+	int fd;
+	uint32_t head;          // next entry to fill, written by the receive loop only
+	uint32_t tail;          // next entry to write, written by the writer only
+	int sleeping;           // writer is (about to be) waiting on wake
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	uint64_t writes;        // pwritev() calls
+	uint64_t entriesWritten;
+	uint64_t errors;        // pwritev() runs that failed or came up short, written by the writer only
+	uint64_t refused;       // pushes into a full ring
+	uint32_t peakDepth;
+} DiskWriter;
+
+int DiskWriter_init(DiskWriter *writer, int fd, uint32_t slots, int slotSize);
+int DiskWriter_push(DiskWriter *writer, uint64_t offset, const uint8_t *data, int len);
+uint32_t DiskWriter_space(DiskWriter *writer);
+uint64_t DiskWriter_errors(DiskWriter *writer);
+void DiskWriter_drain(DiskWriter *writer);
+void DiskWriter_print(DiskWriter *writer, const char *who);
+void DiskWriter_free(DiskWriter *writer);
+
+#endif
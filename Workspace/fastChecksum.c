@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FASTCHECKSUM_X86
+#endif
+
+#include "fastChecksum.h"
+
+typedef uint64_t (*SumFunc)(uint64_t sum, const uint8_t *buf, int len);
+typedef uint64_t (*CopyFunc)(uint64_t sum, uint8_t *dst, const uint8_t *src, int len);
+typedef uint32_t (*CrcFunc)(uint32_t crc, const uint8_t *buf, int len);
+
+typedef struct {
+	const char *name;
+	SumFunc sum;
+	CopyFunc copy;
+	int (*supported)(void);
+} ChecksumKernel;
+
+static const ChecksumKernel *kernel;
+static CrcFunc crcKernel;
+static const char *crcName;
+static uint32_t crcTable[256];
+
+// Adds b to a with the carry wrapped around (one's complement)
+static inline uint64_t add_carry(uint64_t a, uint64_t b) {
+	a += b;
+	return a + (a < b);
+}
+
+// -----Scalar-----
+// Summing 32-bit words folds to the same 16-bit result as summing 16-bit
+// words, since 2^16 == 1 modulo 0xffff; the tail is padded with zeros
+static uint64_t sum_scalar(uint64_t sum, const uint8_t *buf, int len) {
+	uint64_t word;
+	while (len >= 8) {
+		memcpy(&word, buf, 8);
+		sum = add_carry(sum, (word & 0xffffffff) + (word >> 32));
+		buf += 8;
+		len -= 8;
+	}
+	if (len > 0) {
+		word = 0;
+		memcpy(&word, buf, len);
+		sum = add_carry(sum, (word & 0xffffffff) + (word >> 32));
+	}
+	return sum;
+}
+
+static uint64_t copy_scalar(uint64_t sum, uint8_t *dst, const uint8_t *src, int len) {
+	uint64_t word;
+	while (len >= 8) {
+		memcpy(&word, src, 8);
+		memcpy(dst, &word, 8);
+		sum = add_carry(sum, (word & 0xffffffff) + (word >> 32));
+		src += 8;
+		dst += 8;
+		len -= 8;
+	}
+	if (len > 0) {
+		word = 0;
+		memcpy(&word, src, len);
+		memcpy(dst, src, len);
+		sum = add_carry(sum, (word & 0xffffffff) + (word >> 32));
+	}
+	return sum;
+}
+
+static int always(void) {
+	return 1;
+}
+
+#ifdef FASTCHECKSUM_X86
+// -----SSE2-----
+// Each 32-bit lane is zero extended into a 64-bit accumulator, so nothing
+// can overflow for any length a PDU can have
+__attribute__((target("sse2")))
+static uint64_t sse2_reduce(__m128i acc) {
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	return add_carry(lanes[0], lanes[1]);
+}
+
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(uint64_t sum, const uint8_t *buf, int len) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero;
+	while (len >= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)buf);
+		__m128i b = _mm_loadu_si128((const __m128i *)(buf + 16));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+		buf += 32;
+		len -= 32;
+	}
+	sum = add_carry(sum, sse2_reduce(_mm_add_epi64(acc0, acc1)));
+	return sum_scalar(sum, buf, len);
+}
+
+__attribute__((target("sse2")))
+static uint64_t copy_sse2(uint64_t sum, uint8_t *dst, const uint8_t *src, int len) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero;
+	while (len >= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		_mm_storeu_si128((__m128i *)dst, a);
+		_mm_storeu_si128((__m128i *)(dst + 16), b);
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+		src += 32;
+		dst += 32;
+		len -= 32;
+	}
+	sum = add_carry(sum, sse2_reduce(_mm_add_epi64(acc0, acc1)));
+	return copy_scalar(sum, dst, src, len);
+}
+
+static int has_sse2(void) {
+	return __builtin_cpu_supports("sse2");
+}
+
+// -----AVX2-----
+__attribute__((target("avx2")))
+static uint64_t avx2_reduce(__m256i acc) {
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	return add_carry(add_carry(lanes[0], lanes[1]), add_carry(lanes[2], lanes[3]));
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(uint64_t sum, const uint8_t *buf, int len) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+	while (len >= 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)buf);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(buf + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+		buf += 64;
+		len -= 64;
+	}
+	sum = add_carry(sum, avx2_reduce(_mm256_add_epi64(acc0, acc1)));
+	// The tail is legacy-encoded SSE2: clear the upper halves first, or
+	// every SSE instruction after this pays the AVX/SSE transition penalty
+	_mm256_zeroupper();
+	return sum_sse2(sum, buf, len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t copy_avx2(uint64_t sum, uint8_t *dst, const uint8_t *src, int len) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+	while (len >= 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)src);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_storeu_si256((__m256i *)dst, a);
+		_mm256_storeu_si256((__m256i *)(dst + 32), b);
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+		src += 64;
+		dst += 64;
+		len -= 64;
+	}
+	sum = add_carry(sum, avx2_reduce(_mm256_add_epi64(acc0, acc1)));
+	_mm256_zeroupper(); // before the SSE2 tail, see sum_avx2
+	return copy_sse2(sum, dst, src, len);
+}
+
+static int has_avx2(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+// -----CRC32C (SSE4.2)-----
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *buf, int len) {
+	uint64_t crc64 = crc;
+	uint64_t word;
+	while (len >= 8) {
+		memcpy(&word, buf, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		buf += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (len-- > 0) {
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+	return crc;
+}
+#endif
+
+// -----CRC32C (table)-----
+static uint32_t crc_table(uint32_t crc, const uint8_t *buf, int len) {
+	while (len-- > 0) {
+		crc = crcTable[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// Widest first
+static const ChecksumKernel kernels[] = {
+#ifdef FASTCHECKSUM_X86
+	{ "avx2", sum_avx2, copy_avx2, has_avx2 },
+	{ "sse2", sum_sse2, copy_sse2, has_sse2 },
+#endif
+	{ "scalar", sum_scalar, copy_scalar, always },
+};
+
+static void select_kernels(void) {
+	for (int i = 0; kernel == NULL; i++) {
+		if (kernels[i].supported()) {
+			kernel = &kernels[i];
+		}
+	}
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		}
+		crcTable[i] = crc;
+	}
+	crcKernel = crc_table;
+	crcName = "table";
+#ifdef FASTCHECKSUM_X86
+	if (__builtin_cpu_supports("sse4.2")) {
+		crcKernel = crc_sse42;
+		crcName = "sse4.2";
+	}
+#endif
+}
+
+// Forces a checksum (avx2, sse2, scalar) or CRC32C (sse4.2, table)
+// kernel by name, returns -1 if this CPU can't run it
+int FastChecksum_use(const char *name) {
+	if (crcKernel == NULL) {
+		select_kernels();
+	}
+	if (strcmp(name, "table") == 0) {
+		crcKernel = crc_table;
+		crcName = "table";
+		return 0;
+	}
+#ifdef FASTCHECKSUM_X86
+	if (strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+		crcKernel = crc_sse42;
+		crcName = "sse4.2";
+		return 0;
+	}
+#endif
+	for (int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (strcmp(kernels[i].name, name) == 0 && kernels[i].supported()) {
+			kernel = &kernels[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *FastChecksum_name(void) {
+	if (crcKernel == NULL) {
+		select_kernels();
+	}
+	return kernel->name;
+}
+
+const char *FastChecksum_crc32c_name(void) {
+	if (crcKernel == NULL) {
+		select_kernels();
+	}
+	return crcName;
+}
+
+// Adds len bytes to a running sum, buf must sit at an even offset of the PDU
+uint64_t FastChecksum_add(uint64_t sum, const uint8_t *buf, int len) {
+	if (kernel == NULL) {
+		select_kernels();
+	}
+	return kernel->sum(sum, buf, len);
+}
+
+// Copies len bytes to dst and adds them to the sum on the way
+uint64_t FastChecksum_copy(uint64_t sum, uint8_t *dst, const uint8_t *src, int len) {
+	if (kernel == NULL) {
+		select_kernels();
+	}
+	return kernel->copy(sum, dst, src, len);
+}
+
+// The 16-bit checksum to store in a PDU; over a PDU that already carries
+// its checksum this is 0 when the PDU is intact
+uint16_t FastChecksum_fold(uint64_t sum) {
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t)~sum;
+}
+
+// RFC 1624 eqn. 3: the checksum after one 16-bit word of the PDU changed,
+// HC' = ~(~HC + ~m + m')
+uint16_t FastChecksum_update(uint16_t cksum, uint16_t oldWord, uint16_t newWord) {
+	uint32_t sum = (uint16_t)~cksum + (uint16_t)~oldWord + newWord;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+// a * b modulo the CRC32C polynomial, bit reflected (as zlib does it)
+static uint32_t crc_multiply(uint32_t a, uint32_t b) {
+	uint32_t m = 1u << 31;
+	uint32_t p = 0;
+	while (m != 0) {
+		if (a & m) {
+			p ^= b;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ 0x82f63b78 : b >> 1;
+	}
+	return p;
+}
+
+// x^(8 * bytes) modulo the polynomial, i.e. what running bytes zeros
+// through the CRC does to it
+static uint32_t crc_zeros(int bytes) {
+	uint32_t square = 1u << 30; // x^1, then x^2, x^4, ...
+	uint32_t p = 1u << 31;      // x^0
+	uint64_t bits = (uint64_t)bytes * 8;
+	while (bits != 0) {
+		if (bits & 1) {
+			p = crc_multiply(square, p);
+		}
+		square = crc_multiply(square, square);
+		bits >>= 1;
+	}
+	return p;
+}
+
+// The CRC32C after one byte followed by after more bytes changed.  CRCs are
+// linear, so only the difference has to be run through the remaining
+// length; retransmits all have the same length, so its power is kept
+// (per thread, server workers each keep their own).
+uint32_t FastChecksum_crc32c_update(uint32_t crc, uint8_t oldByte, uint8_t newByte, int after) {
+	static __thread int cachedAfter = -1;
+	static __thread uint32_t cachedZeros;
+	if (crcKernel == NULL) {
+		select_kernels();
+	}
+	if (after != cachedAfter) {
+		cachedZeros = crc_zeros(after);
+		cachedAfter = after;
+	}
+	return crc ^ crc_multiply(cachedZeros, crcTable[oldByte ^ newByte]);
+}
+
+// Continues a CRC32C the way zlib's crc32() does: start with 0 and feed
+// the result of one call into the next to cover data in pieces
+uint32_t FastChecksum_crc32c(uint32_t crc, const uint8_t *buf, int len) {
+	if (crcKernel == NULL) {
+		select_kernels();
+	}
+	return ~crcKernel(~crc, buf, len);
+}
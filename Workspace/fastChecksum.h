@@ -0,0 +1,35 @@
+//
+// Internet checksum (RFC 1071) and CRC32C kernels for the PDU path.
+//
+// FastChecksum_add() keeps a running 64-bit sum that folds to the same
+// 16-bit result in_cksum() gives, so a PDU can be summed piece by piece
+// (each piece starting at an even offset of the PDU).  FastChecksum_copy()
+// does the same while copying the bytes, one pass over the payload instead
+// of a memcpy followed by a checksum.
+//
+// The widest kernel the CPU has (AVX2, SSE2, else 64-bit scalar) is picked
+// on first use; FastChecksum_use() forces one, e.g. for checksumBench.
+// FastChecksum_crc32c() uses the SSE4.2 crc32 instruction when present and
+// a table otherwise.
+//
+// The _update() calls patch a checksum or CRC after a few bytes changed
+// (e.g. a retransmit's flag) without reading the rest of the PDU again.
+
+#ifndef __FASTCHECKSUM_H__
+#define __FASTCHECKSUM_H__
+
+#include <stdint.h>
+
+uint64_t FastChecksum_add(uint64_t sum, const uint8_t *buf, int len);
+uint64_t FastChecksum_copy(uint64_t sum, uint8_t *dst, const uint8_t *src, int len);
+uint16_t FastChecksum_fold(uint64_t sum);
+uint16_t FastChecksum_update(uint16_t cksum, uint16_t oldWord, uint16_t newWord);
+
+uint32_t FastChecksum_crc32c(uint32_t crc, const uint8_t *buf, int len);
+uint32_t FastChecksum_crc32c_update(uint32_t crc, uint8_t oldByte, uint8_t newByte, int after);
+
+int FastChecksum_use(const char *name);
+const char *FastChecksum_name(void);
+const char *FastChecksum_crc32c_name(void);
+
+#endif
@@ -0,0 +1,411 @@
+// ----- Forward Error Correction: Parity Groups -----
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fec.h"
+#include "functions.h"
+
+#define GF_POLY 0x11d   // x^8 + x^4 + x^3 + x^2 + 1, 2 generates the field
+
+// ----- GF(2^8) Arithmetic -----
+static uint8_t gfExp[512];          // 2^i, twice over so log sums need no modulo
+static uint8_t gfLog[256];
+static uint8_t gfMul[256][256];     // a row per constant: one lookup per byte
+static pthread_once_t gfOnce = PTHREAD_ONCE_INIT;
+
+static void gf_init(void) {
+	int x = 1;
+	for (int i = 0; i < 255; i++) {
+		gfExp[i] = x;
+		gfExp[i + 255] = x;
+		gfLog[x] = i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= GF_POLY;
+		}
+	}
+	gfExp[510] = gfExp[0];
+	gfExp[511] = gfExp[1];
+	for (int a = 1; a < 256; a++) {
+		for (int b = 1; b < 256; b++) {
+			gfMul[a][b] = gfExp[gfLog[a] + gfLog[b]];
+		}
+	}
+}
+
+static inline uint8_t gf_inverse(uint8_t a) {
+	return gfExp[255 - gfLog[a]];
+}
+
+// acc ^= coef * data, len bytes
+static void gf_add(uint8_t *acc, uint8_t coef, const uint8_t *data, int len) {
+	int i = 0;
+	if (coef == 1) {
+		for (; i + 8 <= len; i += 8) {
+			uint64_t a;
+			uint64_t d;
+			memcpy(&a, acc + i, 8);
+			memcpy(&d, data + i, 8);
+			a ^= d;
+			memcpy(acc + i, &a, 8);
+		}
+		for (; i < len; i++) {
+			acc[i] ^= data[i];
+		}
+		return;
+	}
+	const uint8_t *row = gfMul[coef];
+	for (; i < len; i++) {
+		acc[i] ^= row[data[i]];
+	}
+}
+
+// Adds one packet, as [uint16 length][payload], to coded bytes with weight coef
+static void code_packet(uint8_t *coded, uint8_t coef, const uint8_t *payload, int len) {
+	uint8_t lenBytes[2] = { len >> 8, len & 0xff };
+	gf_add(coded, coef, lenBytes, 2);
+	gf_add(coded + 2, coef, payload, len);
+}
+
+// Weight of the group's packet i in parity index
+static inline uint8_t coefficient(int index, int i) {
+	return (index == 0) ? 1 : gfExp[i];
+}
+
+// ----- Encoder (server) -----
+int FecEncoder_init(FecEncoder *fec, int bufferSize, int headerLen, int windowSize) {
+	pthread_once(&gfOnce, gf_init);
+	memset(fec, 0, sizeof(FecEncoder));
+	fec->parityLen = FEC_PARITY_OVERHEAD + bufferSize;
+	fec->headerLen = headerLen;
+	fec->lossRate = -1;
+	fec->slot = -1;
+
+	// A group has to fit in the window with room to spare, or its parity
+	// could only go out once the losses it covers were long reported
+	fec->maxGroup = (windowSize / 2 < FEC_MAX_GROUP) ? windowSize / 2 : FEC_MAX_GROUP;
+	if (fec->maxGroup < 2) {
+		fec->maxGroup = 0;
+		return 0;
+	}
+	fec->groupSize = (FEC_FIRST_GROUP < fec->maxGroup) ? FEC_FIRST_GROUP : fec->maxGroup;
+	fec->parities = 1;
+	fec->groups = malloc((size_t)FEC_GROUP_SLOTS * FEC_MAX_PARITY * fec->parityLen);
+	return (fec->groups != NULL) ? 0 : -1;
+}
+
+static uint8_t *parity_payload(FecEncoder *fec, int slot, int index) {
+	return fec->groups + ((size_t)slot * FEC_MAX_PARITY + index) * fec->parityLen;
+}
+
+// Codes a new data packet into the open group (opening one if there is
+// none), returns 1 once the group is full and its parity should go out
+int FecEncoder_add(FecEncoder *fec, uint32_t seq, const uint8_t *payload, int len) {
+	fec->sent++;
+	fec->dataPackets++;
+	if (fec->count == 0) {
+		if (fec->parities == 0) {
+			return 0;
+		}
+		// Earlier groups' parity may still be queued on the batch, take the next slot
+		fec->slot = (fec->slot + 1) % FEC_GROUP_SLOTS;
+		fec->first = seq;
+		fec->size = fec->groupSize;
+		fec->openParities = fec->parities;
+		fec->longest = 0;
+		for (int j = 0; j < fec->openParities; j++) {
+			memset(parity_payload(fec, fec->slot, j), 0, fec->parityLen);
+		}
+	}
+	for (int j = 0; j < fec->openParities; j++) {
+		code_packet(parity_payload(fec, fec->slot, j) + FEC_HEADER_LEN, coefficient(j, fec->count), payload, len);
+	}
+	if (len > fec->longest) {
+		fec->longest = len;
+	}
+	fec->count++;
+	return fec->count == fec->size;
+}
+
+// Queues the open group's parity on batch (flag 19) and closes the group,
+// also when it is short (the data ran out)
+void FecEncoder_send(FecEncoder *fec, SendBatch *batch) {
+	if (fec->count == 0) {
+		return;
+	}
+	int payloadLen = FEC_HEADER_LEN + 2 + fec->longest;
+	for (int j = 0; j < fec->openParities; j++) {
+		uint8_t *payload = parity_payload(fec, fec->slot, j);
+		payload[0] = fec->count;
+		payload[1] = fec->openParities;
+		payload[2] = j;
+		uint8_t *header = SendBatch_header(batch);
+		int headerLen = createDataPDUHeader(header, fec->first, 19, payload, payloadLen, fec->headerLen);
+		SendBatch_addv(batch, header, headerLen, payload, payloadLen);
+	}
+	fec->parityPackets += fec->openParities;
+	fec->count = 0;
+}
+
+// The group size and parity count for a loss rate: about one loss in five
+// groups with a single parity, past 2.5% two parities and about one loss
+// in two groups
+static void choose(FecEncoder *fec) {
+	double p = fec->lossRate;
+	double size;
+	if (p < FEC_OFF_LOSS) {
+		fec->parities = 0;
+		return;
+	} else if (p < 0.025) {
+		fec->parities = 1;
+		size = 0.2 / p;
+	} else {
+		fec->parities = 2;
+		size = 0.8 / p;
+	}
+	fec->groupSize = (int)(size + 0.5);
+	if (fec->groupSize > fec->maxGroup) {
+		fec->groupSize = fec->maxGroup;
+	}
+	if (fec->groupSize < FEC_MIN_GROUP) {
+		fec->groupSize = (fec->maxGroup < FEC_MIN_GROUP) ? fec->maxGroup : FEC_MIN_GROUP;
+	}
+}
+
+// An ACK pass heard about lost packets (reported for a resend) and the
+// receiver's running count of rebuilt ones: both were losses on the way,
+// every FEC_ADAPT_PACKETS new packets they make a loss rate sample
+void FecEncoder_feedback(FecEncoder *fec, uint32_t lost, uint32_t recovered) {
+	if (fec->maxGroup == 0) {
+		return;
+	}
+	fec->lost += lost;
+	if (recovered > fec->recovered) {
+		fec->lost += recovered - fec->recovered;
+		fec->recovered = recovered;
+	}
+	if (fec->sent < FEC_ADAPT_PACKETS) {
+		return;
+	}
+	double sample = (double)fec->lost / fec->sent;
+	if (sample > 1) {
+		sample = 1;
+	}
+	fec->lossRate = (fec->lossRate < 0) ? sample : 0.75 * fec->lossRate + 0.25 * sample;
+	fec->sent = 0;
+	fec->lost = 0;
+	choose(fec);
+}
+
+void FecEncoder_print(FecEncoder *fec, const char *who) {
+	printf("[%s] FEC: %llu parity packets for %llu data packets (%.1f%%), loss seen %.2f%%, groups now %d + %d parity\n", who,
+		(unsigned long long)fec->parityPackets, (unsigned long long)fec->dataPackets,
+		(fec->dataPackets > 0) ? 100.0 * fec->parityPackets / fec->dataPackets : 0.0,
+		(fec->lossRate > 0) ? 100.0 * fec->lossRate : 0.0, fec->groupSize, fec->parities);
+}
+
+void FecEncoder_free(FecEncoder *fec) {
+	free(fec->groups);
+	fec->groups = NULL;
+}
+
+// ----- Decoder (rcopy) -----
+// The ring reaches a group behind the window: a lost packet keeps the
+// sender's base at or below it, so nothing that would reuse a slot of its
+// group can have been sent yet
+int FecDecoder_init(FecDecoder *fec, int windowSize, int bufferSize) {
+	pthread_once(&gfOnce, gf_init);
+	memset(fec, 0, sizeof(FecDecoder));
+	uint32_t ringSize = windowSize + FEC_MAX_GROUP;
+	fec->bufferSize = bufferSize;
+	fec->parityLen = FEC_PARITY_OVERHEAD + bufferSize;
+	fec->span = FEC_FIRST_GROUP + 1;
+	fec->slots = malloc((size_t)ringSize * bufferSize);
+	fec->lens = calloc(ringSize, sizeof(int));
+	fec->seqs = calloc(ringSize, sizeof(uint32_t));
+	fec->held = malloc((size_t)FEC_HELD * fec->parityLen);
+	fec->syndromes = malloc((size_t)FEC_MAX_PARITY * fec->parityLen);
+	if (!fec->slots || !fec->lens || !fec->seqs || !fec->held || !fec->syndromes) {
+		FecDecoder_free(fec);
+		return -1;
+	}
+	fec->ringSize = ringSize;
+	return 0;
+}
+
+static inline int has_packet(FecDecoder *fec, uint32_t seq) {
+	return fec->seqs[seq % fec->ringSize] == seq;
+}
+
+// Keeps a data payload, as it came off the wire, for the groups it is in
+void FecDecoder_store(FecDecoder *fec, uint32_t seq, const uint8_t *payload, int len) {
+	if (fec->ringSize == 0 || len > fec->bufferSize) {
+		return;
+	}
+	uint32_t slot = seq % fec->ringSize;
+	if (fec->seqs[slot] == seq) {
+		return;
+	}
+	memcpy(fec->slots + (size_t)slot * fec->bufferSize, payload, len);
+	fec->lens[slot] = len;
+	fec->seqs[slot] = seq;
+}
+
+// Puts a rebuilt packet, [uint16 length][payload] as coded, in the ring
+// and queues it for the receive path
+static void put_rebuilt(FecDecoder *fec, uint32_t seq, const uint8_t *coded, int codedLen) {
+	int len = (coded[0] << 8) | coded[1];
+	if (len > codedLen - 2 || len > fec->bufferSize || fec->queueCount == FEC_QUEUE) {
+		return; // doesn't add up, the resend will have to do
+	}
+	FecDecoder_store(fec, seq, coded + 2, len);
+	fec->queue[(fec->queueHead + fec->queueCount) % FEC_QUEUE] = seq;
+	fec->queueCount++;
+	fec->rebuilt++;
+}
+
+// Takes the parity's coded bytes as the syndrome of the group's missing
+// packets: everything the packets we have put in is taken out again
+static int syndrome(FecDecoder *fec, uint8_t *out, uint32_t first, int count, int index, const uint8_t *coded, int codedLen) {
+	memcpy(out, coded, codedLen);
+	for (int i = 0; i < count; i++) {
+		uint32_t slot = (first + i) % fec->ringSize;
+		if (fec->seqs[slot] != first + i) {
+			continue;
+		}
+		if (fec->lens[slot] > codedLen - 2) {
+			return -1; // not the group the parity was made from
+		}
+		code_packet(out, coefficient(index, i), fec->slots + (size_t)slot * fec->bufferSize, fec->lens[slot]);
+	}
+	return 0;
+}
+
+// A parity PDU (flag 19) for the group starting at first: rebuilds what the
+// group is missing if it can, or holds on to it until the group's other
+// parity comes.  Returns the packets rebuilt, FecDecoder_take hands them out
+int FecDecoder_parity(FecDecoder *fec, uint32_t first, const uint8_t *payload, int len) {
+	if (fec->ringSize == 0) {
+		return 0;
+	}
+	fec->parityPackets++;
+	if (len < FEC_PARITY_OVERHEAD || len > fec->parityLen) {
+		return 0;
+	}
+	int count = payload[0];
+	int parities = payload[1];
+	int index = payload[2];
+	if (count == 0 || count > FEC_MAX_GROUP || parities == 0 || parities > FEC_MAX_PARITY || index >= parities) {
+		return 0;
+	}
+	fec->span = count + parities;
+
+	int missing[FEC_MAX_PARITY];
+	int missingCount = 0;
+	for (int i = 0; i < count; i++) {
+		if (!has_packet(fec, first + i)) {
+			if (missingCount < FEC_MAX_PARITY) {
+				missing[missingCount] = i;
+			}
+			missingCount++;
+		}
+	}
+	if (missingCount == 0) {
+		return 0;
+	}
+	if (missingCount > parities) {
+		fec->shortfalls++;
+		return 0;
+	}
+
+	const uint8_t *coded = payload + FEC_HEADER_LEN;
+	int codedLen = len - FEC_HEADER_LEN;
+	uint8_t *s = fec->syndromes;
+	int h = first % FEC_HELD;
+
+	// One lost: either parity alone will do
+	if (missingCount == 1) {
+		if (syndrome(fec, s, first, count, index, coded, codedLen) < 0) {
+			return 0;
+		}
+		if (index == 1) {
+			uint8_t scale = gf_inverse(gfExp[missing[0]]); // Q = 2^x * D
+			uint8_t *row = gfMul[scale];
+			for (int i = 0; i < codedLen; i++) {
+				s[i] = row[s[i]];
+			}
+		}
+		put_rebuilt(fec, first + missing[0], s, codedLen);
+		return 1;
+	}
+
+	// Two lost: P and Q together, the first of them to come waits here
+	if (fec->heldLen[h] != len || fec->heldFirst[h] != first || fec->held[(size_t)h * fec->parityLen + 2] == index) {
+		memcpy(fec->held + (size_t)h * fec->parityLen, payload, len);
+		fec->heldFirst[h] = first;
+		fec->heldLen[h] = len;
+		return 0;
+	}
+	const uint8_t *p = (index == 0) ? coded : fec->held + (size_t)h * fec->parityLen + FEC_HEADER_LEN;
+	const uint8_t *q = (index == 1) ? coded : fec->held + (size_t)h * fec->parityLen + FEC_HEADER_LEN;
+	fec->heldLen[h] = 0;
+	uint8_t *sp = s;
+	uint8_t *sq = s + fec->parityLen;
+	if (syndrome(fec, sp, first, count, 0, p, codedLen) < 0 || syndrome(fec, sq, first, count, 1, q, codedLen) < 0) {
+		return 0;
+	}
+
+	// P' = Dx + Dy and Q' = 2^x Dx + 2^y Dy, so
+	// Dx = (Q' + 2^y P') / (2^x + 2^y) and Dy = P' + Dx
+	int x = missing[0];
+	int y = missing[1];
+	uint8_t denominator = gf_inverse(gfExp[x] ^ gfExp[y]);
+	uint8_t *qRow = gfMul[denominator];
+	uint8_t *pRow = gfMul[gfMul[gfExp[y]][denominator]];
+	for (int i = 0; i < codedLen; i++) {
+		uint8_t dx = qRow[sq[i]] ^ pRow[sp[i]];
+		sq[i] = dx;
+		sp[i] ^= dx;
+	}
+	put_rebuilt(fec, first + x, sq, codedLen);
+	put_rebuilt(fec, first + y, sp, codedLen);
+	return 2;
+}
+
+// Next packet the parity rebuilt (its payload in the ring), NULL if none
+uint8_t *FecDecoder_take(FecDecoder *fec, uint32_t *seq, int *len) {
+	while (fec->queueCount > 0) {
+		uint32_t next = fec->queue[fec->queueHead];
+		fec->queueHead = (fec->queueHead + 1) % FEC_QUEUE;
+		fec->queueCount--;
+		uint32_t slot = next % fec->ringSize;
+		if (fec->seqs[slot] == next) {
+			*seq = next;
+			*len = fec->lens[slot];
+			return fec->slots + (size_t)slot * fec->bufferSize;
+		}
+	}
+	return NULL;
+}
+
+void FecDecoder_print(FecDecoder *fec, const char *who) {
+	printf("[%s] FEC: %llu parity packets, %llu packets rebuilt, %llu groups lost more than their parity covers\n", who,
+		(unsigned long long)fec->parityPackets, (unsigned long long)fec->rebuilt, (unsigned long long)fec->shortfalls);
+}
+
+void FecDecoder_free(FecDecoder *fec) {
+	free(fec->slots);
+	free(fec->lens);
+	free(fec->seqs);
+	free(fec->held);
+	free(fec->syndromes);
+	fec->slots = NULL;
+	fec->lens = NULL;
+	fec->seqs = NULL;
+	fec->held = NULL;
+	fec->syndromes = NULL;
+	fec->ringSize = 0;
+}
@@ -0,0 +1,103 @@
+//
+// Forward error correction (rcopy -f): parity packets over groups of new
+// data packets, so a loss is rebuilt at the receiver instead of costing a
+// SACK/SREJ round trip.
+//
+// The server closes a group every groupSize new data packets (flag 16) and
+// sends its parity right behind the last one as flag 19 PDUs.  Parity 0 is
+// the XOR of the group's packets, parity 1 their Reed-Solomon syndrome over
+// GF(2^8) (RAID-6's Q, packet i weighted by 2^i), so a group that has both
+// survives any two losses.  Each packet is coded as its payload length
+// (uint16, big-endian) and payload, zero padded to the group's longest.
+// A parity PDU's sequence field is the group's first sequence number and
+// its payload is the packet count, the group's parity count, the parity's
+// index and the coded bytes, at most FEC_PARITY_OVERHEAD bytes more than a
+// data payload.  Retransmissions are never coded, parity doesn't take a
+// sequence number and is never resent.
+//
+// The receiver keeps every data payload (as received, compressed with -k)
+// in a ring a window and a group long.  A parity whose group is missing no
+// more packets than it has parities rebuilds them there, and they go through
+// the receive path as if they had just arrived; holes are only reported once
+// the group's parity had its chance.  Every RR/SACK tells the server how
+// many packets were rebuilt so far, which together with the losses it hears
+// about is the loss rate the group size and parity count follow.
+
+#ifndef __FEC_H__
+#define __FEC_H__
+
+#include <stdint.h>
+
+#include "batchIO.h"
+
+#define FEC_MIN_GROUP 4        // smallest group (most parity per packet)
+#define FEC_MAX_GROUP 64       // largest group, and how far receivers keep data past the window
+#define FEC_FIRST_GROUP 16     // before the loss rate is known
+#define FEC_MAX_PARITY 2       // P (XOR) and Q (Reed-Solomon)
+#define FEC_HEADER_LEN 3       // count, parities, index in front of the coded bytes
+#define FEC_PARITY_OVERHEAD (FEC_HEADER_LEN + 2) // a parity payload past the data payload size
+#define FEC_ADAPT_PACKETS 256  // new packets per loss rate sample
+#define FEC_OFF_LOSS 0.001     // below this loss rate no parity is sent
+#define FEC_GROUP_SLOTS 24     // groups whose parity can be queued on one send batch
+#define FEC_HELD 64            // parity kept for a second one of its group (receiver)
+#define FEC_QUEUE 256          // rebuilt packets waiting for the receive path
+
+typedef struct {
+	uint8_t *groups;        // FEC_GROUP_SLOTS x FEC_MAX_PARITY parity payloads of parityLen
+	int parityLen;          // largest parity payload
+	int headerLen;          // data PDU header of the transfer
+	int maxGroup;           // largest group the window allows, 0 = never any parity
+	int groupSize;          // what the next group gets
+	int parities;
+	// the open group
+	int slot;
+	uint32_t first;
+	int count;              // packets coded so far, 0 = none open
+	int size;
+	int openParities;
+	int longest;            // longest payload in it
+	// loss rate
+	uint64_t sent;          // new packets since the last sample
+	uint64_t lost;          // losses reported or rebuilt since then
+	uint32_t recovered;     // receiver's rebuilt count last heard
+	double lossRate;        // smoothed, < 0 = no sample yet
+	// stats
+	uint64_t dataPackets;
+	uint64_t parityPackets;
+} FecEncoder;
+
+typedef struct {
+	uint8_t *slots;         // ringSize payloads of bufferSize, by sequence % ringSize
+	int *lens;
+	uint32_t *seqs;         // sequence number each slot holds, 0 = none
+	uint32_t ringSize;      // 0 = not decoding
+	int bufferSize;
+	int parityLen;          // largest parity payload
+	uint8_t *held;          // FEC_HELD parity payloads, by group % FEC_HELD
+	uint32_t heldFirst[FEC_HELD];
+	int heldLen[FEC_HELD];  // 0 = empty
+	uint8_t *syndromes;     // FEC_MAX_PARITY scratch payloads
+	uint32_t queue[FEC_QUEUE]; // rebuilt sequence numbers not yet taken
+	int queueHead;
+	int queueCount;
+	int span;               // packets the last group took with its parity
+	uint64_t parityPackets;
+	uint64_t rebuilt;
+	uint64_t shortfalls;    // parity that came with more losses than it covers
+} FecDecoder;
+
+int FecEncoder_init(FecEncoder *fec, int bufferSize, int headerLen, int windowSize);
+int FecEncoder_add(FecEncoder *fec, uint32_t seq, const uint8_t *payload, int len);
+void FecEncoder_send(FecEncoder *fec, SendBatch *batch);
+void FecEncoder_feedback(FecEncoder *fec, uint32_t lost, uint32_t recovered);
+void FecEncoder_print(FecEncoder *fec, const char *who);
+void FecEncoder_free(FecEncoder *fec);
+
+int FecDecoder_init(FecDecoder *fec, int windowSize, int bufferSize);
+void FecDecoder_store(FecDecoder *fec, uint32_t seq, const uint8_t *payload, int len);
+int FecDecoder_parity(FecDecoder *fec, uint32_t first, const uint8_t *payload, int len);
+uint8_t *FecDecoder_take(FecDecoder *fec, uint32_t *seq, int *len);
+void FecDecoder_print(FecDecoder *fec, const char *who);
+void FecDecoder_free(FecDecoder *fec);
+
+#endif
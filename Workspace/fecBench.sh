@@ -0,0 +1,49 @@
+#!/bin/sh
+# FEC benchmark: goodput against loss rate, with and without parity (rcopy -f).
+#
+# Copies a file over loopback with ./server and ./rcopy at each error rate
+# (the libcpe464 loss layer drops and corrupts packets both ways, ACKs too)
+# and pulls rcopy's goodput (file bytes over the transfer time), the
+# server's retransmits and, with -f, the parity sent and packets rebuilt.
+#
+# Usage: ./fecBench.sh [file MB] [window] [buffer-size] [error rates...]
+
+SIZE_MB=${1:-20}
+WINDOW=${2:-256}
+BUFFER=${3:-1400}
+shift 3 2>/dev/null
+RATES=${*:-0 0.01 0.02 0.05 0.1 0.15}
+FILE=fecBench.dat
+PORT=$(( 48000 + $$ % 10000 ))
+
+head -c $(( SIZE_MB * 1024 * 1024 )) /dev/urandom > $FILE || exit 1
+
+echo "Copying $SIZE_MB MB over loopback (window $WINDOW x $BUFFER bytes)"
+printf "%-6s %-4s %10s %10s %12s %9s %9s\n" "loss" "fec" "seconds" "Mbit/s" "retransmits" "parity" "rebuilt"
+for RATE in $RATES; do
+	for MODE in "" "-f"; do
+		rm -f fecBench.out
+		./server $RATE $PORT > fecBench-server.log 2>&1 &
+		SERVER=$!
+		sleep 0.3
+		timeout 300 ./rcopy $MODE $FILE fecBench.out $WINDOW $BUFFER $RATE localhost $PORT > fecBench-rcopy.log 2>&1
+		sleep 0.3
+		kill $SERVER 2>/dev/null
+		wait $SERVER 2>/dev/null
+
+		if ! cmp -s $FILE fecBench.out; then
+			echo "WARNING: copy at $RATE with '$MODE' differs from the source."
+		fi
+		cat fecBench-server.log fecBench-rcopy.log | awk -v loss=$RATE -v fec="${MODE:+on}" '
+			/^\[Server\] bytes:/         { resent = $NF }
+			/^\[Server\] FEC:/           { parity = $10; gsub(/[(),]/, "", parity) }
+			/^\[Client\] elapsed:/       { secs = $3; rate = $(NF - 1) }
+			/^\[Client\] FEC:/           { rebuilt = $6 }
+			END { printf "%-6s %-4s %10s %10s %12s %9s %9s\n", loss, fec == "" ? "off" : fec, secs, rate, resent,
+				fec == "" ? "-" : parity, fec == "" ? "-" : rebuilt }
+		'
+		PORT=$(( PORT + 1 ))
+	done
+done
+
+rm -f $FILE fecBench.out fecBench-server.log fecBench-rcopy.log
@@ -17,6 +17,7 @@
 #include "functions.h"
 #include "checksum.h"
 #include "cpe464.h"
+#include "fastChecksum.h"
 
 
 int createPDU(uint8_t *pduBuffer, uint32_t sequenceNumber, uint8_t flag, uint8_t *payload, int payloadLen) {
@@ -29,7 +30,7 @@ int createPDU(uint8_t *pduBuffer, uint32_t sequenceNumber, uint8_t flag, uint8_t
 	memcpy(pduBuffer, &sequenceNumberNetwork, sizeof(sequenceNumberNetwork));
 	offset+= sizeof(sequenceNumberNetwork);
  	
-	// Calculate and copy Checksum into buffer
+	// Checksum is 0 while it is calculated
 	uint16_t ck_sum = 0;
 	memcpy(pduBuffer + offset, &ck_sum, sizeof(ck_sum));
 	offset+= 2;
@@ -38,13 +39,17 @@ int createPDU(uint8_t *pduBuffer, uint32_t sequenceNumber, uint8_t flag, uint8_t
 	memcpy(pduBuffer + offset, &flag, sizeof(flag));
 	offset+= sizeof(flag);
 	
-	// Copy payload into buffer
-	memcpy(pduBuffer + offset, payload, payloadLen);
+	// Copy payload into buffer and sum it on the way.  The flag pairs up
+	// with the first payload byte, the rest starts on an even offset
+	uint64_t sum = 0;
+	if (payloadLen > 0) {
+		pduBuffer[offset] = payload[0];
+		sum = FastChecksum_copy(0, pduBuffer + offset + 1, payload + 1, payloadLen - 1);
+	}
+	sum = FastChecksum_add(sum, pduBuffer, payloadLen > 0 ? 8 : 7);
 	offset+= payloadLen;
 	
-	// Calculate checksum on the entire PDU with ck_sum set to 0
-	ck_sum = in_cksum((unsigned short *)pduBuffer, offset);
-	//uint16_t ck_sum_network = htons(ck_sum);
+	ck_sum = FastChecksum_fold(sum);
 	memcpy(pduBuffer + 4, &ck_sum, sizeof(ck_sum));
 
 	// Return PDU length	
@@ -53,6 +58,90 @@ int createPDU(uint8_t *pduBuffer, uint32_t sequenceNumber, uint8_t flag, uint8_t
 
 }
 
+int createPDUHeader(uint8_t *header, uint32_t sequenceNumber, uint8_t flag, uint8_t *payload, int payloadLen) {
+	uint32_t sequenceNumberNetwork = htonl(sequenceNumber);
+	memcpy(header, &sequenceNumberNetwork, 4);
+	memset(header + 4, 0, 2);
+	header[6] = flag;
+
+	// The header is 7 bytes, so the flag pairs up with the first payload
+	// byte and the rest of the payload starts on an even offset
+	uint8_t pair[2] = { flag, payloadLen > 0 ? payload[0] : 0 };
+	uint64_t sum = FastChecksum_add(0, header, 6);
+	sum = FastChecksum_add(sum, pair, 2);
+	if (payloadLen > 1) {
+		sum = FastChecksum_add(sum, payload + 1, payloadLen - 1);
+	}
+
+	uint16_t ck_sum = FastChecksum_fold(sum);
+	memcpy(header + 4, &ck_sum, 2);
+	return 7;
+}
+
+int createCrcPDUHeader(uint8_t *header, uint32_t sequenceNumber, uint8_t flag, uint8_t *payload, int payloadLen) {
+	uint32_t sequenceNumberNetwork = htonl(sequenceNumber);
+	memcpy(header, &sequenceNumberNetwork, 4);
+	memset(header + 4, 0, 2);
+	header[6] = flag;
+
+	uint32_t crc = FastChecksum_crc32c(0, header, 7);
+	crc = htonl(FastChecksum_crc32c(crc, payload, payloadLen));
+	memcpy(header + 7, &crc, 4);
+	return CRC_HEADER_LEN;
+}
+
+int createDataPDUHeader(uint8_t *header, uint32_t sequenceNumber, uint8_t flag, uint8_t *payload, int payloadLen, int headerLen) {
+	if (headerLen == CRC_HEADER_LEN) {
+		return createCrcPDUHeader(header, sequenceNumber, flag, payload, payloadLen);
+	}
+	return createPDUHeader(header, sequenceNumber, flag, payload, payloadLen);
+}
+
+void reflagPDUHeader(uint8_t *header, uint8_t flag, uint8_t *payload, int payloadLen, int headerLen) {
+	uint8_t oldFlag = header[6];
+	if (oldFlag == flag) {
+		return;
+	}
+	header[6] = flag;
+
+	if (headerLen == CRC_HEADER_LEN) {
+		// Only the flag byte changed, payloadLen bytes follow it in the CRC
+		uint32_t crc;
+		memcpy(&crc, header + 7, 4);
+		crc = htonl(FastChecksum_crc32c_update(ntohl(crc), oldFlag, flag, payloadLen));
+		memcpy(header + 7, &crc, 4);
+		return;
+	}
+
+	// The flag shares its 16-bit word with the first payload byte
+	uint8_t oldPair[2] = { oldFlag, payloadLen > 0 ? payload[0] : 0 };
+	uint8_t newPair[2] = { flag, oldPair[1] };
+	uint16_t oldWord, newWord, ck_sum;
+	memcpy(&oldWord, oldPair, 2);
+	memcpy(&newWord, newPair, 2);
+	memcpy(&ck_sum, header + 4, 2);
+	ck_sum = FastChecksum_update(ck_sum, oldWord, newWord);
+	memcpy(header + 4, &ck_sum, 2);
+}
+
+int checkPDU(uint8_t *pdu, int pduLen, int headerLen) {
+	if (pduLen < 7) {
+		return 0;
+	}
+	uint8_t flag = pdu[6];
+	if (headerLen == CRC_HEADER_LEN && flag >= 16 && flag <= 19) {
+		if (pduLen < CRC_HEADER_LEN) {
+			return 0;
+		}
+		uint32_t crc;
+		memcpy(&crc, pdu + 7, 4);
+		uint32_t expected = FastChecksum_crc32c(0, pdu, 7);
+		expected = FastChecksum_crc32c(expected, pdu + CRC_HEADER_LEN, pduLen - CRC_HEADER_LEN);
+		return ntohl(crc) == expected;
+	}
+	return FastChecksum_fold(FastChecksum_add(0, pdu, pduLen)) == 0;
+}
+
 void printPDU(uint8_t *aPDU, int pduLength) {
 	// -----Extract fields-----
 	
@@ -94,19 +183,27 @@ void printPDU(uint8_t *aPDU, int pduLength) {
 }
 
 void send_rr(ReceiveInfo *info, uint32_t next) {
-	uint8_t pdu[7];
+	uint8_t pdu[7 + 4 + 4];
+	int pduLen = 7 + 4;
 	uint32_t totalSeq = htonl(next);
+	uint32_t rwnd = htonl(receive_window(info));
 	memcpy(pdu, &totalSeq, 4);
 	memset(pdu + 4, 0, 2);
 	pdu[6] = 5;
+	memcpy(pdu + 7, &rwnd, 4);
+	if (info->fec) {
+		uint32_t rebuilt = htonl(info->parity.rebuilt);
+		memcpy(pdu + pduLen, &rebuilt, 4);
+		pduLen += 4;
+	}
 
-	uint16_t checksum = in_cksum((unsigned short *)pdu, sizeof(pdu));
+	uint16_t checksum = in_cksum((unsigned short *)pdu, pduLen);
 	memcpy(pdu + 4, &checksum, 2);
 
 	//pdu[4] = 0;
 	//pdu[5] = 0;
 	//pdu[6] = 5; // RR
-	sendtoErr(info->socketNum, pdu, sizeof(pdu), 0, (struct sockaddr *)&info->serverAddr, info->serverLen);
+	sendtoErr(info->socketNum, pdu, pduLen, 0, (struct sockaddr *)&info->serverAddr, info->serverLen);
 //	printf("Sent RR %u\n", next);
 
 }
@@ -132,26 +229,192 @@ void send_srej(ReceiveInfo *info, uint32_t missingSeq) {
 }
 
 
-void buffer_packet(ReceiveInfo *info, uint32_t seq, uint8_t *data, int len) {
-    int index = seq % info->windowSize;
-    PacketEntry *entry = &info->buffer[index];
-
-    if (!entry->valid) {
-        memcpy(entry->packet, data, len);
-        entry->packetLen = len;
-        entry->valid = 1;
- //       printf("Buffered seq#%u\n", seq);
-    }
-}
+// Sends one SACK carrying the cumulative ACK plus the missing ranges
+// between expected and highest.  Holes only count as lost once
+// SACK_REORDER_THRESHOLD later packets have arrived (or the sender is
+// known to be done, eofSeq), so brief reordering doesn't trigger
+// retransmits; with -f also the last parity group's length more, so the
+// group's parity gets to rebuild a hole first.  Holes already reported are
+// skipped unless full is set.  Returns the number of ranges sent.
+int send_sack(ReceiveInfo *info, int full) {
+	uint8_t pdu[7 + 2 + SACK_MAX_BLOCKS * 8 + 4 + 4];
+	uint16_t blockCount = 0;
+	int offset = 9;
 
+	// Last sequence number a hole may end on
+	uint32_t lossEdge = info->highest;
+	if (info->eofSeq != 0) {
+		lossEdge = info->eofSeq - 1;
+	} else if (!full) {
+		uint32_t threshold = SACK_REORDER_THRESHOLD + (info->fec ? info->parity.span : 0);
+		lossEdge = (lossEdge > threshold) ? lossEdge - threshold : 0;
+	}
 
+	uint32_t seq = info->expected;
+	if (!full && info->reportedUpTo > seq) {
+		seq = info->reportedUpTo;
+	}
+	while (seq <= lossEdge && blockCount < SACK_MAX_BLOCKS) {
+		uint32_t held = RecvWindow_run(&info->window, seq, lossEdge - seq + 1, 1);
+		seq += held;
+		if (seq > lossEdge) {
+			break;
+		}
+		uint32_t missing = RecvWindow_run(&info->window, seq, lossEdge - seq + 1, 0);
+		uint32_t start = htonl(seq);
+		uint32_t end = htonl(seq + missing - 1);
+		memcpy(pdu + offset, &start, 4);
+		memcpy(pdu + offset + 4, &end, 4);
+		offset += 8;
+		blockCount++;
+		seq += missing;
+	}
+	if (seq > info->reportedUpTo) {
+		info->reportedUpTo = seq;
+	}
 
+	uint16_t netCount = htons(blockCount);
+	uint32_t rwnd = htonl(receive_window(info));
+	memcpy(pdu + 7, &netCount, 2);
+	memcpy(pdu + offset, &rwnd, 4);
+	offset += 4;
+	if (info->fec) {
+		uint32_t rebuilt = htonl(info->parity.rebuilt);
+		memcpy(pdu + offset, &rebuilt, 4);
+		offset += 4;
+	}
+	createPDUHeader(pdu, info->expected, 7, pdu + 7, offset - 7);
+	sendtoErr(info->socketNum, pdu, offset, 0, (struct sockaddr *)&info->serverAddr, info->serverLen);
+	return blockCount;
+}
 
+// Pulls the missing ranges out of a SACK PDU, returns how many
+int parseSack(uint8_t *pdu, int pduLen, SackBlock *blocks, int maxBlocks) {
+	uint16_t blockCount;
+	if (pduLen < 9) {
+		return 0;
+	}
+	memcpy(&blockCount, pdu + 7, 2);
+	blockCount = ntohs(blockCount);
+	if (blockCount > (pduLen - 9) / 8) {
+		blockCount = (pduLen - 9) / 8;
+	}
+	if (blockCount > maxBlocks) {
+		blockCount = maxBlocks;
+	}
 
+	for (int i = 0; i < blockCount; i++) {
+		memcpy(&blocks[i].start, pdu + 9 + i * 8, 4);
+		memcpy(&blocks[i].end, pdu + 13 + i * 8, 4);
+		blocks[i].start = ntohl(blocks[i].start);
+		blocks[i].end = ntohl(blocks[i].end);
+	}
+	return blockCount;
+}
 
+// Receive window out of an RR or SACK, returns 0 if it carries none
+int parseRwnd(uint8_t *pdu, int pduLen, uint32_t *rwnd) {
+	int offset = 7;
+	if (pdu[6] == 7) {
+		uint16_t blockCount;
+		if (pduLen < 9) {
+			return 0;
+		}
+		memcpy(&blockCount, pdu + 7, 2);
+		offset = 9 + ntohs(blockCount) * 8;
+	}
+	if (pduLen < offset + 4) {
+		return 0;
+	}
+	memcpy(rwnd, pdu + offset, 4);
+	*rwnd = ntohl(*rwnd);
+	return 1;
+}
 
+// Packets rebuilt from parity so far, behind the receive window of an RR
+// or SACK from a -f receiver; returns 0 if it carries none
+int parseRebuilt(uint8_t *pdu, int pduLen, uint32_t *rebuilt) {
+	int offset = 7;
+	if (pdu[6] == 7) {
+		uint16_t blockCount;
+		if (pduLen < 9) {
+			return 0;
+		}
+		memcpy(&blockCount, pdu + 7, 2);
+		offset = 9 + ntohs(blockCount) * 8;
+	}
+	if (pduLen < offset + 8) {
+		return 0;
+	}
+	memcpy(rebuilt, pdu + offset + 4, 4);
+	*rebuilt = ntohl(*rebuilt);
+	return 1;
+}
 
+// Packets the sender may have past our cumulative ACK: what the writer
+// thread's ring can still take, otherwise the whole window
+uint32_t receive_window(ReceiveInfo *info) {
+	uint32_t rwnd = info->windowSize;
+	if (info->writer != NULL && DiskWriter_space(info->writer) < rwnd) {
+		rwnd = DiskWriter_space(info->writer);
+	}
+	info->advertised = rwnd;
+	return rwnd;
+}
 
+// Writes an out-of-order packet straight to its place in the file and
+// only marks it present: every packet before it carries payloadSize bytes,
+// so it goes payloadSize per packet past where the next in-order one will.
+// Until payloadSize is known (-m may shrink it) packets are held in memory.
+void buffer_packet(ReceiveInfo *info, uint32_t seq, uint8_t *data, int len) {
+	// Already held packets are ignored, a slot is only taken for new ones
+	if (RecvWindow_has(&info->window, seq)) {
+		return;
+	}
+	if (info->payloadSize == 0) {
+		RecvWindow_store(&info->window, seq, data, len);
+		return;
+	}
 
+	uint64_t offset = info->writeOffset + (uint64_t)(seq - info->expected) * info->payloadSize;
+	if (info->writer != NULL) {
+		if (DiskWriter_push(info->writer, offset, data, len) < 0) {
+			return; // ring full: as good as lost, the sender resends it
+		}
+	} else if (info->ring != NULL) {
+		if (Uring_space(info->ring) == 0) {
+			Uring_submit(info->ring, &info->stats.syscalls);
+		}
+		Uring_write(info->ring, fileno(info->outFile), data, len, offset);
+	} else if (pwrite(fileno(info->outFile), data, len, offset) != len) {
+		RecvWindow_store(&info->window, seq, data, len); // written in order later
+		return;
+	}
+	RecvWindow_mark(&info->window, seq, len);
+	info->placed++;
+}
 
+// Appends one (type, length, value) option at offset, returns the new offset
+int addOption(uint8_t *buffer, int offset, uint8_t type, const void *value, uint8_t len) {
+	buffer[offset] = type;
+	buffer[offset + 1] = len;
+	memcpy(buffer + offset + 2, value, len);
+	return offset + 2 + len;
+}
 
+// Value of the first option of this type, NULL if it isn't there
+uint8_t *findOption(uint8_t *options, int optionsLen, uint8_t type, int *len) {
+	int offset = 0;
+	while (offset + 2 <= optionsLen) {
+		int valueLen = options[offset + 1];
+		if (offset + 2 + valueLen > optionsLen) {
+			break; // truncated
+		}
+		if (options[offset] == type) {
+			*len = valueLen;
+			return options + offset + 2;
+		}
+		offset += 2 + valueLen;
+	}
+	return NULL;
+}
@@ -10,7 +10,63 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
-#define MAXBUF 1400
+
+#include "transferStats.h"
+#include "recvWindow.h"
+#include "rttEstimator.h"
+#include "uringIO.h"
+#include "diskWriter.h"
+#include "partFile.h"
+#include "delta.h"
+#include "compress.h"
+#include "fec.h"
+
+#define MAXBUF 1400        // default payload size, also sizes control PDUs
+#define MAX_PAYLOAD 65000  // largest payload a transfer may ask for (64 KB datagrams)
+#define PDU_HEADER_LEN 7   // seq (4), checksum (2), flag (1)
+#define CRC_HEADER_LEN 11  // data PDU header with a CRC32C (-C)
+
+// Selective ACK (flag 7): sequence field = cumulative ACK (next expected),
+// payload = 16-bit block count + that many (start, end) missing ranges
+#define SACK_MAX_BLOCKS 64
+#define SACK_REORDER_THRESHOLD 3 // packets above a hole before it counts as lost
+
+// Receive window: an RR (flag 5) carries a uint32 payload and a SACK one
+// after its blocks, the packets past the cumulative ACK the receiver can
+// still take.  ACKs without it leave the sender's limit where it was.
+// With -f another uint32 follows it: the packets rebuilt from parity so far.
+
+typedef struct {
+	uint32_t start;
+	uint32_t end;   // inclusive
+} SackBlock;
+
+// Filename request (flag 8) options: the filename is NUL terminated and
+// followed by (type, length, value) entries.  A request without the NUL
+// is an old client with no options.  The file OK (flag 9) answers the same
+// way when there is something to tell the client.
+#define OPT_CONGESTION 1 // name of the congestion controller to run
+#define OPT_RATE_CAP 2   // uint32 kbit/s the transfer must stay under
+#define OPT_PMTU_PROBE 3 // no value: probe the path before sending data
+#define OPT_CRC32C 4     // no value: data PDUs carry a CRC32C instead of the checksum
+#define OPT_STRIPE 5     // uint16 index, uint16 count: send only this share of the file
+#define OPT_RANGE 6      // in the file OK (flag 9): uint64 offset, uint64 length of the stripe
+#define OPT_RESUME 7     // uint64 offset, uint64 end: send only [offset, end) of the file
+#define OPT_SOURCE 8     // in the file OK next to OPT_RANGE or OPT_DELTA: uint64 file size, int64 mtime
+#define OPT_DELTA 9      // uint32 block size: send the signatures of every block (delta.h)...
+#define OPT_BLOCKS 10    // ...or, next to it, only these runs of blocks: uint32 first, uint32 count each
+#define DELTA_RUNS_PER_OPTION 31 // runs that fit one option's 255 byte value
+#define DELTA_RUNS_PER_REQUEST 124 // runs one request asks for (4 options)
+#define OPT_COMPRESS 11  // uint8 codec (COMPRESS_LZ): data payloads are compressed packets (compress.h)
+#define OPT_FEC 12       // no value: parity packets (flag 19) follow groups of data packets (fec.h)
+#define MAX_STREAMS 64   // parallel stripes one rcopy may open
+
+// Path MTU probe: before the data the server sends flag 11 PDUs with DF
+// set, padded to the size in their sequence field; rcopy echoes each one
+// back as an empty flag 12 with the same sequence number.  The largest
+// size that makes it through becomes the transfer's PDU size.
+#define PMTU_MIN_PDU 1232  // 1280 byte IPv6 minimum MTU less IP/UDP headers
+#define PMTU_PROBE_TRIES 3 // a probe that goes unanswered this often was too big
 
 // Process Transfer Struct
 typedef enum {
@@ -18,14 +74,10 @@ typedef enum {
 } TRANSFER_STATE;
 
 typedef struct {
-    uint8_t packet[MAXBUF];
-    int packetLen;
-    int valid;
-} PacketEntry;
-
-typedef struct {
-	PacketEntry *buffer;
+	RecvWindow window;     // out-of-order packets waiting for the gap to fill
 	int windowSize;
+	int bufferSize;         // largest payload the server may send
+	int headerLen;          // data PDU header, longer when it carries a CRC32C
 	uint32_t expected;
 	uint32_t highest;
 	FILE *outFile;
@@ -33,6 +85,31 @@ typedef struct {
 	struct sockaddr_in6 serverAddr;
 	socklen_t serverLen;
 	uint32_t eofSeq;
+	uint32_t reportedUpTo;  // holes below this went out in an earlier SACK
+	TransferStats stats;
+	RttEstimator rtt;       // seeded by the handshake, paces our repeats
+	int gro;                // take coalesced receives (UDP_GRO) when the kernel can
+	Uring *ring;            // io_uring for receives and file writes, NULL = system calls
+	uint64_t writeOffset;   // where the next in-order payload goes in the file
+	int writeFailed;        // a write to the file failed, EOF isn't acknowledged
+	uint64_t fileErrors;    // fwrite()/fflush() calls that failed (neither -W nor -u)
+	int payloadSize;        // payload of every data packet but the last, 0 = not known yet
+	int firstLen;           // packet 1's payload, payloadSize once anything follows it
+	uint64_t placed;        // out-of-order packets written straight to their offset
+	DiskWriter *writer;     // -W: a writer thread does the file writes, NULL = inline
+	uint32_t advertised;    // receive window in our last RR/SACK
+	PartFile *part;         // -R: progress is recorded here, NULL = not resumable
+	int partIndex;          // our record in it
+	uint64_t checkpointTime; // when it was last recorded
+	int compress;           // -k: every payload expands on its own first
+	int chunkSize;          // file bytes in a full packet (less than bufferSize with -k)
+	uint8_t *expanded;      // -k: windowSize slots of chunkSize bytes, by sequence % windowSize
+	uint64_t wireBytes;     // -k: payload bytes received for the file bytes written
+	uint64_t expandNs;      // -k: time spent expanding them
+	int fec;                // -f: parity packets come with the data
+	uint8_t sourceDigest[DELTA_DIGEST_LEN]; // -d: the digest a signatures' EOF carries
+	int digestLen;          // 0 = the EOF had none
+	FecDecoder parity;      // -f: what rebuilds lost packets from them, ringSize 0 = nothing does
 } ReceiveInfo;
 
 
@@ -45,11 +122,47 @@ typedef struct {
 // returns the length of the created PDU
 int createPDU(uint8_t *pduBuffer, uint32_t sequenceNumber, uint8_t flag, uint8_t *payload, int payloadLen);
 
+// Same as createPDU but only writes the 7-byte header; the payload stays
+// where it is (e.g. in an mmap'd file) and is sent as a second iovec.
+// The checksum still covers header + payload.  Returns the header length.
+int createPDUHeader(uint8_t *header, uint32_t sequenceNumber, uint8_t flag, uint8_t *payload, int payloadLen);
+
+// Data PDU header in CRC32C mode: the 7-byte header (checksum field 0)
+// followed by a CRC32C over it and the payload.  Returns CRC_HEADER_LEN.
+int createCrcPDUHeader(uint8_t *header, uint32_t sequenceNumber, uint8_t flag, uint8_t *payload, int payloadLen);
+
+// Whichever of the two a transfer with this data header length uses
+int createDataPDUHeader(uint8_t *header, uint32_t sequenceNumber, uint8_t flag, uint8_t *payload, int payloadLen, int headerLen);
+
+// Gives a data PDU built by createDataPDUHeader a new flag (e.g. 17 or 18
+// for a retransmit), patching its checksum (RFC 1624) or CRC32C instead of
+// recomputing it over the payload
+void reflagPDUHeader(uint8_t *header, uint8_t flag, uint8_t *payload, int payloadLen, int headerLen);
+
+// 1 if the PDU arrived intact.  headerLen is the transfer's data header
+// length: with CRC_HEADER_LEN data (and parity) PDUs are checked against
+// their CRC32C, everything else against the Internet checksum.
+int checkPDU(uint8_t *pdu, int pduLen, int headerLen);
+
 void printPDU(uint8_t *aPDU, int pduLength);
 
 void send_rr(ReceiveInfo *info, uint32_t next);
 
 void send_srej(ReceiveInfo *info, uint32_t missingSeg);
 
+int send_sack(ReceiveInfo *info, int full);
+
+int parseSack(uint8_t *pdu, int pduLen, SackBlock *blocks, int maxBlocks);
+
+int parseRwnd(uint8_t *pdu, int pduLen, uint32_t *rwnd);
+
+int parseRebuilt(uint8_t *pdu, int pduLen, uint32_t *rebuilt);
+
+uint32_t receive_window(ReceiveInfo *info);
+
 void buffer_packet(ReceiveInfo *info, uint32_t seq, uint8_t *data, int len);
+
+int addOption(uint8_t *buffer, int offset, uint8_t type, const void *value, uint8_t len);
+
+uint8_t *findOption(uint8_t *options, int optionsLen, uint8_t type, int *len);
 #endif 
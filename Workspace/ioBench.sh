@@ -0,0 +1,44 @@
+#!/bin/sh
+# I/O benchmark: system calls per GB moved, plain system calls against the
+# io_uring backend (-u on both server and rcopy).
+#
+# Copies a file over loopback with ./server and ./rcopy, no loss, and pulls
+# each side's transfer stats: socket syscalls (sendmmsg/recvmmsg, or
+# io_uring_enter with -u), file syscalls (read/write, from /proc/self/io) and
+# both together per GB.
+#
+# Usage: ./ioBench.sh [file MB] [window] [buffer-size]
+
+SIZE_MB=${1:-200}
+WINDOW=${2:-256}
+BUFFER=${3:-1400}
+FILE=ioBench.dat
+PORT=$(( 47000 + $$ % 10000 ))
+
+head -c $(( SIZE_MB * 1024 * 1024 )) /dev/urandom > $FILE || exit 1
+
+echo "Copying $SIZE_MB MB over loopback (window $WINDOW x $BUFFER bytes)"
+printf "%-9s %-7s %10s %14s %13s %10s\n" "backend" "side" "syscalls" "file syscalls" "syscalls/GB" "Mbit/s"
+for MODE in "" "-u"; do
+	./server $MODE 0 $PORT > ioBench-server.log 2>&1 &
+	SERVER=$!
+	sleep 0.3
+	./rcopy $MODE $FILE ioBench.out $WINDOW $BUFFER 0 localhost $PORT > ioBench-rcopy.log 2>&1
+	sleep 0.3
+	kill $SERVER 2>/dev/null
+	wait $SERVER 2>/dev/null
+
+	if ! cmp -s $FILE ioBench.out; then
+		echo "WARNING: copy with '$MODE' differs from the source."
+	fi
+	for SIDE in server rcopy; do
+		awk -v backend="${MODE:+io_uring}" -v side=$SIDE '
+			/throughput:/ { rate = $NF == "Mbit/s" ? $(NF - 1) : rate }
+			/syscalls:/   { sys = $3; file = $8; perGB = $10 }
+			END { printf "%-9s %-7s %10s %14s %13s %10s\n", backend == "" ? "syscalls" : backend, side, sys, file, perGB, rate }
+		' ioBench-$SIDE.log
+	done
+	PORT=$(( PORT + 1 ))
+done
+
+rm -f $FILE ioBench.out ioBench-server.log ioBench-rcopy.log
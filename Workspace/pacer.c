@@ -0,0 +1,127 @@
+// ----- Pacer -----
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+#include "pacer.h"
+#include "rttEstimator.h"
+
+void Pacer_init(Pacer *pacer, PACE_MODE mode, double capRate, int packetSize) {
+	memset(pacer, 0, sizeof(Pacer));
+	pacer->mode = mode;
+	pacer->capRate = capRate;
+	pacer->packetSize = packetSize;
+	pacer->last = RttEstimator_now();
+	Pacer_set_rate(pacer, 0);
+	pacer->tokens = pacer->burst;
+
+	// Default timer slack (50 us) would swamp sub-millisecond gaps
+	if (mode != PACE_OFF) {
+		prctl(PR_SET_TIMERSLACK, 1);
+	}
+}
+
+// New target rate in bytes per second (0 = no estimate), the cap still applies
+void Pacer_set_rate(Pacer *pacer, double rate) {
+	if (pacer->mode == PACE_OFF) {
+		rate = 0;
+	}
+	if (pacer->capRate > 0 && (rate == 0 || rate > pacer->capRate)) {
+		rate = pacer->capRate;
+	}
+	pacer->rate = rate;
+
+	pacer->burst = rate * PACER_BURST_US / 1e6;
+	if (pacer->burst < PACER_MIN_BURST * pacer->packetSize) {
+		pacer->burst = PACER_MIN_BURST * pacer->packetSize;
+	}
+}
+
+static void refill(Pacer *pacer, uint64_t now) {
+	pacer->tokens += (now - pacer->last) * pacer->rate / 1e6;
+	if (pacer->tokens > pacer->burst) {
+		pacer->tokens = pacer->burst;
+	}
+	pacer->last = now;
+}
+
+// Microseconds until a packet of this size may be handed to the socket
+uint64_t Pacer_delay(Pacer *pacer, int bytes) {
+	uint64_t delay = 0;
+	if (pacer->rate == 0) {
+		return 0;
+	}
+
+	uint64_t now = RttEstimator_now();
+	if (pacer->mode == PACE_TXTIME) {
+		if (pacer->nextTx > now + PACER_HORIZON_US) {
+			delay = pacer->nextTx - now - PACER_HORIZON_US;
+		}
+	} else {
+		refill(pacer, now);
+		if (pacer->tokens < bytes) {
+			delay = (uint64_t)((bytes - pacer->tokens) * 1e6 / pacer->rate) + 1;
+		}
+	}
+
+	if (delay > 0) {
+		pacer->holds++;
+		pacer->holdUs += delay;
+	}
+	return delay;
+}
+
+// Accounts for a packet going out now.  Retransmissions go through here
+// too, without waiting first, and simply leave the bucket in debt.
+// Returns the SO_TXTIME departure time in CLOCK_MONOTONIC nanoseconds
+// (0 when not in txtime mode).
+uint64_t Pacer_consume(Pacer *pacer, int bytes) {
+	if (pacer->rate == 0) {
+		return 0;
+	}
+
+	uint64_t now = RttEstimator_now();
+	if (pacer->mode == PACE_TXTIME) {
+		if (pacer->nextTx < now) {
+			pacer->nextTx = now;
+		}
+		uint64_t departure = pacer->nextTx;
+		pacer->nextTx += (uint64_t)(bytes * 1e6 / pacer->rate);
+		return departure * 1000;
+	}
+
+	refill(pacer, now);
+	pacer->tokens -= bytes;
+	return 0;
+}
+
+void Pacer_sleep(uint64_t us) {
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+const char *Pacer_mode_name(PACE_MODE mode) {
+	switch (mode) {
+		case PACE_TIMER:
+			return "timer";
+		case PACE_TXTIME:
+			return "txtime";
+		default:
+			return "off";
+	}
+}
+
+void Pacer_print(Pacer *pacer, const char *who) {
+	printf("[%s] pacing: %s  rate: %.2f Mbit/s  cap: ", who, Pacer_mode_name(pacer->mode),
+		pacer->rate * 8 / 1e6);
+	if (pacer->capRate > 0) {
+		printf("%.2f Mbit/s", pacer->capRate * 8 / 1e6);
+	} else {
+		printf("none");
+	}
+	printf("  holds: %llu (%.1f ms)\n", (unsigned long long)pacer->holds, pacer->holdUs / 1000.0);
+}
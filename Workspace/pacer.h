@@ -0,0 +1,52 @@
+// 
+// Packet pacing for the sender.
+//
+// Instead of firing the whole congestion window back to back, packets
+// leave at a target rate: the congestion window spread over one smoothed
+// RTT (with some headroom), never above the transfer's rate cap.
+//
+// Two ways of holding packets back:
+//   timer   token bucket, the sender sleeps (high resolution) until the
+//           bucket has room; the bucket holds about PACER_BURST_US of
+//           traffic so sendmmsg batches stay useful
+//   txtime  every packet is stamped with a departure time (SO_TXTIME) and
+//           the fq qdisc releases it; the sender only stops scheduling
+//           when it is PACER_HORIZON_US ahead of the clock
+
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#include <stdint.h>
+
+#define PACER_BURST_US 1000    // token bucket depth, in time at the current rate
+#define PACER_MIN_BURST 2      // packets, whatever the rate
+#define PACER_HORIZON_US 2000  // txtime: how far ahead packets may be scheduled
+#define PACER_GAIN_SLOW_START 2.0
+#define PACER_GAIN 1.25
+
+typedef enum {
+	PACE_OFF, PACE_TIMER, PACE_TXTIME
+} PACE_MODE;
+
+typedef struct {
+	PACE_MODE mode;
+	double rate;          // bytes per second, 0 = not known yet (unpaced)
+	double capRate;       // bytes per second ceiling, 0 = no cap
+	double tokens;        // bytes, negative = retransmission debt
+	double burst;         // bucket depth in bytes
+	int packetSize;
+	uint64_t last;        // last refill, microseconds
+	uint64_t nextTx;      // txtime: departure time of the next packet, microseconds
+	uint64_t holds;       // times the sender had to wait
+	uint64_t holdUs;      // total time it was told to wait
+} Pacer;
+
+void Pacer_init(Pacer *pacer, PACE_MODE mode, double capRate, int packetSize);
+void Pacer_set_rate(Pacer *pacer, double rate);
+uint64_t Pacer_delay(Pacer *pacer, int bytes);
+uint64_t Pacer_consume(Pacer *pacer, int bytes);
+void Pacer_sleep(uint64_t us);
+const char *Pacer_mode_name(PACE_MODE mode);
+void Pacer_print(Pacer *pacer, const char *who);
+
+#endif
@@ -0,0 +1,86 @@
+// ----- Resume Sidecar -----
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "partFile.h"
+
+// Loads path if it is a sidecar, otherwise creates it with count records
+// of unknown range.  Returns 1 if an existing copy is being resumed, 0 if
+// it starts over, -1 if path can't be used.
+int PartFile_open(PartFile *part, const char *path, int count) {
+	memset(part, 0, sizeof(PartFile));
+	part->fd = open(path, O_RDWR);
+	if (part->fd >= 0) {
+		if (PartFile_load(part) < 0) {
+			close(part->fd);
+			return -1;
+		}
+		return 1;
+	}
+
+	part->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (part->fd < 0 || count < 1 || count > PART_MAX_RECORDS) {
+		return -1;
+	}
+	part->header = (PartHeader){ .magic = PART_MAGIC, .count = count, .sourceSize = PART_UNKNOWN };
+	for (int i = 0; i < count; i++) {
+		part->records[i].end = PART_UNKNOWN;
+	}
+	size_t len = sizeof(PartHeader) + count * sizeof(PartRecord);
+	if (pwrite(part->fd, &part->header, sizeof(PartHeader), 0) != sizeof(PartHeader) ||
+			pwrite(part->fd, part->records, len - sizeof(PartHeader), sizeof(PartHeader)) != (ssize_t)(len - sizeof(PartHeader))) {
+		close(part->fd);
+		return -1;
+	}
+	return 0;
+}
+
+// Rereads the header and every record (the sessions update them)
+int PartFile_load(PartFile *part) {
+	if (pread(part->fd, &part->header, sizeof(PartHeader), 0) != sizeof(PartHeader) ||
+			memcmp(part->header.magic, PART_MAGIC, sizeof(part->header.magic)) != 0 ||
+			part->header.count < 1 || part->header.count > PART_MAX_RECORDS) {
+		return -1;
+	}
+	ssize_t len = part->header.count * sizeof(PartRecord);
+	if (pread(part->fd, part->records, len, sizeof(PartHeader)) != len) {
+		return -1;
+	}
+	return 0;
+}
+
+// Records the source's size and mtime the first time, after that returns
+// -1 if they no longer match
+int PartFile_source(PartFile *part, uint64_t size, int64_t mtime) {
+	if (part->header.sourceSize == PART_UNKNOWN) {
+		part->header.sourceSize = size;
+		part->header.sourceMtime = mtime;
+		return pwrite(part->fd, &part->header, sizeof(PartHeader), 0) == sizeof(PartHeader) ? 0 : -1;
+	}
+	return (part->header.sourceSize == size && part->header.sourceMtime == mtime) ? 0 : -1;
+}
+
+// Writes record index back, on disk before it returns
+int PartFile_update(PartFile *part, int index) {
+	off_t offset = sizeof(PartHeader) + index * sizeof(PartRecord);
+	if (pwrite(part->fd, &part->records[index], sizeof(PartRecord), offset) != sizeof(PartRecord)) {
+		return -1;
+	}
+	return fdatasync(part->fd);
+}
+
+// 1 once every byte of the record's range is on disk
+int PartFile_done(PartFile *part, int index) {
+	PartRecord *record = &part->records[index];
+	return record->end != PART_UNKNOWN && record->start + record->done == record->end;
+}
+
+void PartFile_close(PartFile *part) {
+	if (part->fd >= 0) {
+		close(part->fd);
+	}
+	part->fd = -1;
+}
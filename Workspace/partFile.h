@@ -0,0 +1,52 @@
+//
+// Sidecar that makes a copy resumable (rcopy -R).
+//
+// <to-filename>.part holds one record per session of the copy (the whole
+// file, or one per -n stripe): the byte range it fetches and how much of
+// that range, from its start, is known to be on disk.  A session only ever
+// rewrites its own record, so parallel streams share the file without
+// locking.  A rerun asks the server for each record's range past what is
+// done; once every record is complete the sidecar is removed.
+//
+// The header also keeps the source's size and modification time as the
+// server reported them, so a copy isn't resumed against a changed file.
+// Everything is in host byte order, the file never leaves this machine.
+
+#ifndef __PARTFILE_H__
+#define __PARTFILE_H__
+
+#include <stdint.h>
+
+#define PART_MAGIC "RCPART1"
+#define PART_MAX_RECORDS 64
+#define PART_CHECKPOINT_US 1000000 // how often a session records its progress
+#define PART_UNKNOWN UINT64_MAX    // record's end before its session got the range
+
+typedef struct {
+	uint64_t start;
+	uint64_t end;     // PART_UNKNOWN until the server answered
+	uint64_t done;    // bytes from start that are on disk
+} PartRecord;
+
+typedef struct {
+	char magic[8];
+	uint32_t count;   // records that follow
+	uint32_t pad;
+	uint64_t sourceSize;  // PART_UNKNOWN until a session learned them
+	int64_t sourceMtime;
+} PartHeader;
+
+typedef struct {
+	int fd;
+	PartHeader header;
+	PartRecord records[PART_MAX_RECORDS];
+} PartFile;
+
+int PartFile_open(PartFile *part, const char *path, int count);
+int PartFile_load(PartFile *part);
+int PartFile_source(PartFile *part, uint64_t size, int64_t mtime);
+int PartFile_update(PartFile *part, int index);
+int PartFile_done(PartFile *part, int index);
+void PartFile_close(PartFile *part);
+
+#endif
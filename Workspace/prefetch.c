@@ -0,0 +1,422 @@
+// ----- Read-Ahead Stage -----
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "prefetch.h"
+#include "delta.h"
+#include "compress.h"
+
+static void *reader_main(void *arg);
+
+// Bytes block k holds once read: file bytes, or their signatures
+static int block_len(Prefetch *prefetch, uint32_t k) {
+	uint64_t in = prefetch->total - (uint64_t)k * prefetch->blockSize;
+	if (in > (uint64_t)prefetch->blockSize) {
+		in = prefetch->blockSize;
+	}
+	if (prefetch->sigBlock > 0) {
+		return (in + prefetch->sigBlock - 1) / prefetch->sigBlock * SIG_LEN;
+	}
+	return in;
+}
+
+static void free_ring(Prefetch *prefetch) {
+	free(prefetch->blocks);
+	free(prefetch->lens);
+	free(prefetch->ready);
+	free(prefetch->ranges);
+	free(prefetch->scratch);
+	free(prefetch->digests);
+	CompressCache_close(&prefetch->cache);
+	prefetch->blocks = NULL;
+	prefetch->lens = NULL;
+	prefetch->ready = NULL;
+	prefetch->ranges = NULL;
+	prefetch->scratch = NULL;
+	prefetch->digests = NULL;
+}
+
+// Starts mode's readers on the ranges of fd (copied).  The ring is sized
+// to twice windowBytes (no more than what is read and PREFETCH_MAX_BYTES);
+// hashing and compressing readers get at least two blocks each.
+int Prefetch_init(Prefetch *prefetch, int fd, PrefetchRange *ranges, int rangeCount, uint64_t windowBytes, PrefetchMode *mode) {
+	memset(prefetch, 0, sizeof(Prefetch));
+	prefetch->cache.fd = -1;
+	int sigBlock = mode->sigBlock;
+	int chunk = (sigBlock > 0) ? 0 : mode->chunk;
+	int threads = mode->threads;
+	if (threads < 1 || threads > PREFETCH_MAX_THREADS) {
+		threads = 1;
+	}
+	for (int i = 0; i < rangeCount; i++) {
+		if (ranges[i].end > ranges[i].start) {
+			prefetch->total += ranges[i].end - ranges[i].start;
+		}
+	}
+
+	int blockSize = PREFETCH_BLOCK;
+	uint32_t count = 2;
+	if (sigBlock > 0) {
+		while (blockSize > sigBlock && (uint64_t)blockSize / 2 >= prefetch->total) {
+			blockSize /= 2;
+		}
+		while (count < 2 * (uint32_t)threads) {
+			count *= 2;
+		}
+	} else {
+		// At least two blocks, so one is read while the other is sent from.
+		// Compressed blocks are whole chunks and the same size for every
+		// transfer of the file, so the cache's blocks line up.
+		uint64_t target = windowBytes * 2;
+		if (target > prefetch->total) {
+			target = prefetch->total;
+		}
+		if (target > PREFETCH_MAX_BYTES) {
+			target = PREFETCH_MAX_BYTES;
+		}
+		if (chunk > 0) {
+			blockSize = PREFETCH_BLOCK / chunk * chunk;
+		}
+		while (chunk == 0 && blockSize > PREFETCH_MIN_BLOCK && (uint64_t)blockSize * 2 > target) {
+			blockSize /= 2;
+		}
+		while ((uint64_t)count * blockSize < target || (chunk > 0 && count < 2 * (uint32_t)threads)) {
+			count *= 2;
+		}
+	}
+	prefetch->blockCount = count;
+	prefetch->blockSize = blockSize;
+	prefetch->sigBlock = sigBlock;
+	prefetch->chunk = chunk;
+	prefetch->blocksTotal = (prefetch->total + blockSize - 1) / blockSize;
+	prefetch->fd = fd;
+	prefetch->threads = threads;
+
+	// Signature blocks are much smaller than the file bytes behind them,
+	// packets at worst a little bigger (their headers)
+	if (sigBlock > 0) {
+		prefetch->slotSize = blockSize / sigBlock * SIG_LEN;
+	} else if (chunk > 0) {
+		prefetch->slotSize = blockSize + blockSize / chunk * (2 + COMPRESS_HEADER_LEN);
+	} else {
+		prefetch->slotSize = blockSize;
+	}
+	prefetch->blocks = malloc((size_t)count * prefetch->slotSize);
+	prefetch->lens = calloc(count, sizeof(int));
+	prefetch->ready = calloc(count, sizeof(uint32_t));
+	prefetch->ranges = malloc((rangeCount + 1) * sizeof(PrefetchRange));
+	if (sigBlock > 0 || chunk > 0) {
+		prefetch->scratch = malloc((size_t)threads * blockSize);
+	}
+	if (sigBlock > 0) {
+		prefetch->digests = malloc((prefetch->total + sigBlock - 1) / sigBlock * DELTA_DIGEST_LEN + 1);
+	}
+	if (!prefetch->blocks || !prefetch->lens || !prefetch->ready || !prefetch->ranges || ((sigBlock > 0 || chunk > 0) && !prefetch->scratch) ||
+			(sigBlock > 0 && !prefetch->digests)) {
+		free_ring(prefetch);
+		return -1;
+	}
+	for (int i = 0; i < rangeCount; i++) {
+		if (ranges[i].end > ranges[i].start) {
+			prefetch->ranges[prefetch->rangeCount++] = ranges[i];
+		}
+	}
+	if (chunk > 0 && mode->cacheDir != NULL &&
+			CompressCache_open(&prefetch->cache, mode->cacheDir, fd, chunk, blockSize, prefetch->slotSize) < 0) {
+		printf("WARNING: Unable to open the compression cache in %s.\n", mode->cacheDir);
+	}
+
+	pthread_mutex_init(&prefetch->lock, NULL);
+	pthread_cond_init(&prefetch->wake, NULL);
+	for (int t = 0; t < threads; t++) {
+		if (pthread_create(&prefetch->thread[t], NULL, reader_main, prefetch) != 0) {
+			if (t == 0) {
+				free_ring(prefetch);
+				return -1;
+			}
+			prefetch->threads = t; // fewer readers, still correct
+			break;
+		}
+	}
+	return 0;
+}
+
+// Bytes the send loop gets out of it in all
+uint64_t Prefetch_size(Prefetch *prefetch) {
+	if (prefetch->sigBlock > 0) {
+		return (prefetch->total + prefetch->sigBlock - 1) / prefetch->sigBlock * SIG_LEN;
+	}
+	return prefetch->total;
+}
+
+// Signature mode: the digest of the whole file (delta.h) once the send
+// loop took every block, -1 before that or if the file came up short
+int Prefetch_digest(Prefetch *prefetch, uint8_t *digest) {
+	if (prefetch->digests == NULL || prefetch->tail < prefetch->blocksTotal || prefetch->ended) {
+		return -1;
+	}
+	Delta_file_digest(digest, prefetch->digests, (prefetch->total + prefetch->sigBlock - 1) / prefetch->sigBlock);
+	return 0;
+}
+
+// Tail block used up: hand it back, waking readers waiting for room
+static void release_block(Prefetch *prefetch, int ended) {
+	prefetch->ended = ended;
+	prefetch->pos = 0;
+	__atomic_store_n(&prefetch->tail, prefetch->tail + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&prefetch->sleeping, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&prefetch->lock);
+		pthread_cond_broadcast(&prefetch->wake);
+		pthread_mutex_unlock(&prefetch->lock);
+	}
+}
+
+// Copies the next len bytes into dest, or fewer at the end.  Returns -1
+// (and takes nothing) if they aren't all read yet.
+int Prefetch_take(Prefetch *prefetch, uint8_t *dest, int len) {
+	uint32_t mask = prefetch->blockCount - 1;
+	int ready = 0;
+	int last = 0;
+	uint32_t block;
+	for (block = prefetch->tail; block < prefetch->blocksTotal && ready < len && !prefetch->ended; block++) {
+		uint32_t index = block & mask;
+		if (__atomic_load_n(&prefetch->ready[index], __ATOMIC_ACQUIRE) != block + 1) {
+			break;
+		}
+		ready += prefetch->lens[index] - (block == prefetch->tail ? prefetch->pos : 0);
+		if (prefetch->lens[index] < block_len(prefetch, block)) {
+			last = 1; // the file ended early, nothing after it is valid
+			break;
+		}
+	}
+	if (block >= prefetch->blocksTotal || prefetch->ended) {
+		last = 1;
+	}
+	if (ready < len && !last) {
+		prefetch->misses++;
+		return -1;
+	}
+
+	int copied = 0;
+	while (copied < len && prefetch->tail < prefetch->blocksTotal && !prefetch->ended) {
+		uint32_t index = prefetch->tail & mask;
+		int n = prefetch->lens[index] - prefetch->pos;
+		if (n > len - copied) {
+			n = len - copied;
+		}
+		memcpy(dest + copied, prefetch->blocks + (size_t)index * prefetch->slotSize + prefetch->pos, n);
+		copied += n;
+		prefetch->pos += n;
+		if (prefetch->pos == prefetch->lens[index]) {
+			release_block(prefetch, prefetch->lens[index] < block_len(prefetch, prefetch->tail));
+		}
+	}
+	return copied;
+}
+
+// Chunk mode: copies the next packet payload into dest and returns its
+// length, 0 once there are no more.  Returns -1 (and takes nothing) if its
+// block isn't read yet.
+int Prefetch_take_packet(Prefetch *prefetch, uint8_t *dest) {
+	if (prefetch->tail >= prefetch->blocksTotal || prefetch->ended) {
+		return 0;
+	}
+	uint32_t index = prefetch->tail & (prefetch->blockCount - 1);
+	if (__atomic_load_n(&prefetch->ready[index], __ATOMIC_ACQUIRE) != prefetch->tail + 1) {
+		prefetch->misses++;
+		return -1;
+	}
+	if (prefetch->lens[index] == 0) {
+		prefetch->ended = 1; // the file ended early
+		return 0;
+	}
+
+	uint8_t *packet = prefetch->blocks + (size_t)index * prefetch->slotSize + prefetch->pos;
+	uint16_t len;
+	memcpy(&len, packet, 2);
+	memcpy(dest, packet + 2, len);
+	prefetch->pos += 2 + len;
+	if (prefetch->pos >= prefetch->lens[index]) {
+		release_block(prefetch, 0);
+	}
+	return len;
+}
+
+void Prefetch_print(Prefetch *prefetch, const char *who) {
+	printf("[%s] read-ahead: %u blocks of %d KB  readers: %d  reads: %llu  misses: %llu", who,
+		prefetch->blockCount, prefetch->blockSize / 1024, prefetch->threads,
+		(unsigned long long)prefetch->reads, (unsigned long long)prefetch->misses);
+	if (prefetch->sigBlock > 0) {
+		printf("  signatures of %d KB blocks", prefetch->sigBlock / 1024);
+	}
+	printf("\n");
+	if (prefetch->chunk > 0 && prefetch->packedBytes > 0) {
+		double encodeMs = prefetch->encodeNs / 1e6;
+		printf("[%s] compression: %.2fx (%.1f MB of file in %.1f MB of payload)  CPU: %.1f ms (%.0f MB/s)  cache: %u of %u blocks%s\n", who,
+			(double)prefetch->rawBytes / prefetch->packedBytes, prefetch->rawBytes / 1e6, prefetch->packedBytes / 1e6,
+			encodeMs, (encodeMs > 0) ? prefetch->encodedBytes / 1e3 / encodeMs : 0.0,
+			prefetch->cacheHits, prefetch->blocksTotal, (prefetch->cache.regionSize > 0) ? "" : " (no cache)"); // set once opened
+	}
+}
+
+// Stops the readers (wherever they are) and frees the ring
+void Prefetch_free(Prefetch *prefetch) {
+	if (prefetch->blocks == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&prefetch->lock);
+	__atomic_store_n(&prefetch->stop, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&prefetch->wake);
+	pthread_mutex_unlock(&prefetch->lock);
+	for (int t = 0; t < prefetch->threads; t++) {
+		pthread_join(prefetch->thread[t], NULL);
+	}
+
+	pthread_mutex_destroy(&prefetch->lock);
+	pthread_cond_destroy(&prefetch->wake);
+	free_ring(prefetch);
+}
+
+// Calls posix_fadvise(advice) for the file bytes behind [offset, offset +
+// len) of what is read, or reads them into dest; returns the bytes read
+// (short at the end of the file, -1 on an error)
+static int map_ranges(Prefetch *prefetch, uint64_t offset, uint64_t len, uint8_t *dest, int advice) {
+	uint64_t done = 0;
+	uint64_t rangeStart = 0; // where the current range starts in what is read
+	for (int i = 0; i < prefetch->rangeCount && done < len; i++) {
+		PrefetchRange *range = &prefetch->ranges[i];
+		uint64_t rangeLen = range->end - range->start;
+		if (offset + done >= rangeStart + rangeLen) {
+			rangeStart += rangeLen;
+			continue;
+		}
+		uint64_t within = offset + done - rangeStart;
+		uint64_t piece = rangeLen - within;
+		if (piece > len - done) {
+			piece = len - done;
+		}
+		if (dest == NULL) {
+			posix_fadvise(prefetch->fd, range->start + within, piece, advice);
+			done += piece;
+		} else {
+			uint64_t got = 0;
+			while (got < piece) {
+				ssize_t n = pread(prefetch->fd, dest + done + got, piece - got, range->start + within + got);
+				__atomic_add_fetch(&prefetch->reads, 1, __ATOMIC_RELAXED);
+				if (n < 0) {
+					return -1;
+				}
+				if (n == 0) {
+					return done + got;
+				}
+				got += n;
+			}
+			done += piece;
+		}
+		rangeStart += rangeLen;
+	}
+	return done;
+}
+
+// Chunk mode: block's packets, [uint16 length][payload] each, out of the
+// cache or compressed from len file bytes read into scratch.  Returns 0 if
+// the file came up short.
+static int pack_block(Prefetch *prefetch, uint32_t block, int len, uint8_t *scratch, uint8_t *slot) {
+	int packets = (len + prefetch->chunk - 1) / prefetch->chunk;
+	int n = CompressCache_load(&prefetch->cache, block, slot, prefetch->slotSize);
+	if (n > 0) {
+		__atomic_add_fetch(&prefetch->cacheHits, 1, __ATOMIC_RELAXED);
+	} else {
+		if (map_ranges(prefetch, (uint64_t)block * prefetch->blockSize, len, scratch, 0) != len) {
+			return 0;
+		}
+		struct timespec start;
+		struct timespec end;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		for (int done = 0; done < len; done += prefetch->chunk) {
+			int piece = (len - done < prefetch->chunk) ? len - done : prefetch->chunk;
+			uint16_t packed = Compress_packet(slot + n + 2, scratch + done, piece);
+			memcpy(slot + n, &packed, 2);
+			n += 2 + packed;
+		}
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+		__atomic_add_fetch(&prefetch->encodeNs, (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&prefetch->encodedBytes, len, __ATOMIC_RELAXED);
+		CompressCache_store(&prefetch->cache, block, slot, n);
+	}
+	__atomic_add_fetch(&prefetch->rawBytes, len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&prefetch->packedBytes, n - 2 * packets, __ATOMIC_RELAXED);
+	return n;
+}
+
+static void *reader_main(void *arg) {
+	Prefetch *prefetch = arg;
+	uint32_t mask = prefetch->blockCount - 1;
+	uint64_t ringBytes = (uint64_t)prefetch->blockCount * prefetch->blockSize;
+	int id = __atomic_fetch_add(&prefetch->started, 1, __ATOMIC_RELAXED);
+	uint8_t *scratch = (prefetch->scratch != NULL) ? prefetch->scratch + (size_t)id * prefetch->blockSize : NULL;
+
+	// Sequential from here on, and the first ring's worth is wanted now
+	if (id == 0) {
+		map_ranges(prefetch, 0, prefetch->total, NULL, POSIX_FADV_SEQUENTIAL);
+		map_ranges(prefetch, 0, ringBytes, NULL, POSIX_FADV_WILLNEED);
+	}
+
+	while (1) {
+		// Claim the next block once the ring has room for it
+		pthread_mutex_lock(&prefetch->lock);
+		__atomic_add_fetch(&prefetch->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (!prefetch->stop && prefetch->next < prefetch->blocksTotal &&
+				prefetch->next - __atomic_load_n(&prefetch->tail, __ATOMIC_SEQ_CST) >= prefetch->blockCount) {
+			pthread_cond_wait(&prefetch->wake, &prefetch->lock);
+		}
+		__atomic_sub_fetch(&prefetch->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (prefetch->stop || prefetch->next >= prefetch->blocksTotal) {
+			pthread_mutex_unlock(&prefetch->lock);
+			break;
+		}
+		uint32_t block = prefetch->next++;
+		pthread_mutex_unlock(&prefetch->lock);
+
+		uint64_t offset = (uint64_t)block * prefetch->blockSize;
+		int len = prefetch->blockSize;
+		if (prefetch->total - offset < (uint64_t)len) {
+			len = prefetch->total - offset;
+		}
+		uint32_t index = block & mask;
+		uint8_t *slot = prefetch->blocks + (size_t)index * prefetch->slotSize;
+		int n;
+		if (prefetch->chunk > 0) {
+			n = pack_block(prefetch, block, len, scratch, slot);
+		} else {
+			n = map_ranges(prefetch, offset, len, scratch != NULL ? scratch : slot, 0);
+		}
+		if (n < 0) {
+			n = 0;
+		}
+		if (scratch != NULL && prefetch->sigBlock > 0) {
+			// Signature mode: the block goes out as one signature per piece
+			// (published with the block, the send loop takes them in order)
+			int sigs = 0;
+			uint8_t *digests = prefetch->digests + offset / prefetch->sigBlock * DELTA_DIGEST_LEN;
+			for (int done = 0; done < n; done += prefetch->sigBlock) {
+				int piece = (n - done < prefetch->sigBlock) ? n - done : prefetch->sigBlock;
+				Delta_signature(slot + sigs * SIG_LEN, scratch + done, piece);
+				Delta_sha256(digests + sigs * DELTA_DIGEST_LEN, scratch + done, piece);
+				sigs++;
+			}
+			n = (n == len) ? sigs * SIG_LEN : 0; // a short read ends it, no partial signature
+		}
+		prefetch->lens[index] = n;
+		__atomic_store_n(&prefetch->ready[index], block + 1, __ATOMIC_RELEASE);
+
+		// Keep the kernel one ring ahead of what has been read
+		map_ranges(prefetch, offset + ringBytes, len, NULL, POSIX_FADV_WILLNEED);
+	}
+	return NULL;
+}
@@ -0,0 +1,98 @@
+//
+// Read-ahead stage for the server's send loop.
+//
+// Reader threads read the source in large blocks into a ring ahead of the
+// send cursor, telling the kernel the access is sequential and which blocks
+// come next (posix_fadvise), so a cold file is read while the window is
+// still being sent.  The send loop never touches the disk: it copies its
+// payloads out of blocks that are already read, and a block that isn't yet
+// is reported instead of waited for.  Readers claim ring blocks in order
+// and publish each with its sequence number, so several can fill the ring
+// at once while the send loop still takes the blocks in order.
+//
+// What is read is a list of byte ranges of the file, sent back to back
+// (one range for a plain transfer, the blocks a delta copy is missing for
+// rcopy -d).  In signature mode every block is turned into the delta
+// signatures of its sigBlock sized pieces instead, hashed by several
+// readers in parallel, along with the SHA-256 of every piece for the
+// digest of the whole file (Prefetch_digest).  In chunk mode (rcopy -k) the readers compress
+// every chunk sized piece into a whole packet payload (compress.h) and the
+// send loop takes one packet at a time; blocks of whole-file transfers can
+// come from and go to a CompressCache instead.
+//
+// The ring holds about twice the window (the window is what one round trip
+// can have in flight), in blocks of up to PREFETCH_BLOCK bytes.
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "compress.h"
+
+#define PREFETCH_BLOCK (1024 * 1024)         // largest block read at once
+#define PREFETCH_MIN_BLOCK (64 * 1024)
+#define PREFETCH_MAX_BYTES (64 * 1024 * 1024) // ring memory cap
+#define PREFETCH_RETRY_US 1000               // send loop retry after a miss
+#define PREFETCH_MAX_THREADS 16
+
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+} PrefetchRange;
+
+// What the readers make of the file bytes, and how many of them there are
+typedef struct {
+	int sigBlock;           // > 0: the signatures of pieces this big instead of the bytes
+	int chunk;              // > 0: packet payloads, each this many bytes compressed
+	const char *cacheDir;   // chunk mode: keep the blocks in a CompressCache here, NULL = don't
+	int threads;
+} PrefetchMode;
+
+typedef struct {
+	uint8_t *blocks;        // blockCount slots of slotSize bytes
+	int *lens;              // bytes each block holds
+	uint32_t *ready;        // block's sequence number + 1 once it is filled
+	uint32_t blockCount;
+	int blockSize;          // file bytes behind a block
+	int slotSize;           // what a block holds at most once read
+	int fd;
+	PrefetchRange *ranges;  // what is read, in order
+	int rangeCount;
+	uint64_t total;         // bytes of the file read in all
+	uint32_t blocksTotal;   // ring blocks that takes
+	int sigBlock;           // > 0: blocks are sent as the signatures of their pieces
+	int chunk;              // > 0: blocks hold packets, [uint16 length][payload] each
+	CompressCache cache;
+	uint32_t next;          // next block a reader claims (under lock)
+	uint32_t tail;          // blocks used up, written by the send loop only
+	int pos;                // send loop's offset in the tail block
+	int ended;              // a block came up short, the file ended early
+	int sleeping;           // readers waiting on wake for room in the ring
+	int stop;
+	uint8_t *scratch;       // signature and chunk mode: blockSize per reader for the file bytes
+	uint8_t *digests;       // signature mode: DELTA_DIGEST_LEN per piece, in file order
+	int threads;
+	int started;            // readers that took their scratch
+	pthread_t thread[PREFETCH_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	uint64_t reads;         // pread() calls
+	uint64_t misses;        // takes that found their data not read yet
+	uint64_t rawBytes;      // chunk mode: file bytes packed
+	uint64_t packedBytes;   // the packet payloads they became
+	uint64_t encodedBytes;  // file bytes compressed here (not loaded from the cache)
+	uint64_t encodeNs;      // readers' CPU time compressing them
+	uint32_t cacheHits;     // blocks loaded from the cache
+} Prefetch;
+
+int Prefetch_init(Prefetch *prefetch, int fd, PrefetchRange *ranges, int rangeCount, uint64_t windowBytes, PrefetchMode *mode);
+uint64_t Prefetch_size(Prefetch *prefetch);
+int Prefetch_digest(Prefetch *prefetch, uint8_t *digest);
+int Prefetch_take(Prefetch *prefetch, uint8_t *dest, int len);
+int Prefetch_take_packet(Prefetch *prefetch, uint8_t *dest);
+void Prefetch_print(Prefetch *prefetch, const char *who);
+void Prefetch_free(Prefetch *prefetch);
+
+#endif
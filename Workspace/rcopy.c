@@ -15,6 +15,11 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <math.h>
+#include <getopt.h>
+#include <endian.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "gethostbyname.h"
 #include "networks.h"
@@ -23,16 +28,56 @@
 #include "checksum.h"
 #include "cpe464.h"
 #include "pollLib.h"
-#include "functions.h"
+#include "batchIO.h"
+#include "congestion.h"
 
 //#define MAXBUF 1400
 #define MAX_RETRIES 10
-#define TIMEOUT_MS 1000
+
+// ----- Options (before the positional arguments) -----
+typedef struct {
+	const char *congestion; // -c: congestion controller the server should run
+	uint32_t rateCapKbps;   // -r: rate cap for this transfer, 0 = server's default
+	int noGro;              // -G: one datagram per receive, no UDP_GRO
+	int pmtuProbe;          // -m: server probes the path MTU, may shrink buffer-size
+	int crc;                // -C: data PDUs carry a CRC32C instead of the checksum
+	int streams;            // -n: parallel sessions, each fetching one stripe
+	int uring;              // -u: io_uring for receives and file writes
+	int asyncWrite;         // -W: a writer thread does the file writes
+	int resume;             // -R: progress is kept in <to-filename>.part, a rerun picks up from it
+	int delta;              // -d: only fetch the blocks to-filename doesn't already have
+	int compress;           // -k: ask for compressed packets
+	int fec;                // -f: ask for parity packets
+
+	// Per session, filled in as it runs
+	int stream;             // which stripe this process fetches
+	uint64_t offset;        // where the server says our stripe starts
+	int complete;           // EOF ACKed, every byte of the stripe is written
+	int compressed;         // the server agreed to -k for this session
+	int parity;             // the server agreed to -f for this session
+	PartFile *part;         // -R: the sidecar, this session owns record stream
+	const char *outPath;    // what the session writes: to-filename, or a delta copy's own files
+	int inPlace;            // the file is already there, write from offset instead of truncating
+	uint32_t deltaBlock;    // -d: block size asked for, 0 = not a delta session
+	uint32_t (*runs)[2];    // -d: runs of blocks (first, count) to ask for, none = signatures
+	int runCount;
+	uint64_t sourceSize;    // -d: the source as the server described it
+	int64_t sourceMtime;
+	uint8_t sourceDigest[DELTA_DIGEST_LEN]; // -d: the whole source's, from the signatures' EOF
+	int digestLen;          // 0 = the server sent none
+} RcopyConfig;
 
 // function instantiations 
+int checkOptions(int argc, char *argv[], RcopyConfig *config);
 int checkArgs(int argc, char * argv[]);
 float getErrorRate(int argc, char *argv[]);
-void processFile(int argc, char *argv[], int socketNum, struct sockaddr_in6 *server);
+int processFile(int argc, char *argv[], int socketNum, struct sockaddr_in6 *server, RcopyConfig *config);
+int processStreams(int argc, char *argv[], RcopyConfig *config);
+int processDelta(int argc, char *argv[], RcopyConfig *config);
+static uint8_t *load_file(const char *path, uint64_t *len);
+static int fetch_blocks(int argc, char *argv[], RcopyConfig *config, DeltaIndex *index, const char *literalPath, uint64_t *fetched);
+static int assemble(DeltaIndex *index, int localFd, const char *literalPath, const char *newPath, const char *toFile, const uint8_t *digest);
+static int copy_whole(int argc, char *argv[], RcopyConfig *config, const char *newPath, const char *toFile);
 
 
 
@@ -45,15 +90,26 @@ enum State {
 
 // State Functions
 STATE start_state(char *argv[], struct sockaddr_in6 *server, int socketNum, int portNumber);
-STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socketNum, int portNumber);
-STATE wait_on_data_state(char *argv[], struct sockaddr_in6 *recvAddr, int socketNum);
+STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socketNum, int portNumber, RttEstimator *rtt, RcopyConfig *config);
+STATE wait_on_data_state(char *argv[], struct sockaddr_in6 *recvAddr, int socketNum, RttEstimator *rtt, RcopyConfig *config);
 STATE process_transfer_state(ReceiveInfo *info);
 STATE send_eof_ack_state(ReceiveInfo *info, uint32_t eofSequence);
+int write_data(ReceiveInfo *info, uint8_t *data, int len);
+int flush_window(ReceiveInfo *info);
+int checkpoint(ReceiveInfo *info);
+uint64_t write_errors(ReceiveInfo *info);
 
 // -----Main----- 
 int main (int argc, char *argv[]) {
 	int socketNum = 0;				
 	struct sockaddr_in6 server;		// Supports 4 and 6 but requires IPv6 struct
+	RcopyConfig config = {0};
+
+	// Drop the options so the positional arguments keep their argv slots
+	int shift = checkOptions(argc, argv, &config) - 1;
+	argv[shift] = argv[0];
+	argv += shift;
+	argc -= shift;
 	int portNumber = checkArgs(argc, argv);
 	float errorRate = atof(argv[5]);
 		
@@ -64,12 +120,414 @@ int main (int argc, char *argv[]) {
 	sendErr_init(errorRate, DROP_ON, FLIP_ON, DEBUG_ON, RSEED_OFF);
 
 	// The start of the state transition	
-	processFile(argc, argv, socketNum, &server);
-		
+	config.outPath = argv[2];
+	config.inPlace = (config.streams > 1 || config.resume);
+	if (config.delta) {
+		close(socketNum);
+		return processDelta(argc, argv, &config) == 0 ? 0 : 1;
+	}
+	if (config.streams > 1 || config.resume) {
+		close(socketNum);
+		return processStreams(argc, argv, &config) == 0 ? 0 : 1;
+	}
+	return processFile(argc, argv, socketNum, &server, &config) == 0 ? 0 : 1;
+}
+
+// -----Parallel Streams-----
+// One child per stripe, each a whole rcopy session of its own (socket,
+// server child, window, sequence space) writing its share of the file in
+// place.  With -R the sidecar has a record per stripe (one for a single
+// stream): a rerun keeps the stripes it had and only starts the sessions
+// that didn't finish.  Returns 0 when every stripe arrived.
+int processStreams(int argc, char *argv[], RcopyConfig *config) {
+	PartFile part;
+	char partPath[strlen(argv[2]) + sizeof(".part")];
+	int resumed = 0;
+	uint64_t doneBefore = 0;
+	if (config->resume) {
+		sprintf(partPath, "%s.part", argv[2]);
+		resumed = PartFile_open(&part, partPath, config->streams > 1 ? config->streams : 1);
+		if (resumed < 0) {
+			printf("ERROR: Unable to use %s to resume the copy.\n", partPath);
+			return -1;
+		}
+		// The records are the stripes, a rerun can't split the file differently
+		if (resumed && config->streams != 0 && config->streams != (int)part.header.count) {
+			printf("ERROR: %s was started with -n %u, rerun with that or remove it to start over.\n", partPath, part.header.count);
+			PartFile_close(&part);
+			return -1;
+		}
+		config->streams = part.header.count;
+		config->part = &part;
+		for (int i = 0; i < config->streams; i++) {
+			doneBefore += part.records[i].done;
+		}
+		if (resumed) {
+			printf("[Client] resuming from %s: %llu bytes already copied\n", partPath, (unsigned long long)doneBefore);
+		}
+	}
+
+	// Create (or truncate) the output file once, the sessions only open it;
+	// a resumed copy keeps what it has
+	FILE *outFile = fopen(argv[2], resumed ? "r+b" : "wb");
+	if (outFile == NULL) {
+		printf("ERROR: Unable to open the output file: %s\n", argv[2]);
+		return -1;
+	}
+	fclose(outFile);
+	fflush(stdout);
+
+	uint64_t start = RttEstimator_now();
+	pid_t pids[MAX_STREAMS];
+	for (int i = 0; i < config->streams; i++) {
+		pids[i] = 0;
+		if (config->part != NULL && PartFile_done(config->part, i)) {
+			continue; // arrived in an earlier run
+		}
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			printf("ERROR: fork failed.\n");
+			exit(-1);
+		} else if (pids[i] == 0) {
+			// ----- Child -----
+			struct sockaddr_in6 server;
+			config->stream = i;
+			exit(processFile(argc, argv, 0, &server, config) == 0 ? 0 : 1);
+		}
+	}
+
+	int failed = 0;
+	for (int i = 0; i < config->streams; i++) {
+		int status;
+		if (pids[i] == 0) {
+			continue;
+		}
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed++;
+		}
+	}
+
+	double elapsed = (RttEstimator_now() - start) / 1e6;
+	struct stat outStat;
+	uint64_t bytes = (stat(argv[2], &outStat) == 0) ? outStat.st_size : 0;
+
+	// -R: the sessions kept their records up to date, the copy is whole
+	// once all of them are
+	if (config->part != NULL) {
+		int complete = (PartFile_load(&part) == 0);
+		bytes = 0;
+		for (int i = 0; i < config->streams; i++) {
+			complete = complete && PartFile_done(&part, i);
+			bytes += part.records[i].done;
+		}
+		bytes -= doneBefore;
+		PartFile_close(&part);
+		if (complete) {
+			unlink(partPath);
+		} else {
+			printf("WARNING: copy is incomplete, run again with -R to resume it from %s.\n", partPath);
+		}
+	}
+	printf("[Client] %d streams: %llu bytes in %.3f s, %.2f Mbit/s\n", config->streams,
+		(unsigned long long)bytes, elapsed, elapsed > 0 ? bytes * 8 / elapsed / 1e6 : 0);
+	if (failed > 0) {
+		printf("ERROR: %d of %d streams did not finish.\n", failed, config->streams);
+		return -1;
+	}
+	return 0;
+}
+
+// -----Delta Copy-----
+// to-filename is an older (or other) version of the file: get the
+// signatures of the source's blocks, find each block anywhere in the local
+// file, fetch only the ones that aren't there (into <to>.literal) and put
+// the new file together as <to>.new, which then replaces it once it has
+// the source's digest (otherwise the whole file is copied).  Returns 0
+// once it has.
+int processDelta(int argc, char *argv[], RcopyConfig *config) {
+	struct sockaddr_in6 server;
+	const char *toFile = argv[2];
+	struct stat localStat;
+	int localFd = open(toFile, O_RDONLY);
+	if (localFd < 0 || fstat(localFd, &localStat) < 0 || localStat.st_size == 0) {
+		printf("[Client] delta: nothing to start from in %s, copying the whole file.\n", toFile);
+		if (localFd >= 0) {
+			close(localFd);
+		}
+		return processFile(argc, argv, 0, &server, config);
+	}
+
+	char sigPath[strlen(toFile) + sizeof(".literal")];
+	char literalPath[sizeof(sigPath)];
+	char newPath[sizeof(sigPath)];
+	sprintf(sigPath, "%s.sig", toFile);
+	sprintf(literalPath, "%s.literal", toFile);
+	sprintf(newPath, "%s.new", toFile);
+	uint64_t start = RttEstimator_now();
+
+	// ----- Signatures of the source -----
+	config->deltaBlock = Delta_block_size(localStat.st_size);
+	config->outPath = sigPath;
+	config->inPlace = 0;
+	int result = processFile(argc, argv, 0, &server, config);
+	uint64_t blocks = (config->sourceSize + config->deltaBlock - 1) / config->deltaBlock;
+	uint64_t sigLen = 0;
+	uint8_t *sigs = (result == 0) ? load_file(sigPath, &sigLen) : NULL;
+	DeltaIndex index;
+	if (result < 0 || (blocks > 0 && (sigs == NULL || sigLen != blocks * SIG_LEN)) ||
+			DeltaIndex_init(&index, sigs, config->sourceSize, config->deltaBlock) < 0) {
+		printf("ERROR: Unable to get the signatures of %s.\n", argv[1]);
+		if (sigs != NULL) {
+			munmap(sigs, sigLen);
+		}
+		unlink(sigPath);
+		close(localFd);
+		return -1;
+	}
+	if (sigs != NULL) {
+		munmap(sigs, sigLen);
+	}
+	unlink(sigPath);
+
+	// Without the source's digest the result couldn't be checked
+	uint8_t digest[DELTA_DIGEST_LEN];
+	if (config->digestLen != DELTA_DIGEST_LEN) {
+		printf("WARNING: No digest of %s came with its signatures, copying the whole file.\n", argv[1]);
+		DeltaIndex_free(&index);
+		close(localFd);
+		return copy_whole(argc, argv, config, newPath, toFile);
+	}
+	memcpy(digest, config->sourceDigest, DELTA_DIGEST_LEN);
+
+	// ----- Find the blocks locally -----
+	uint64_t matchStart = RttEstimator_now();
+	int threads = Delta_threads();
+	uint8_t *local = mmap(NULL, localStat.st_size, PROT_READ, MAP_PRIVATE, localFd, 0);
+	if (local != MAP_FAILED) {
+		madvise(local, localStat.st_size, MADV_SEQUENTIAL);
+		DeltaIndex_match(&index, local, localStat.st_size, threads);
+		munmap(local, localStat.st_size);
+	}
+	uint32_t missing = DeltaIndex_missing(&index);
+	double matchTime = (RttEstimator_now() - matchStart) / 1e6;
+
+	// ----- Fetch what is missing, then put the new file together -----
+	uint64_t fetched = 0;
+	result = fetch_blocks(argc, argv, config, &index, literalPath, &fetched);
+	if (result == 0) {
+		result = assemble(&index, localFd, literalPath, newPath, toFile, digest);
+	}
+	unlink(literalPath);
+
+	double elapsed = (RttEstimator_now() - start) / 1e6;
+	printf("[Client] delta: %u of %u blocks of %d KB found locally (%d threads, %.3f s), %llu of %llu bytes fetched + %llu of signatures, %.3f s in all\n",
+		index.blockCount - missing, index.blockCount, index.blockSize / 1024, threads, matchTime,
+		(unsigned long long)fetched, (unsigned long long)config->sourceSize, (unsigned long long)sigLen, elapsed);
+	DeltaIndex_free(&index);
+	close(localFd);
+	if (result > 0) {
+		result = copy_whole(argc, argv, config, newPath, toFile);
+	}
+	return result;
+}
+
+// The delta didn't work out: the whole source into newPath as a plain
+// copy, which then replaces toFile
+static int copy_whole(int argc, char *argv[], RcopyConfig *config, const char *newPath, const char *toFile) {
+	struct sockaddr_in6 server;
+	config->deltaBlock = 0;
+	config->runs = NULL;
+	config->runCount = 0;
+	config->offset = 0;
+	config->outPath = newPath;
+	config->inPlace = 0;
+	if (processFile(argc, argv, 0, &server, config) < 0 || rename(newPath, toFile) < 0) {
+		printf("ERROR: Unable to copy the whole of %s.\n", argv[1]);
+		unlink(newPath);
+		return -1;
+	}
+	return 0;
+}
+
+// Maps a whole file read-only, NULL if it can't (or is empty)
+static uint8_t *load_file(const char *path, uint64_t *len) {
+	struct stat fileStat;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &fileStat) < 0 || fileStat.st_size == 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+	uint8_t *data = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	*len = fileStat.st_size;
+	return (data == MAP_FAILED) ? NULL : data;
+}
+
+// Bytes of source block j, only the last one can be short
+static uint64_t block_bytes(DeltaIndex *index, uint32_t j) {
+	uint64_t start = (uint64_t)j * index->blockSize;
+	return (index->sourceSize - start < (uint64_t)index->blockSize) ? index->sourceSize - start : (uint64_t)index->blockSize;
+}
+
+// Asks for the missing blocks, DELTA_RUNS_PER_REQUEST runs of them per
+// session, each session's data going to the literal file behind the last
+static int fetch_blocks(int argc, char *argv[], RcopyConfig *config, DeltaIndex *index, const char *literalPath, uint64_t *fetched) {
+	struct sockaddr_in6 server;
+	uint32_t (*runs)[2] = malloc((index->blockCount / 2 + 1) * sizeof(*runs));
+	int runCount = 0;
+	FILE *literal = fopen(literalPath, "wb");
+	if (runs == NULL || literal == NULL) {
+		printf("ERROR: Unable to set up %s.\n", literalPath);
+		free(runs);
+		return -1;
+	}
+	fclose(literal);
+	for (uint32_t j = 0; j < index->blockCount; j++) {
+		if (index->found[j] >= 0) {
+			continue;
+		}
+		if (runCount > 0 && runs[runCount - 1][0] + runs[runCount - 1][1] == j) {
+			runs[runCount - 1][1]++;
+		} else {
+			runs[runCount][0] = j;
+			runs[runCount][1] = 1;
+			runCount++;
+		}
+	}
+
+	// The source has to stay the file the signatures came from
+	uint64_t sourceSize = config->sourceSize;
+	int64_t sourceMtime = config->sourceMtime;
+	config->outPath = literalPath;
+	config->inPlace = 1;
+	*fetched = 0;
+	for (int r = 0; r < runCount; r += DELTA_RUNS_PER_REQUEST) {
+		config->runs = runs + r;
+		config->runCount = (runCount - r < DELTA_RUNS_PER_REQUEST) ? runCount - r : DELTA_RUNS_PER_REQUEST;
+		config->offset = *fetched;
+		for (int i = 0; i < config->runCount; i++) {
+			for (uint32_t j = config->runs[i][0]; j < config->runs[i][0] + config->runs[i][1]; j++) {
+				*fetched += block_bytes(index, j);
+			}
+		}
+		if (processFile(argc, argv, 0, &server, config) < 0) {
+			printf("ERROR: Unable to fetch the changed blocks of %s.\n", argv[1]);
+			free(runs);
+			return -1;
+		}
+		if (config->sourceSize != sourceSize || config->sourceMtime != sourceMtime) {
+			printf("ERROR: %s changed during the delta copy.\n", argv[1]);
+			free(runs);
+			return -1;
+		}
+	}
+	free(runs);
+	return 0;
+}
+
+// Copies len bytes from one file to another, in the kernel where it can
+// (filesystems that share extents don't even copy)
+static int copy_range(int from, uint64_t fromOffset, int to, uint64_t toOffset, uint64_t len) {
+	while (len > 0) {
+		loff_t in = fromOffset;
+		loff_t out = toOffset;
+		ssize_t n = copy_file_range(from, &in, to, &out, len, 0);
+		if (n <= 0) {
+			break; // not supported here, or across filesystems
+		}
+		fromOffset += n;
+		toOffset += n;
+		len -= n;
+	}
+
+	uint8_t buffer[64 * 1024];
+	while (len > 0) {
+		ssize_t n = pread(from, buffer, (len < sizeof(buffer)) ? len : sizeof(buffer), fromOffset);
+		if (n <= 0 || pwrite(to, buffer, n, toOffset) != n) {
+			return -1;
+		}
+		fromOffset += n;
+		toOffset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Writes the new file from the local blocks and the fetched ones (in
+// block order in the literal file), then puts it in place of toFile.
+// Returns 1 (and leaves toFile alone) if it doesn't have the source's
+// digest: a block matched that only looked the same, or toFile changed.
+static int assemble(DeltaIndex *index, int localFd, const char *literalPath, const char *newPath, const char *toFile, const uint8_t *digest) {
+	int newFd = open(newPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	int literalFd = open(literalPath, O_RDONLY);
+	if (newFd < 0 || literalFd < 0) {
+		printf("ERROR: Unable to put the new %s together.\n", toFile);
+		if (newFd >= 0) {
+			close(newFd);
+			unlink(newPath);
+		}
+		if (literalFd >= 0) {
+			close(literalFd);
+		}
+		return -1;
+	}
+
+	// One copy per stretch that comes from one place in one piece
+	uint64_t literalOffset = 0;
+	int failed = 0;
+	uint32_t j = 0;
+	while (j < index->blockCount && !failed) {
+		int fromLocal = (index->found[j] >= 0);
+		uint64_t from = fromLocal ? (uint64_t)index->found[j] : literalOffset;
+		uint64_t len = block_bytes(index, j);
+		uint32_t k = j + 1;
+		while (k < index->blockCount && (index->found[k] >= 0) == fromLocal &&
+				(!fromLocal || (uint64_t)index->found[k] == from + len)) {
+			len += block_bytes(index, k);
+			k++;
+		}
+		failed = copy_range(fromLocal ? localFd : literalFd, from, newFd, (uint64_t)j * index->blockSize, len) < 0;
+		if (!fromLocal) {
+			literalOffset += len;
+		}
+		j = k;
+	}
+	failed = failed || ftruncate(newFd, index->sourceSize) < 0 || fsync(newFd) < 0;
+
+	// End to end: what is about to replace toFile has to be the source
+	int mismatch = 0;
+	if (!failed) {
+		uint8_t actual[DELTA_DIGEST_LEN];
+		uint8_t *data = (index->sourceSize > 0) ? mmap(NULL, index->sourceSize, PROT_READ, MAP_SHARED, newFd, 0) : NULL;
+		if (data == MAP_FAILED || Delta_data_digest(actual, data, index->sourceSize, index->blockSize, Delta_threads()) < 0) {
+			failed = 1;
+		} else {
+			mismatch = (memcmp(actual, digest, DELTA_DIGEST_LEN) != 0);
+		}
+		if (data != NULL && data != MAP_FAILED) {
+			munmap(data, index->sourceSize);
+		}
+	}
+	close(newFd);
+	close(literalFd);
+	if (mismatch) {
+		printf("WARNING: The new %s doesn't match the source's digest, copying the whole file.\n", toFile);
+		unlink(newPath);
+		return 1;
+	}
+	if (failed || rename(newPath, toFile) < 0) {
+		printf("ERROR: Unable to put the new %s together.\n", toFile);
+		unlink(newPath);
+		return -1;
+	}
 	return 0;
 }
 
-void processFile(int argc, char *argv[], int socketNum, struct sockaddr_in6 *server) {		
+// Returns 0 once the whole file (or our stripe of it) is written
+int processFile(int argc, char *argv[], int socketNum, struct sockaddr_in6 *server, RcopyConfig *config) {		
 	// Grab port-num
 	int portNumber = checkArgs(argc, argv); //7
 	
@@ -81,6 +539,10 @@ void processFile(int argc, char *argv[], int socketNum, struct sockaddr_in6 *ser
 	info.socketNum = socketNum;
 	info.serverAddr = *server;
 	info.serverLen = sizeof(info.serverAddr);
+
+	// One estimator per transfer, the handshake gives it the first sample
+	RttEstimator rtt;
+	RttEstimator_init(&rtt);
 	
 	// ----- State Loop -----
 	STATE state = START;
@@ -91,10 +553,10 @@ void processFile(int argc, char *argv[], int socketNum, struct sockaddr_in6 *ser
 				state = start_state(argv, server, socketNum, portNumber);
 				break;
 			case WAIT_ON_FILE_OK:
-				state = wait_on_file_ok_state(argv, server, socketNum, portNumber);
+				state = wait_on_file_ok_state(argv, server, socketNum, portNumber, &rtt, config);
 				break;
 			case WAIT_ON_DATA:
-				state = wait_on_data_state(argv, &recvAddr, socketNum);
+				state = wait_on_data_state(argv, &recvAddr, socketNum, &rtt, config);
 				break;
 			case PROCESS_TRANSFER:
 				state = process_transfer_state(&info);					
@@ -111,6 +573,7 @@ void processFile(int argc, char *argv[], int socketNum, struct sockaddr_in6 *ser
 		}
 
 	}
+	return config->complete ? 0 : -1;
 }
 
 // ----- Start State -> Wait on File Ok State -----
@@ -129,7 +592,7 @@ STATE start_state(char *argv[], struct sockaddr_in6 *server, int socketNum, int
 }
 
 // ----- Wait on File Ok State -> Wait on Data -----
-STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socketNum, int portNumber) {
+STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socketNum, int portNumber, RttEstimator *rtt, RcopyConfig *config) {
 	// -----Initialize variables-----
 	int count = 0;
 	STATE returnValue = DONE; // WAIT_ON_FILE_OK
@@ -148,6 +611,55 @@ STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socke
 	memcpy(payload, &windowSize, 2);
 	memcpy(payload + 2, &bufferSize, 2);
 	memcpy(payload + 4, fromFilename, fileNameLen);
+	int payloadLen = fileNameLen + 4;
+
+	// Options ride behind a NUL terminated filename, without any the
+	// request looks exactly like it always did
+	PartRecord *record = (config->part != NULL) ? &config->part->records[config->stream] : NULL;
+	if (config->congestion != NULL || config->rateCapKbps != 0 || config->pmtuProbe || config->crc || config->streams > 1 || record != NULL || config->deltaBlock > 0 || config->compress || config->fec) {
+		payload[payloadLen++] = '\0';
+	}
+	if (config->congestion != NULL) {
+		payloadLen = addOption(payload, payloadLen, OPT_CONGESTION, config->congestion, strlen(config->congestion));
+	}
+	if (config->rateCapKbps != 0) {
+		uint32_t capKbps = htonl(config->rateCapKbps);
+		payloadLen = addOption(payload, payloadLen, OPT_RATE_CAP, &capKbps, 4);
+	}
+	if (config->pmtuProbe) {
+		payloadLen = addOption(payload, payloadLen, OPT_PMTU_PROBE, "", 0);
+	}
+	if (config->crc) {
+		payloadLen = addOption(payload, payloadLen, OPT_CRC32C, "", 0);
+	}
+	if (config->streams > 1 && (record == NULL || record->end == PART_UNKNOWN)) {
+		uint16_t stripe[2] = { htons(config->stream), htons(config->streams) };
+		payloadLen = addOption(payload, payloadLen, OPT_STRIPE, stripe, 4);
+	} else if (record != NULL) {
+		// Only what our record doesn't have yet (the whole file the first time)
+		uint64_t resume[2] = { htobe64(record->start + record->done), htobe64(record->end) };
+		payloadLen = addOption(payload, payloadLen, OPT_RESUME, resume, 16);
+	}
+	if (config->deltaBlock > 0) {
+		uint32_t deltaBlock = htonl(config->deltaBlock);
+		payloadLen = addOption(payload, payloadLen, OPT_DELTA, &deltaBlock, 4);
+		for (int i = 0; i < config->runCount; i += DELTA_RUNS_PER_OPTION) {
+			uint32_t runs[DELTA_RUNS_PER_OPTION][2];
+			int count = (config->runCount - i < DELTA_RUNS_PER_OPTION) ? config->runCount - i : DELTA_RUNS_PER_OPTION;
+			for (int j = 0; j < count; j++) {
+				runs[j][0] = htonl(config->runs[i + j][0]);
+				runs[j][1] = htonl(config->runs[i + j][1]);
+			}
+			payloadLen = addOption(payload, payloadLen, OPT_BLOCKS, runs, count * 8);
+		}
+	}
+	if (config->compress) {
+		uint8_t codec = COMPRESS_LZ;
+		payloadLen = addOption(payload, payloadLen, OPT_COMPRESS, &codec, 1);
+	}
+	if (config->fec) {
+		payloadLen = addOption(payload, payloadLen, OPT_FEC, "", 0);
+	}
 		
 	//printf("Sending:\n  windowSize: %d\n  bufferSize: %d\n  filename: %s\n",
        	//	ntohs(windowSize), ntohs(bufferSize), fromFilename);
@@ -157,7 +669,7 @@ STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socke
 	uint8_t pdu[MAXBUF+7];
 	uint32_t sequenceNum = 0;
 	uint8_t flag = 8;
-	pduLen = createPDU(pdu, sequenceNum, flag, payload, fileNameLen + 4);
+	pduLen = createPDU(pdu, sequenceNum, flag, payload, payloadLen);
 
 	while (count < MAX_RETRIES) {
 		// Close and open a new socket
@@ -178,13 +690,15 @@ STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socke
 		sendErr_init(atof(argv[5]), DROP_ON, FLIP_ON, DEBUG_ON, RSEED_OFF);
 
 		// send PDU
+		uint64_t sentTime = RttEstimator_now();
 		sendtoErr(socketNum, pdu, pduLen, 0, (struct sockaddr *)server, serverAddrLen);
 	//	printf("[Client %d] attempted %d: Sent filename: %s\n", socketNum, count+1,  argv[1]);
 		
 		// Start timer
-		int socketReady = pollCall(TIMEOUT_MS); // 1-second poll
+		int socketReady = pollCall(RttEstimator_timeout(rtt));
 		if (socketReady == -1) {
 			printf("WARNING: Timeout waiting for server to respond!\n");
+			RttEstimator_backoff(rtt);
 			count++;
 			close(socketNum);
 			continue;
@@ -202,17 +716,127 @@ STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socke
 			continue;
 		}
 
+		// A corrupted answer counts as no answer, ask again
+		if (!checkPDU(recvBuff, recvBytes, PDU_HEADER_LEN)) {
+			count++;
+			close(socketNum);
+			continue;
+		}
+
 		// Check for filename OK
 		uint8_t recvFlag = recvBuff[6];
 		if (recvFlag == 9) {	
+			// Only time the answer to a request we sent once (Karn)
+			if (count == 0) {
+				RttEstimator_sample(rtt, sentTime);
+			}
+
+			// A striped or resumed session is told where its share of the file starts
+			if (config->streams > 1 || record != NULL) {
+				uint8_t *options = memchr(recvBuff + 7, '\0', recvBytes - 7);
+				int optionLen = 0;
+				int sourceLen = 0;
+				uint8_t *range = NULL;
+				uint8_t *sourceOption = NULL;
+				if (options != NULL) {
+					options++;
+					range = findOption(options, recvBytes - (options - recvBuff), OPT_RANGE, &optionLen);
+					sourceOption = findOption(options, recvBytes - (options - recvBuff), OPT_SOURCE, &sourceLen);
+				}
+				if (range == NULL || optionLen != 16) {
+					printf("ERROR: Server can't send part of a file.\n");
+					close(socketNum);
+					return DONE;
+				}
+				uint64_t offset;
+				uint64_t length;
+				memcpy(&offset, range, 8);
+				memcpy(&length, range + 8, 8);
+				config->offset = be64toh(offset);
+				length = be64toh(length);
+
+				// -R: the first answer sets our record, later ones must be for
+				// the same file and pick up right where it stopped
+				if (record != NULL) {
+					uint64_t source[2] = { 0, 0 };
+					if (sourceOption != NULL && sourceLen == 16) {
+						memcpy(source, sourceOption, 16);
+					}
+					if (PartFile_source(config->part, be64toh(source[0]), (int64_t)be64toh(source[1])) < 0 ||
+							(record->end != PART_UNKNOWN && (config->offset != record->start + record->done || config->offset + length != record->end))) {
+						printf("ERROR: %s changed since the partial copy, remove %s.part to start over.\n", argv[1], argv[2]);
+						close(socketNum);
+						return DONE;
+					}
+					if (record->end == PART_UNKNOWN) {
+						record->start = config->offset;
+						record->end = config->offset + length;
+						record->done = 0;
+						PartFile_update(config->part, config->stream);
+					}
+				}
+			}
+
+			// A delta session learns which version of the file it is working on
+			if (config->deltaBlock > 0) {
+				uint8_t *options = memchr(recvBuff + 7, '\0', recvBytes - 7);
+				int optionLen = 0;
+				uint8_t *sourceOption = NULL;
+				if (options != NULL) {
+					options++;
+					sourceOption = findOption(options, recvBytes - (options - recvBuff), OPT_SOURCE, &optionLen);
+				}
+				if (sourceOption == NULL || optionLen != 16) {
+					printf("ERROR: Server can't send a delta copy.\n");
+					close(socketNum);
+					return DONE;
+				}
+				uint64_t source[2];
+				memcpy(source, sourceOption, 16);
+				config->sourceSize = be64toh(source[0]);
+				config->sourceMtime = be64toh(source[1]);
+			}
+
+			// -k: packets are compressed only if the server says so (never a
+			// delta copy's signatures)
+			config->compressed = 0;
+			if (config->compress) {
+				uint8_t *options = memchr(recvBuff + 7, '\0', recvBytes - 7);
+				int optionLen = 0;
+				uint8_t *codec = NULL;
+				if (options != NULL) {
+					options++;
+					codec = findOption(options, recvBytes - (options - recvBuff), OPT_COMPRESS, &optionLen);
+				}
+				config->compressed = (codec != NULL && optionLen == 1 && codec[0] == COMPRESS_LZ);
+				if (!config->compressed && (config->deltaBlock == 0 || config->runCount > 0)) {
+					printf("WARNING: Server doesn't compress, receiving plain data.\n");
+				}
+			}
+
+			// -f: parity only comes if the server says so
+			config->parity = 0;
+			if (config->fec) {
+				uint8_t *options = memchr(recvBuff + 7, '\0', recvBytes - 7);
+				int optionLen = 0;
+				if (options != NULL) {
+					options++;
+					config->parity = (findOption(options, recvBytes - (options - recvBuff), OPT_FEC, &optionLen) != NULL);
+				}
+				if (!config->parity) {
+					printf("WARNING: Server doesn't send parity, losses are all resent.\n");
+				}
+			}
+
 			// -----Attempt to Open Output File-----
-		        char *toFileName = argv[2];			
-			FILE *OutputFile = fopen(toFileName, "wb");
+		        const char *toFileName = config->outPath;
+			FILE *OutputFile = fopen(toFileName, config->inPlace ? "r+b" : "wb");
 			if (OutputFile == NULL) {
 				printf("Error on open of output file: %s\n", toFileName);
 				close(socketNum);
 				return DONE;	
 			}	
+			fclose(OutputFile);
 		
 			// -----Send FILE OK ACK (flag = 34)-----
 			uint8_t file_ok_ack_pdu[MAXBUF];
@@ -236,27 +860,93 @@ STATE wait_on_file_ok_state(char *argv[], struct sockaddr_in6 *server, int socke
 	return returnValue;	
 }
 
-STATE wait_on_data_state(char *argv[], struct sockaddr_in6 *recvAddr, int socketNum) {
+STATE wait_on_data_state(char *argv[], struct sockaddr_in6 *recvAddr, int socketNum, RttEstimator *rtt, RcopyConfig *config) {
 	// Set Receiver Info
 	ReceiveInfo info;
 	info.windowSize = atoi(argv[3]);
+	info.bufferSize = atoi(argv[4]);
+	info.headerLen = config->crc ? CRC_HEADER_LEN : PDU_HEADER_LEN;
 	info.expected = 1;
 	info.highest = 0;
+	info.eofSeq = 0;
+	info.reportedUpTo = 0;
 	info.socketNum = socketNum;
-	info.buffer = calloc(info.windowSize, sizeof(PacketEntry));
+	info.rtt = *rtt;
+	info.gro = !config->noGro;
+	info.compress = config->compressed;
+	info.chunkSize = info.bufferSize - (info.compress ? COMPRESS_HEADER_LEN : 0);
+	info.payloadSize = config->pmtuProbe ? 0 : info.chunkSize; // the probe may settle lower
+	info.firstLen = 0;
+	info.placed = 0;
+	info.writeFailed = 0;
+	info.fileErrors = 0;
+	info.wireBytes = 0;
+	info.expandNs = 0;
+	info.fec = config->parity;
+	info.digestLen = 0;
+
+	// Only the presence bitmap is sized by the window, payload slots are
+	// allocated when packets actually arrive out of order
+	if (RecvWindow_init(&info.window, info.windowSize, info.bufferSize) < 0) {
+		printf("ERROR: Unable to allocate packet buffer.\n");
+		return DONE;
+	}
 
-	if (!info.buffer) {
+	// -k: a slot per window position to expand packets into
+	info.expanded = NULL;
+	if (info.compress && (info.expanded = malloc((size_t)info.windowSize * info.chunkSize)) == NULL) {
 		printf("ERROR: Unable to allocate packet buffer.\n");
+		RecvWindow_free(&info.window);
 		return DONE;
 	}
 
-	// Open the output file 
-	info.outFile = fopen(argv[2], "wb");
+	// -f: the payloads as received, for parity to rebuild lost ones from.
+	// Without it parity is only received and dropped, losses are resent
+	memset(&info.parity, 0, sizeof(info.parity));
+	if (info.fec && FecDecoder_init(&info.parity, info.windowSize, info.bufferSize) < 0) {
+		printf("WARNING: Unable to allocate the parity buffer, not rebuilding lost packets.\n");
+	}
+
+	// Open the output file, a stripe (or what a resumed copy is missing) is
+	// written in place from its offset
+	info.outFile = fopen(config->outPath, config->inPlace ? "r+b" : "wb");
 	if (!info.outFile) {
-		printf("ERROR: Unable to open the output file: %s\n", argv[2]);
-		free(info.buffer);	
+		printf("ERROR: Unable to open the output file: %s\n", config->outPath);
+		RecvWindow_free(&info.window);
+		free(info.expanded);
+		FecDecoder_free(&info.parity);
 		return DONE;
 	}
+	fseeko(info.outFile, config->offset, SEEK_SET);
+	info.writeOffset = config->offset;
+
+	// io_uring: receives and the writes behind them share one submit
+	Uring ring;
+	info.ring = NULL;
+	if (config->uring) {
+		if (Uring_init(&ring) < 0) {
+			printf("WARNING: io_uring not available, using plain system calls.\n");
+		} else {
+			info.ring = &ring;
+		}
+	}
+
+	// -W: the receive loop only queues writes, a writer thread does them
+	DiskWriter writer;
+	info.writer = NULL;
+	info.advertised = info.windowSize;
+	if (config->asyncWrite) {
+		if (DiskWriter_init(&writer, fileno(info.outFile), info.windowSize, info.bufferSize) < 0) {
+			printf("WARNING: Unable to start the writer thread, writing inline.\n");
+		} else {
+			info.writer = &writer;
+		}
+	}
+
+	// -R: our record in the sidecar follows what reaches the disk in order
+	info.part = config->part;
+	info.partIndex = config->stream;
+	info.checkpointTime = RttEstimator_now();
 
 	// Copy the sender address from previous response
 	memcpy(&info.serverAddr, recvAddr, sizeof(struct sockaddr_in6));
@@ -264,130 +954,538 @@ STATE wait_on_data_state(char *argv[], struct sockaddr_in6 *recvAddr, int socket
 
 	// File reception state machine
 	STATE nextState = process_transfer_state(&info);
+	RecvWindow_free(&info.window);
+	free(info.expanded);
+	FecDecoder_free(&info.parity);
+	if (info.writer != NULL) {
+		DiskWriter_free(info.writer);
+	}
+	if (info.ring != NULL) {
+		Uring_free(info.ring);
+	}
+	config->complete = (info.eofSeq != 0 && info.expected >= info.eofSeq && !info.writeFailed);
+	config->digestLen = info.digestLen;
+	memcpy(config->sourceDigest, info.sourceDigest, info.digestLen);
 
 	return nextState; // DONE after receiving the whole file
 }
 
+// Sender already announced EOF but packets before it never showed up
+static int tailMissing(ReceiveInfo *info) {
+	return info->eofSeq != 0 && info->expected < info->eofSeq;
+}
+
 // -----PROCESS TRANSFER STATE-----
 STATE process_transfer_state(ReceiveInfo *info) {
 	TRANSFER_STATE state = IN_ORDER;
 	info->serverLen = sizeof(info->serverAddr);
+	uint64_t lastHeard = RttEstimator_now();
+
+	// Preallocated ring of receive buffers, refilled by one recvmmsg per loop
+	// (parity PDUs are a few bytes longer than data)
+	RecvBatch batch;
+	int pduMax = info->bufferSize + info->headerLen + (info->fec ? FEC_PARITY_OVERHEAD : 0);
+	if (RecvBatch_init(&batch, info->socketNum, pduMax, &info->stats) < 0) {
+		printf("ERROR: Unable to allocate receive buffers.\n");
+		return DONE;
+	}
+	SocketBuffer_reserve(info->socketNum, SO_RCVBUF, (long)info->windowSize * pduMax);
+	if (info->gro && RecvBatch_enable_gro(&batch) < 0) {
+		printf("WARNING: UDP_GRO not available, receiving one datagram at a time.\n");
+	}
+	if (info->ring != NULL) {
+		batch.ring = info->ring;
+		Uring_add_file(info->ring, info->socketNum);
+		Uring_add_file(info->ring, fileno(info->outFile));
+		Uring_add_buffer(info->ring, batch.buffers, (size_t)BATCH_MAX * batch.bufLen);
+	}
+	TransferStats_start(&info->stats);
+
+	setupPollSet();
+	addToPollSet(info->socketNum);
 
 	// -----Start the Mini State Machine-----
 	while (1) {
-		uint8_t packet[MAXBUF + 7];
-		int bytesRecv = safeRecvfrom(info->socketNum, packet, sizeof(packet), 0, (struct sockaddr *)&(info->serverAddr), (int *)(&info->serverLen));
-		if (bytesRecv < 0) {
-			continue;	
+		// What didn't make it to the disk won't be sent again, the copy
+		// has failed
+		if (write_errors(info) > 0) {
+			printf("ERROR: Writes to the output file failed, giving up.\n");
+			info->writeFailed = 1;
+			break;
 		}
 
-		// Extract info
-		uint32_t seqNum;
-		memcpy(&seqNum, packet, 4);
-		seqNum = ntohl(seqNum);
-	
-		uint8_t flag = packet[6];
-		int payloadLen = bytesRecv - 7;
-		uint8_t *payload = packet + 7;
+		// A flush the writer had no room for goes on once it has drained
+		if (state == OUT_OF_ORDER && RecvWindow_has(&info->window, info->expected)) {
+			flush_window(info);
+			if (info->expected > info->highest) {
+				state = IN_ORDER;
+			}
+		}
 
-		// Debugging - if this never prints, the client isn't getting packets
-		// Most likely the server is sending to wrong port or packets are flipped/dropped
-		//printf("[Client %d] RECV seq=%u, flag=%u, len=%d\n", info->socketNum, seqNum, flag, payloadLen);
+		// While the writer holds the receive window down, look every
+		// millisecond so the sender hears about it reopening right away
+		int throttled = info->writer != NULL && info->advertised < (uint32_t)info->windowSize / 2;
+		if (pollCall(throttled ? 1 : RttEstimator_timeout(&info->rtt)) == -1) {
+			if (throttled) {
+				uint32_t space = DiskWriter_space(info->writer);
+				if (space >= (uint32_t)info->windowSize / 2 || space > 2 * info->advertised) {
+					if (state == IN_ORDER && !tailMissing(info)) {
+						send_rr(info, info->expected);
+					} else {
+						send_sack(info, 0);
+					}
+					continue;
+				}
+				if (RttEstimator_now() - lastHeard < RttEstimator_timeout(&info->rtt) * 1000ULL) {
+					continue;
+				}
+			}
 
-		// Handle EOF 
-		if (flag == 10) {
-			printf("[Client] received EOF (flag 10) seq #%u.\n", seqNum);
+			// Nothing from the server, repeat our last answer in case it got lost
+			if (RttEstimator_now() - lastHeard >= RTT_GIVE_UP_MS * 1000ULL) {
+				printf("ERROR: Server stopped sending, giving up.\n");
+				break;
+			}
+			RttEstimator_backoff(&info->rtt);
+			if (state == IN_ORDER && !tailMissing(info)) {
+				send_rr(info, info->expected);
+			} else {
+				send_sack(info, 1);
+			}
+			continue;
+		}
+		lastHeard = RttEstimator_now();
+		info->rtt.backoff = 0;
+
+		int count = RecvBatch_recv(&batch, MSG_DONTWAIT);
+		if (count < 0) {
+			break;
+		}
 
-			info->eofSeq = seqNum;
-			
-			// Flush the rest
-		        while (info->expected <= info->highest && info->buffer[info->expected % info->windowSize].valid) {
-		                PacketEntry *entry = &info->buffer[info->expected % info->windowSize];
-                		fwrite(entry->packet, 1, entry->packetLen, info->outFile);
-	                	entry->valid = 0;
-        	        	info->expected++;
-            		}
+		// Run the whole batch through the state machine, then whatever parity
+		// rebuilt on the way as if it had come with it; answer once at the end
+		int needRR = 0;
+		int needSack = 0;
+		int fullSack = 0;
+		for (int i = 0; i < count || info->parity.queueCount > 0; i++) {
+			uint32_t seqNum;
+			uint8_t flag = 16;
+			int payloadLen;
+			uint8_t *payload;
+			if (i < count) {
+				int bytesRecv;
+				uint8_t *packet = RecvBatch_packet(&batch, i, &bytesRecv);
 
+				// Drop anything corrupted on the way
+				if (!checkPDU(packet, bytesRecv, info->headerLen)) {
+					continue;
+				}
+				memcpy(&info->serverAddr, RecvBatch_addr(&batch, i), sizeof(struct sockaddr_in6));
 
-		        return send_eof_ack_state(info, seqNum);
-		}
+				// Extract info
+				memcpy(&seqNum, packet, 4);
+				seqNum = ntohl(seqNum);
+				flag = packet[6];
+				payloadLen = bytesRecv - info->headerLen;
+				payload = packet + info->headerLen;
+				if (flag == 10) {
+					payloadLen = bytesRecv - PDU_HEADER_LEN; // never carries a CRC
+					payload = packet + PDU_HEADER_LEN;
+				}
+			} else if ((payload = FecDecoder_take(&info->parity, &seqNum, &payloadLen)) == NULL) {
+				break;
+			}
+
+			// Path MTU probe made it through, echo it so the server can size up
+			if (flag == 11) {
+				uint8_t echoPDU[7];
+				int echoLen = createPDU(echoPDU, seqNum, 12, NULL, 0);
+				sendtoErr(info->socketNum, echoPDU, echoLen, 0, (struct sockaddr *)&(info->serverAddr), info->serverLen);
+				continue;
+			}
+
+			// Handle EOF, finished once everything before it is written
+			if (flag == 10) {
+				printf("[Client] received EOF (flag 10) seq #%u.\n", seqNum);
+				info->eofSeq = seqNum;
+				if (payloadLen == DELTA_DIGEST_LEN) {
+					memcpy(info->sourceDigest, payload, DELTA_DIGEST_LEN);
+					info->digestLen = DELTA_DIGEST_LEN;
+				}
+				if (info->expected < seqNum) {
+					needSack = 1;
+				}
+				continue;
+			}
+
+			// -f: a group's parity, the packets it rebuilds are queued
+			if (flag == 19) {
+				FecDecoder_parity(&info->parity, seqNum, payload, payloadLen);
+				continue;
+			}
+
+			// Data Packet (flags 16/17/18)
+			if (flag != 16 && flag != 17 && flag != 18) {
+				continue;
+			}
+
+			// A timeout resend means the sender is stuck, tell it about every
+			// hole, even ones still inside the reordering allowance
+			if (flag == 18) {
+				fullSack = 1;
+			}
+
+			// Already written, our RR must have been lost
+			if (seqNum < info->expected) {
+				needRR = 1;
+				continue;
+			}
+
+			// -f: kept as it came, for its group's parity to rebuild the others
+			if (info->fec && seqNum < info->expected + info->windowSize) {
+				FecDecoder_store(&info->parity, seqNum, payload, payloadLen);
+			}
+
+			// -k: the packet expands on its own, into its window position's
+			// slot (writes queued from an earlier packet's slot may still be
+			// reading it, that one was expected a whole window ago)
+			if (info->compress) {
+				if (seqNum >= info->expected + info->windowSize) {
+					continue;
+				}
+				struct timespec start;
+				struct timespec end;
+				uint8_t *raw = info->expanded + (size_t)(seqNum % info->windowSize) * info->chunkSize;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				int rawLen = Compress_packet_expand(raw, info->chunkSize, payload, payloadLen);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				info->expandNs += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+				if (rawLen <= 0) {
+					continue; // malformed, as good as lost
+				}
+				info->wireBytes += payloadLen;
+				payload = raw;
+				payloadLen = rawLen;
+			}
+
+			// After a path MTU probe the payload size is whatever full packets carry
+			if (info->payloadSize == 0) {
+				if (seqNum == 1) {
+					info->firstLen = payloadLen;
+				}
+				if (payloadLen == info->chunkSize || (seqNum > 1 && info->firstLen > 0)) {
+					info->payloadSize = (payloadLen == info->chunkSize) ? payloadLen : info->firstLen;
+				}
+			}
+
+			// Can't be in flight, the sender never gets this far ahead
+			if (seqNum >= info->expected + info->windowSize) {
+				continue;
+			}
 
-		// Data Packet (flags 16/17/18)
-		if (flag == 16 || flag == 17 || flag == 18) {
 			switch (state) {
 				case IN_ORDER:
 					if (seqNum == info->expected) {
-						fwrite(payload, 1, payloadLen, info->outFile);
+						if (write_data(info, payload, payloadLen) < 0) {
+							break; // writer is full, as good as lost
+						}
+						info->stats.bytes += payloadLen;
 						info->expected++;
 						info->highest = seqNum;
-						send_rr(info, info->expected);	
-					} else if (seqNum > info->expected) {
+						needRR = 1;
+					} else {
 						buffer_packet(info, seqNum, payload, payloadLen);
 						if (seqNum > info->highest) {
 							info->highest = seqNum;
 						}
-						send_srej(info, info->expected);
+						needSack = 1;
 						state = OUT_OF_ORDER;
-						/*info->highest = seqNum;
-						send_srej(info, info->expected);
-						state = OUT_OF_ORDER;	*/
 					}
 					break;
 				case OUT_OF_ORDER:
-					if (seqNum == info->expected) {
-						fwrite(payload, 1, payloadLen, info->outFile);
-						info->expected++;
-						send_rr(info, info->expected);	
-						state = FLUSH;
-					} else if (seqNum > info->expected) {
+					if (seqNum > info->expected) {
 						buffer_packet(info, seqNum, payload, payloadLen);
 						if (seqNum > info->highest) {
 							info->highest = seqNum;
 						}
+						needSack = 1;
+						break;
 					}
-					break;
-				case FLUSH:
-					while ((info->expected <= info->highest) && (info->buffer[info->expected % info->windowSize].valid)) {
-						PacketEntry * entry = &info->buffer[info->expected % info->windowSize];
-						fwrite(entry->packet, 1, entry->packetLen, info->outFile);
-						entry->valid = 0;
-						info->expected++;
+					if (write_data(info, payload, payloadLen) < 0) {
+						break; // writer is full, as good as lost
 					}
+					info->stats.bytes += payloadLen;
+					info->expected++;
+					state = FLUSH;
+					/* fall through */
+				case FLUSH:
+					flush_window(info);
+					needRR = 1;
 				
 					if (info->expected <= info->highest) {
-						PacketEntry *entry = &info->buffer[info->expected % info->windowSize];
-						if (!entry->valid) {
-							send_srej(info, info->expected);
-							state = OUT_OF_ORDER;
-						}
+						needSack = 1;
+						state = OUT_OF_ORDER;
 					} else {
-						send_rr(info, info->expected);
 						state = IN_ORDER;
 					}
 					break;					
 			}
 		}
+
+		// One answer for the batch: RR when in order, otherwise a SACK
+		// covering every hole found so far
+		if (state == IN_ORDER && !tailMissing(info)) {
+			if (needRR) {
+				send_rr(info, info->expected);
+			}
+		} else if (needRR || needSack) {
+			send_sack(info, fullSack);
+		}
+
+		if (info->eofSeq != 0 && info->expected >= info->eofSeq) {
+			if (info->ring != NULL) {
+				Uring_submit(info->ring, &info->stats.syscalls);
+			}
+			RecvBatch_free(&batch);
+			return send_eof_ack_state(info, info->eofSeq);
+		}
+
+		if (info->part != NULL && RttEstimator_now() - info->checkpointTime >= PART_CHECKPOINT_US) {
+			checkpoint(info);
+		}
 	}
+
+	if (info->ring != NULL) {
+		Uring_submit(info->ring, &info->stats.syscalls);
+	}
+	if (info->part != NULL) {
+		checkpoint(info); // what a rerun with -R won't have to fetch again
+	}
+	RecvBatch_free(&batch);
 	return DONE;
 }
 
+// Writes the next in-order payload, returns -1 if the writer thread's ring
+// is full and it has to come again.  With -W it is queued for the writer
+// thread; with io_uring it is only queued and goes out with the next
+// receive (which waits for it before reusing the buffer), otherwise it is
+// fwrite()
+int write_data(ReceiveInfo *info, uint8_t *data, int len) {
+	if (info->writer != NULL) {
+		if (DiskWriter_push(info->writer, info->writeOffset, data, len) < 0) {
+			return -1;
+		}
+	} else if (info->ring != NULL) {
+		if (Uring_space(info->ring) == 0) {
+			Uring_submit(info->ring, &info->stats.syscalls);
+		}
+		Uring_write(info->ring, fileno(info->outFile), data, len, info->writeOffset);
+	} else if (fwrite(data, 1, len, info->outFile) != (size_t)len) {
+		info->fileErrors++;
+	}
+	info->writeOffset += len;
+	return 0;
+}
+
+// Writes out the buffered run at expected.  Returns -1 if the writer's
+// ring filled up first, what is left stays in the window for the next try.
+int flush_window(ReceiveInfo *info) {
+	if (info->expected > info->highest) {
+		return 0;
+	}
+	uint32_t run = RecvWindow_run(&info->window, info->expected, info->highest - info->expected + 1, 1);
+	// Packets written in place only move the write offset on
+	// (and stdio's position with it, before its next write)
+	int stdio = (info->writer == NULL && info->ring == NULL);
+	int held = 0;
+	int skipped = 0;
+	int full = 0;
+	for (uint32_t j = 0; j < run; j++) {
+		int packetLen;
+		uint8_t *packet = RecvWindow_peek(&info->window, info->expected, &packetLen);
+		if (packet != NULL) {
+			if (skipped && stdio) {
+				fseeko(info->outFile, info->writeOffset, SEEK_SET);
+			}
+			// Held packets (only before -m's payload size is known)
+			// are out of the window now, they wait for room in the
+			// writer's ring
+			if (write_data(info, packet, packetLen) < 0) {
+				full = 1;
+				break;
+			}
+			held = 1;
+			skipped = 0;
+		} else {
+			info->writeOffset += packetLen;
+			skipped = 1;
+		}
+		RecvWindow_take(&info->window, info->expected, &packetLen);
+		info->stats.bytes += packetLen;
+		info->expected++;
+	}
+	if (skipped && stdio) {
+		fseeko(info->outFile, info->writeOffset, SEEK_SET);
+	}
+	// Taken slots are handed out again right away, the writes out of
+	// them can't wait for the next receive
+	if (info->ring != NULL && info->writer == NULL && held) {
+		Uring_submit(info->ring, &info->stats.syscalls);
+	}
+	return full ? -1 : 0;
+}
+
+// -R: gets everything written in order onto the disk, then records it in
+// our sidecar record, so a rerun starts right behind it.  Once a write has
+// failed the record stays where it was, returns -1.
+int checkpoint(ReceiveInfo *info) {
+	if (info->writer != NULL) {
+		DiskWriter_drain(info->writer);
+	} else if (info->ring != NULL) {
+		Uring_submit(info->ring, &info->stats.syscalls);
+	} else if (fflush(info->outFile) != 0) {
+		info->fileErrors++;
+	}
+	info->checkpointTime = RttEstimator_now();
+	if (write_errors(info) > 0 || fdatasync(fileno(info->outFile)) < 0) {
+		if (!info->writeFailed) {
+			printf("ERROR: Writes to the output file failed, its progress isn't recorded.\n");
+		}
+		info->writeFailed = 1;
+		return -1;
+	}
+
+	PartRecord *record = &info->part->records[info->partIndex];
+	record->done = info->writeOffset - record->start;
+	if (PartFile_update(info->part, info->partIndex) < 0) {
+		printf("WARNING: Unable to record the copy's progress.\n");
+	}
+	return 0;
+}
+
+// Writes to the output file that failed so far (the ring's are only
+// known once they were submitted)
+uint64_t write_errors(ReceiveInfo *info) {
+	if (info->writer != NULL) {
+		return DiskWriter_errors(info->writer);
+	}
+	return (info->ring != NULL) ? info->ring->errors : info->fileErrors;
+}
+
 // -----SEND EOF ACK STATE-----
 STATE send_eof_ack_state(ReceiveInfo *info, uint32_t eofSequence) {
 	uint8_t ackPDU[7];
 	int ackLen = createPDU(ackPDU, eofSequence, 35, NULL, 0);
-	
-	sendtoErr(info->socketNum, ackPDU, ackLen, 0, (struct sockaddr *)&(info->serverAddr), info->serverLen);
+
+	// Everything is on its way to the disk (and with -R recorded) before
+	// we say so, and only if none of it failed to get there
+	if (info->part != NULL) {
+		checkpoint(info);
+	} else if (info->writer != NULL) {
+		DiskWriter_drain(info->writer);
+	} else if (fflush(info->outFile) != 0) {
+		info->fileErrors++;
+	}
+	if (info->writeFailed || write_errors(info) > 0) {
+		printf("ERROR: Writes to the output file failed, not acknowledging EOF.\n");
+		info->writeFailed = 1;
+	} else {
+		sendtoErr(info->socketNum, ackPDU, ackLen, 0, (struct sockaddr *)&(info->serverAddr), info->serverLen);
+	}
 	
 	//printf("[Client] sent EOF ACK (flag 35) for seq #%u\n", eofSequence);
-
-	// Flush
-	fflush(info->outFile);
 	fclose(info->outFile);
 	close(info->socketNum);
 
+	TransferStats_stop(&info->stats);
+	TransferStats_print(&info->stats, "Client");
+	RttEstimator_print(&info->rtt, "Client");
+	printf("[Client] out of order: %llu packets written in place, reorder buffer peak: %u packets, %llu KB\n",
+		(unsigned long long)info->placed, info->window.peakInUse,
+		(unsigned long long)RecvWindow_peak_bytes(&info->window) / 1024);
+	if (info->writer != NULL) {
+		DiskWriter_print(info->writer, "Client");
+	}
+	if (info->fec) {
+		FecDecoder_print(&info->parity, "Client");
+	}
+	if (info->compress && info->wireBytes > 0) {
+		double expandMs = info->expandNs / 1e6;
+		printf("[Client] compression: %.2fx (%.1f MB of file in %.1f MB of payload)  expanding: %.1f ms (%.0f MB/s)\n",
+			(double)info->stats.bytes / info->wireBytes, info->stats.bytes / 1e6, info->wireBytes / 1e6,
+			expandMs, (expandMs > 0) ? info->stats.bytes / 1e3 / expandMs : 0.0);
+	}
+
 	return DONE;
 }
 
+// -----Check rcopy Options-----
+// Fills in config, returns the index of the first positional argument
+int checkOptions(int argc, char *argv[], RcopyConfig *config) {
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "+c:r:GmCn:uWRdkf")) != -1) {
+		switch (opt) {
+			case 'c':
+				if (CongestionControl_find(optarg) == NULL) {
+					printf("ERROR: Unknown congestion control %s (none, reno, cubic)\n", optarg);
+					exit(-1);
+				}
+				config->congestion = optarg;
+				break;
+			case 'r':
+				config->rateCapKbps = atof(optarg) * 1000; // Mbit/s
+				if (config->rateCapKbps == 0) {
+					printf("ERROR: Invalid rate cap %s\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'G':
+				config->noGro = 1;
+				break;
+			case 'm':
+				config->pmtuProbe = 1;
+				break;
+			case 'C':
+				config->crc = 1;
+				break;
+			case 'n':
+				config->streams = atoi(optarg);
+				if (config->streams < 1 || config->streams > MAX_STREAMS) {
+					printf("ERROR: Invalid number of streams %s (1 to %d)\n", optarg, MAX_STREAMS);
+					exit(-1);
+				}
+				break;
+			case 'u':
+				config->uring = 1;
+				break;
+			case 'W':
+				config->asyncWrite = 1;
+				break;
+			case 'R':
+				config->resume = 1;
+				break;
+			case 'd':
+				config->delta = 1;
+				break;
+			case 'k':
+				config->compress = 1;
+				break;
+			case 'f':
+				config->fec = 1;
+				break;
+			default:
+				printf("Usage: %s [-c none|reno|cubic] [-r Mbit/s] [-G] [-m] [-C] [-n streams] [-u] [-W] [-R] [-d] [-k] [-f] from-filename to-filename window-size buffer-size error-rate host-name port-number \n", argv[0]);
+				exit(1);
+		}
+	}
+	if (config->delta && (config->streams > 1 || config->resume)) {
+		printf("ERROR: -d can't be combined with -n or -R.\n");
+		exit(1);
+	}
+	return optind;
+}
+
 // -----Check rcopy Command-line Argument-----
 int checkArgs(int argc, char * argv[]) {
 	// Initialize variables
@@ -396,7 +1494,7 @@ int checkArgs(int argc, char * argv[]) {
 	
         /* check command line arguments  */
 	if (argc != 8) {
-		printf("Usage: %s from-filename to-filename window-size buffer-size error-rate host-name port-number \n", argv[0]);
+		printf("Usage: %s [-c none|reno|cubic] [-r Mbit/s] [-G] [-m] [-C] [-n streams] [-u] [-W] [-R] [-d] [-k] [-f] from-filename to-filename window-size buffer-size error-rate host-name port-number \n", argv[0]);
 		exit(1);
 	}
 
@@ -406,9 +1504,15 @@ int checkArgs(int argc, char * argv[]) {
 		exit(-1);
 	}	
 
-	// Check Window Size input
-	if (atoi(argv[3]) <= 0 || atoi(argv[3]) >= pow(2, 30)) {
-		printf("ERROR: Invalid Window Size!\n");
+	// Check Window Size input, it is sent as 16 bits
+	if (atoi(argv[3]) <= 0 || atoi(argv[3]) > UINT16_MAX) {
+		printf("ERROR: Invalid Window Size (1 to %d)!\n", UINT16_MAX);
+		exit(-1);
+	}
+
+	// Check Buffer Size input, it is sent as 16 bits and a PDU must fit a datagram
+	if (atoi(argv[4]) <= 0 || atoi(argv[4]) > MAX_PAYLOAD) {
+		printf("ERROR: Invalid Buffer Size (1 to %d)!\n", MAX_PAYLOAD);
 		exit(-1);
 	}
 
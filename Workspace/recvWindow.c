@@ -0,0 +1,236 @@
+// ----- Receive Window (bitmap + lazy slot pool) -----
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recvWindow.h"
+
+#define RW_PAGE_SIZE (1u << RW_PAGE_BITS)
+
+int RecvWindow_init(RecvWindow *rw, uint32_t windowSize, int maxPayload) {
+	memset(rw, 0, sizeof(RecvWindow));
+	uint32_t words = (windowSize + 63) / 64;
+	uint32_t pages = (windowSize + RW_PAGE_SIZE - 1) / RW_PAGE_SIZE;
+
+	rw->bitmap = calloc(words, sizeof(uint64_t));
+	rw->pages = calloc(pages, sizeof(uint32_t *));
+	rw->pageUsed = calloc(pages, sizeof(uint16_t));
+	if (rw->bitmap == NULL || rw->pages == NULL || rw->pageUsed == NULL) {
+		RecvWindow_free(rw);
+		return -1;
+	}
+	rw->windowSize = windowSize;
+	rw->slotSize = (4 + maxPayload + 7) & ~7;
+	return 0;
+}
+
+static uint8_t *slot_ptr(RecvWindow *rw, uint32_t slot) {
+	return rw->chunks[slot / RW_CHUNK_SLOTS] + (size_t)(slot % RW_CHUNK_SLOTS) * rw->slotSize;
+}
+
+// Adds one more chunk of slots to the pool
+static int pool_grow(RecvWindow *rw) {
+	uint8_t **chunks = realloc(rw->chunks, (rw->chunkCount + 1) * sizeof(uint8_t *));
+	uint32_t *freeSlots = realloc(rw->freeSlots, (size_t)(rw->chunkCount + 1) * RW_CHUNK_SLOTS * sizeof(uint32_t));
+	if (chunks != NULL) {
+		rw->chunks = chunks;
+	}
+	if (freeSlots != NULL) {
+		rw->freeSlots = freeSlots;
+	}
+	if (chunks == NULL || freeSlots == NULL) {
+		return -1;
+	}
+
+	rw->chunks[rw->chunkCount] = malloc((size_t)RW_CHUNK_SLOTS * rw->slotSize);
+	if (rw->chunks[rw->chunkCount] == NULL) {
+		return -1;
+	}
+	for (int i = RW_CHUNK_SLOTS - 1; i >= 0; i--) {
+		rw->freeSlots[rw->freeCount++] = rw->chunkCount * RW_CHUNK_SLOTS + i;
+	}
+	rw->chunkCount++;
+	return 0;
+}
+
+int RecvWindow_has(RecvWindow *rw, uint32_t seq) {
+	uint32_t pos = seq % rw->windowSize;
+	return (rw->bitmap[pos >> 6] >> (pos & 63)) & 1;
+}
+
+// Buffers an out-of-order payload, returns 0 or -1 if it was already held
+// (or memory ran out)
+int RecvWindow_store(RecvWindow *rw, uint32_t seq, uint8_t *data, int len) {
+	uint32_t pos = seq % rw->windowSize;
+	uint32_t page = pos >> RW_PAGE_BITS;
+
+	if (RecvWindow_has(rw, seq) || len + 4 > rw->slotSize) {
+		return -1;
+	}
+	if (rw->freeCount == 0 && pool_grow(rw) < 0) {
+		return -1;
+	}
+	if (rw->pages[page] == NULL) {
+		rw->pages[page] = malloc(RW_PAGE_SIZE * sizeof(uint32_t));
+		if (rw->pages[page] == NULL) {
+			return -1;
+		}
+	}
+
+	uint32_t slot = rw->freeSlots[--rw->freeCount];
+	uint8_t *mem = slot_ptr(rw, slot);
+	uint32_t slotLen = len;
+	memcpy(mem, &slotLen, 4);
+	memcpy(mem + 4, data, len);
+
+	rw->pages[page][pos & (RW_PAGE_SIZE - 1)] = slot;
+	rw->pageUsed[page]++;
+	rw->bitmap[pos >> 6] |= (uint64_t)1 << (pos & 63);
+	if (++rw->inUse > rw->peakInUse) {
+		rw->peakInUse = rw->inUse;
+	}
+	return 0;
+}
+
+// Records an out-of-order packet that was written straight to the file:
+// present for the ACKs, but no payload is held.  Returns 0 or -1 if it was
+// already there (or memory ran out).
+int RecvWindow_mark(RecvWindow *rw, uint32_t seq, int len) {
+	uint32_t pos = seq % rw->windowSize;
+	uint32_t page = pos >> RW_PAGE_BITS;
+
+	if (RecvWindow_has(rw, seq)) {
+		return -1;
+	}
+	if (rw->pages[page] == NULL) {
+		rw->pages[page] = malloc(RW_PAGE_SIZE * sizeof(uint32_t));
+		if (rw->pages[page] == NULL) {
+			return -1;
+		}
+	}
+
+	rw->pages[page][pos & (RW_PAGE_SIZE - 1)] = RW_PLACED | (uint32_t)len;
+	rw->pageUsed[page]++;
+	rw->bitmap[pos >> 6] |= (uint64_t)1 << (pos & 63);
+	return 0;
+}
+
+// RecvWindow_take() without removing the packet, for a caller that may
+// not be able to use it yet.
+uint8_t *RecvWindow_peek(RecvWindow *rw, uint32_t seq, int *len) {
+	uint32_t pos = seq % rw->windowSize;
+
+	*len = 0;
+	if (!RecvWindow_has(rw, seq)) {
+		return NULL;
+	}
+
+	uint32_t slot = rw->pages[pos >> RW_PAGE_BITS][pos & (RW_PAGE_SIZE - 1)];
+	if (slot & RW_PLACED) {
+		*len = slot & ~RW_PLACED;
+		return NULL;
+	}
+	uint32_t slotLen;
+	uint8_t *mem = slot_ptr(rw, slot);
+	memcpy(&slotLen, mem, 4);
+	*len = slotLen;
+	return mem + 4;
+}
+
+// Removes a packet and sets len to its payload length.  Returns the
+// buffered bytes, valid until the next RecvWindow_store(), or NULL for a
+// packet that was only marked (or isn't there, len 0).
+uint8_t *RecvWindow_take(RecvWindow *rw, uint32_t seq, int *len) {
+	uint32_t pos = seq % rw->windowSize;
+	uint32_t page = pos >> RW_PAGE_BITS;
+
+	*len = 0;
+	if (!RecvWindow_has(rw, seq)) {
+		return NULL;
+	}
+
+	uint32_t slot = rw->pages[page][pos & (RW_PAGE_SIZE - 1)];
+	uint8_t *mem = NULL;
+	if (slot & RW_PLACED) {
+		*len = slot & ~RW_PLACED;
+	} else {
+		uint32_t slotLen;
+		mem = slot_ptr(rw, slot);
+		memcpy(&slotLen, mem, 4);
+		*len = slotLen;
+		mem += 4;
+		rw->freeSlots[rw->freeCount++] = slot;
+		rw->inUse--;
+	}
+
+	rw->bitmap[pos >> 6] &= ~((uint64_t)1 << (pos & 63));
+	if (--rw->pageUsed[page] == 0) {
+		free(rw->pages[page]);
+		rw->pages[page] = NULL;
+	}
+	return mem;
+}
+
+// Length of the run starting at seq (at most limit long) whose packets
+// are all buffered (present = 1) or all missing (present = 0).
+// Works a 64-bit word at a time using count-trailing-zeros.
+uint32_t RecvWindow_run(RecvWindow *rw, uint32_t seq, uint32_t limit, int present) {
+	uint32_t run = 0;
+	uint32_t pos = seq % rw->windowSize;
+
+	if (limit > rw->windowSize) {
+		limit = rw->windowSize;
+	}
+	while (run < limit) {
+		uint32_t bit = pos & 63;
+		uint32_t avail = 64 - bit;
+		if (avail > rw->windowSize - pos) {
+			avail = rw->windowSize - pos; // last, partial word
+		}
+
+		uint64_t word = rw->bitmap[pos >> 6];
+		if (present) {
+			word = ~word;
+		}
+		word >>= bit;
+
+		// First bit that ends the run
+		uint32_t len = word ? (uint32_t)__builtin_ctzll(word) : avail;
+		if (len > avail) {
+			len = avail;
+		}
+		run += len;
+		if (len < avail) {
+			break;
+		}
+		pos += avail;
+		if (pos == rw->windowSize) {
+			pos = 0;
+		}
+	}
+	return run < limit ? run : limit;
+}
+
+// Payload memory at the deepest point of reordering
+uint64_t RecvWindow_peak_bytes(RecvWindow *rw) {
+	return (uint64_t)rw->peakInUse * rw->slotSize;
+}
+
+void RecvWindow_free(RecvWindow *rw) {
+	uint32_t pages = (rw->windowSize + RW_PAGE_SIZE - 1) / RW_PAGE_SIZE;
+	if (rw->pages != NULL) {
+		for (uint32_t i = 0; i < pages; i++) {
+			free(rw->pages[i]);
+		}
+	}
+	for (int i = 0; i < rw->chunkCount; i++) {
+		free(rw->chunks[i]);
+	}
+	free(rw->chunks);
+	free(rw->freeSlots);
+	free(rw->pages);
+	free(rw->pageUsed);
+	free(rw->bitmap);
+	memset(rw, 0, sizeof(RecvWindow));
+}
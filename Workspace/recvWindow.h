@@ -0,0 +1,45 @@
+// 
+// Receiver reorder window.
+//
+// A presence bitmap (one bit per window position) records which
+// out-of-order packets are buffered; runs and holes are found a word at a
+// time with count-trailing-zeros.  Payload slots come from a pool that
+// grows in chunks only when a packet actually has to be held, so memory
+// follows the reordering depth instead of the advertised window size.
+// Packets already written to their place in the file are only marked
+// present (RecvWindow_mark) and take no slot at all.
+
+#ifndef __RECVWINDOW_H__
+#define __RECVWINDOW_H__
+
+#include <stdint.h>
+
+#define RW_PAGE_BITS 9    // 512 window positions per slot-index page
+#define RW_CHUNK_SLOTS 64 // payload slots added to the pool at a time
+#define RW_PLACED 0x80000000u // slot index entry: no slot, written in place, low bits = length
+
+typedef struct {
+	uint64_t *bitmap;      // bit set = packet buffered at that position
+	uint32_t windowSize;
+	uint32_t **pages;      // position -> slot number, pages made on demand
+	uint16_t *pageUsed;    // buffered packets per page, page freed at 0
+	uint8_t **chunks;      // pool memory, RW_CHUNK_SLOTS slots per chunk
+	int chunkCount;
+	uint32_t *freeSlots;   // stack of free slot numbers
+	int freeCount;
+	int slotSize;          // 4-byte length + payload
+	uint32_t inUse;
+	uint32_t peakInUse;
+} RecvWindow;
+
+int RecvWindow_init(RecvWindow *rw, uint32_t windowSize, int maxPayload);
+int RecvWindow_store(RecvWindow *rw, uint32_t seq, uint8_t *data, int len);
+int RecvWindow_mark(RecvWindow *rw, uint32_t seq, int len);
+int RecvWindow_has(RecvWindow *rw, uint32_t seq);
+uint8_t *RecvWindow_peek(RecvWindow *rw, uint32_t seq, int *len);
+uint8_t *RecvWindow_take(RecvWindow *rw, uint32_t seq, int *len);
+uint32_t RecvWindow_run(RecvWindow *rw, uint32_t seq, uint32_t limit, int present);
+uint64_t RecvWindow_peak_bytes(RecvWindow *rw);
+void RecvWindow_free(RecvWindow *rw);
+
+#endif
@@ -0,0 +1,121 @@
+// ----- RTT Estimator -----
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rttEstimator.h"
+
+// Monotonic clock in microseconds, what sent times are stamped with
+uint64_t RttEstimator_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void RttEstimator_init(RttEstimator *rtt) {
+	memset(rtt, 0, sizeof(RttEstimator));
+	rtt->rto = RTT_INITIAL_RTO_MS;
+}
+
+// Histogram bucket: power of two plus the next RTT_HIST_SUB_BITS bits
+static int bucket_of(uint64_t us) {
+	if (us < (1 << RTT_HIST_SUB_BITS)) {
+		return (int)us;
+	}
+	if (us > 0xffffffff) {
+		return RTT_HIST_BUCKETS - 1;
+	}
+	int msb = 31 - __builtin_clz((uint32_t)us);
+	int sub = (us >> (msb - RTT_HIST_SUB_BITS)) & ((1 << RTT_HIST_SUB_BITS) - 1);
+	return ((msb - RTT_HIST_SUB_BITS + 1) << RTT_HIST_SUB_BITS) + sub;
+}
+
+// Largest value that lands in a bucket
+static uint64_t bucket_top(int bucket) {
+	if (bucket < (1 << RTT_HIST_SUB_BITS)) {
+		return bucket;
+	}
+	int shift = (bucket >> RTT_HIST_SUB_BITS) - 1;
+	uint64_t sub = bucket & ((1 << RTT_HIST_SUB_BITS) - 1);
+	return (((1 << RTT_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+// One measurement for a packet sent (once) at sentTime
+void RttEstimator_sample(RttEstimator *rtt, uint64_t sentTime) {
+	uint64_t now = RttEstimator_now();
+	if (now < sentTime) {
+		return;
+	}
+	uint64_t r = now - sentTime;
+
+	if (rtt->samples == 0) {
+		rtt->srtt = r;
+		rtt->rttvar = r / 2.0;
+		rtt->minRtt = r;
+	} else {
+		double err = (double)r - rtt->srtt;
+		rtt->rttvar += ((err < 0 ? -err : err) - rtt->rttvar) / 4;
+		rtt->srtt += err / 8;
+		if (r < rtt->minRtt) {
+			rtt->minRtt = r;
+		}
+	}
+	rtt->samples++;
+	rtt->sumRtt += r;
+	rtt->hist[bucket_of(r)]++;
+
+	// RTO = SRTT + 4 * RTTVAR, rounded up to what pollCall can wait
+	int rto = (int)((rtt->srtt + 4 * rtt->rttvar + 999) / 1000);
+	if (rto < RTT_MIN_RTO_MS) {
+		rto = RTT_MIN_RTO_MS;
+	} else if (rto > RTT_MAX_RTO_MS) {
+		rto = RTT_MAX_RTO_MS;
+	}
+	rtt->rto = rto;
+	rtt->backoff = 0;
+}
+
+// Milliseconds to wait before the next retransmission
+int RttEstimator_timeout(RttEstimator *rtt) {
+	int rto = rtt->rto;
+	for (int i = 0; i < rtt->backoff && rto < RTT_MAX_RTO_MS; i++) {
+		rto *= 2;
+	}
+	return rto < RTT_MAX_RTO_MS ? rto : RTT_MAX_RTO_MS;
+}
+
+// The timer expired, wait twice as long next time
+void RttEstimator_backoff(RttEstimator *rtt) {
+	if (RttEstimator_timeout(rtt) < RTT_MAX_RTO_MS) {
+		rtt->backoff++;
+	}
+}
+
+// Upper edge of the bucket holding the given fraction of samples
+uint64_t RttEstimator_percentile(RttEstimator *rtt, double fraction) {
+	uint64_t target = (uint64_t)(rtt->samples * fraction);
+	uint64_t seen = 0;
+
+	if (target >= rtt->samples && rtt->samples > 0) {
+		target = rtt->samples - 1;
+	}
+	for (int i = 0; i < RTT_HIST_BUCKETS; i++) {
+		seen += rtt->hist[i];
+		if (seen > target) {
+			return bucket_top(i);
+		}
+	}
+	return 0;
+}
+
+void RttEstimator_print(RttEstimator *rtt, const char *who) {
+	if (rtt->samples == 0) {
+		printf("[%s] rtt: no samples  rto: %d ms\n", who, RttEstimator_timeout(rtt));
+		return;
+	}
+	printf("[%s] rtt min/avg/p99: %.3f/%.3f/%.3f ms  rto: %d ms  samples: %llu\n", who,
+		rtt->minRtt / 1000.0, (double)rtt->sumRtt / rtt->samples / 1000.0,
+		RttEstimator_percentile(rtt, 0.99) / 1000.0, RttEstimator_timeout(rtt),
+		(unsigned long long)rtt->samples);
+}
@@ -0,0 +1,41 @@
+// 
+// Round-trip time estimator and retransmission timer (RFC 6298).
+//
+// Each transfer owns one RttEstimator.  Samples feed the smoothed RTT
+// and its variance, which give the RTO every wait hands to pollCall().
+// Only packets that were sent exactly once may be sampled (Karn's rule);
+// each expiry doubles the RTO until the next valid sample.  A log-scale
+// histogram of the samples gives the min/avg/p99 summary.
+
+#ifndef __RTTESTIMATOR_H__
+#define __RTTESTIMATOR_H__
+
+#include <stdint.h>
+
+#define RTT_INITIAL_RTO_MS 1000 // before the first sample
+#define RTT_MIN_RTO_MS 5
+#define RTT_MAX_RTO_MS 8000
+#define RTT_GIVE_UP_MS 10000    // peer silent this long is gone
+#define RTT_HIST_SUB_BITS 3     // 8 buckets per power of two (~12% wide)
+#define RTT_HIST_BUCKETS (32 << RTT_HIST_SUB_BITS)
+
+typedef struct {
+	double srtt;        // microseconds
+	double rttvar;      // microseconds
+	int rto;            // milliseconds, backoff not included
+	int backoff;        // expiries since the last valid sample
+	uint64_t samples;
+	uint64_t minRtt;    // microseconds
+	uint64_t sumRtt;
+	uint32_t hist[RTT_HIST_BUCKETS];
+} RttEstimator;
+
+uint64_t RttEstimator_now(void);
+void RttEstimator_init(RttEstimator *rtt);
+void RttEstimator_sample(RttEstimator *rtt, uint64_t sentTime);
+int RttEstimator_timeout(RttEstimator *rtt);
+void RttEstimator_backoff(RttEstimator *rtt);
+uint64_t RttEstimator_percentile(RttEstimator *rtt, double fraction);
+void RttEstimator_print(RttEstimator *rtt, const char *who);
+
+#endif
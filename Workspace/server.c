@@ -5,11 +5,21 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <getopt.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "pollLib.h"
 #include "gethostbyname.h"
@@ -19,42 +29,173 @@
 #include "checksum.h"
 #include "cpe464.h"
 #include "circularQueue.h"
-
+#include "batchIO.h"
+#include "transferStats.h"
+#include "rttEstimator.h"
+#include "congestion.h"
+#include "pacer.h"
+#include "uringIO.h"
+#include "prefetch.h"
+#include "delta.h"
+#include "compress.h"
+#include "fastChecksum.h"
+#include "fec.h"
+
+
+#define SREJ_LIST_MAX 256 // lost ranges (SREJ or SACK blocks) acted on per ACK pass
+#define EVENT_MAX 64      // epoll events taken per wakeup (-e)
+#define CTRL_TIMEOUTS 10  // file OK ACK waits / EOF resends before giving up
+#define WORKER_MAX 64     // worker threads (-w)
+#define LOAD_REPORT_SEC 5 // per-worker load report interval (-w)
 
 typedef enum State STATE;
 enum State {
-	START, FILENAME, WRITE_FILE_OK_ACK, SEND_DATA, WAIT_ON_ACK, WAIT_ON_EOF_ACK, RESEND_EOF, DONE
+	START, FILENAME, WRITE_FILE_OK_ACK, PMTU_PROBE, SEND_DATA, WAIT_ON_ACK, WAIT_ON_EOF_ACK, RESEND_EOF, DONE
+};
+
+// Why a state runs: it was just entered, its socket has something to read
+// or the deadline it set passed.  States never block, they set a deadline
+// and return, so one process can drive any number of transfers.
+typedef enum Event EVENT;
+enum Event {
+	ENTER, READABLE, TIMER
 };
 
 
+// ----- ServerConfig Struct-----
+typedef struct {
+	float errorRate;
+	int portNumber;
+	int zeroCopy;    // -z: mmap the file, slots hold only headers
+	int msgZeroCopy; // -Z: also send with MSG_ZEROCOPY (implies -z)
+	const char *congestion; // -c: controller for clients that don't pick one
+	int traceCwnd;   // -T: log cwnd over time to cwnd-<pid>[-<client port>].trace
+	PACE_MODE pacing; // -p: off, timer or txtime
+	double rateCap;  // -r: bytes/s no transfer may exceed, 0 = none
+	int gso;         // UDP_SEGMENT offload, -G turns it off
+	int eventLoop;   // -e: one process serves every client with epoll
+	int uring;       // -u: io_uring for the data path's socket and file I/O
+	int workers;     // -w: worker threads, each an event loop on its own SO_REUSEPORT shard
+	int pinWorkers;  // -a: pin worker i to core i
+	int readAhead;   // read-ahead thread for the plain read path, -F turns it off
+	const char *cacheDir; // -k: compressed blocks of whole-file transfers are kept here
+} ServerConfig;
+
+// ----- Worker Threads (-w) -----
+// A worker's event loop publishes its load here, the main thread reads it
+// for the load report (relaxed atomics, the numbers only need to be recent)
+typedef struct {
+	uint64_t sessions;  // sessions started
+	uint64_t active;    // sessions running now
+	uint64_t bytes;     // payload bytes sent, finished sessions included
+} WorkerLoad;
+
+typedef struct {
+	int id;
+	int cpu;            // core it is pinned to, -1 = not pinned
+	int socketNum;      // its listener shard
+	pthread_t thread;
+	ServerConfig *config;
+	WorkerLoad load;
+} Worker;
+
 // ----- Function Prototypes -----
-void processServer(char *argv[], int socketNum);
-void processClient(char *argv[], struct sockaddr_in6 clientAddr, int socketNum, uint8_t *buffer, int bytesRecv);
-int checkArgs(int argc, char *argv[]);
+void processServer(ServerConfig *config, int socketNum);
+void processServerEvents(ServerConfig *config, int socketNum, WorkerLoad *load);
+void processServerWorkers(ServerConfig *config, int socketNum);
+void *runWorker(void *arg);
+int shardSetup(int serverPort);
+void processClient(ServerConfig *config, struct sockaddr_in6 clientAddr, int socketNum, uint8_t *buffer, int bytesRecv);
+int checkArgs(int argc, char *argv[], ServerConfig *config);
 float getErrorRate(int argc, char *argv[]);
 
 
 
 // ----- ServerInfo Struct-----
+// One transfer (session): where its state machine is and everything the
+// states keep between events
 typedef struct {
+	STATE state;
+	uint64_t deadline;   // when the state wants a TIMER event (us), 0 = never
 	int childSocket;
 	FILE *file;
 	struct sockaddr_in6 clientAddr;
 	uint16_t windowSize;
 	uint16_t bufferSize;
 	int eofLen;
-	uint8_t eofPacket[MAXBUF+7];
+	uint8_t eofPacket[PDU_HEADER_LEN + DELTA_DIGEST_LEN];
 	uint32_t eofSeq;
 	int eofResendCount;
+	int ctrlTimeouts;    // file OK ACK waits that ran out
+	TransferStats stats;
+	uint8_t *fileMap;    // zero-copy mode: the whole file, read-only
+	uint64_t fileSize;
+	int msgZeroCopy;     // sends from the window use MSG_ZEROCOPY
+	RecvBatch *ackBatch; // RR/SREJs are drained through this (shared with -e)
+	CircularQueue window; // sent and not yet ACKed
+	RttEstimator rtt;    // sets every timeout of this transfer
+	uint32_t resendMark; // packets below this went out before the last retransmission
+	uint64_t ctrlSentTime; // when the file OK / EOF was (first) sent
+	CongestionControl cc;  // how much of the window may be in flight
+	uint32_t lostNext;     // after a timeout [lostNext, lostEnd) is presumed
+	uint32_t lostEnd;      // lost and gets resent as cwnd opens up again
+	Pacer pacer;           // spreads the window out over the RTT
+	int gso;               // data goes out as UDP_SEGMENT runs
+	int pmtuProbe;         // client asked us to size PDUs to the path MTU
+	int headerLen;         // data PDU header: 7, or 11 with a CRC32C
+	uint64_t rangeStart;   // the part of the file this transfer sends, all
+	uint64_t rangeEnd;     // of it unless the client asked for a stripe
+	// send data state
+	uint32_t nextSeq;      // sequence number of the next new packet
+	int eofReached;        // the whole range has been read
+	uint64_t fileOffset;   // where the next new packet's payload starts
+	uint64_t fileEnd;
+	uint64_t lastHeard;    // last ACK from the client
+	uint64_t rtoDeadline;  // retransmission timer while blocked, 0 = not armed
+	// pmtu probe state
+	uint8_t *probe;
+	int probeLow;          // largest size known to get through
+	int probeHigh;         // largest size that might
+	int probeSize;         // size being tried
+	int probeTries;
+	uint32_t rwnd;         // receiver's window: packets it can take past Base
+	// io_uring backend
+	Uring *ring;           // NULL = plain system calls
+	uint32_t readNext;     // window slots before this are read ahead
+	uint64_t readOffset;   // file offset of the next read ahead
+	int *readLen;          // payload read into each slot, by sequence % window
+	// read-ahead thread (plain read path)
+	int readAhead;         // start one on entering SEND_DATA
+	Prefetch prefetch;     // blocks == NULL = not running, fread in the send loop
+	// delta copy (rcopy -d)
+	int deltaBlock;        // block size, 0 = plain transfer
+	PrefetchRange *deltaRanges; // the blocks asked for, NULL = send their signatures
+	int deltaRangeCount;
+	// compression (rcopy -k)
+	int compress;          // every packet carries a compressed chunk
+	const char *cacheDir;  // where whole-file transfers keep their compressed blocks, NULL = nowhere
+	// forward error correction (rcopy -f)
+	int fec;               // parity packets follow groups of new data packets
+	FecEncoder parity;
 } ServerInfo;
 
 // ----- STATE MACHINE ----
-STATE filename_state(char *argv[], int socketNum, uint8_t *buffer, int bytesRecv, ServerInfo *info);
-STATE write_file_ok_ack_state(ServerInfo *info);
-STATE send_data_state(CircularQueue *window, ServerInfo *info);
+STATE filename_state(ServerConfig *config, uint8_t *buffer, int bytesRecv, ServerInfo *info);
+STATE write_file_ok_ack_state(ServerInfo *info, EVENT event);
+STATE pmtu_probe_state(ServerInfo *info, EVENT event);
+STATE send_data_state(ServerInfo *info, EVENT event);
 STATE wait_on_ack_state(CircularQueue *window, ServerInfo *info);
-STATE wait_on_eof_ack_state(CircularQueue *window, ServerInfo *info);
-STATE resend_eof_state(CircularQueue *window, ServerInfo *info);
+STATE wait_on_eof_ack_state(ServerInfo *info, EVENT event);
+STATE resend_eof_state(ServerInfo *info, EVENT event);
+
+void enter_state(ServerInfo *info, STATE next);
+void run_session(ServerInfo *info, EVENT event);
+void finish_session(ServerInfo *info);
+void resend_packet(CircularQueue *window, ServerInfo *info, SendBatch *batch, QueueEntry *entry, uint8_t flag);
+void update_pacing_rate(ServerInfo *info);
+uint32_t in_flight(CircularQueue *window, ServerInfo *info);
+void read_ahead(ServerInfo *info);
+PrefetchRange *parseBlocks(uint8_t *options, int optionsLen, uint32_t blockSize, uint64_t fileSize, int *count);
 
 void handleZombies(int signal) {
 	while (waitpid(-1, NULL, WNOHANG) > 0);
@@ -64,20 +205,34 @@ void handleZombies(int signal) {
 // ===== Main =====
 int main (int argc, char *argv[]) { 
 	int mainSocketNum = 0;				
-	int portNumber = 0;
-	float errorRate = 0.0;
+	ServerConfig config = {0};
+	config.congestion = CC_DEFAULT;
+	config.pacing = PACE_TIMER;
+	config.gso = 1;
+	config.readAhead = 1;
 	
 	// Grab a port number and a socket number
-	portNumber = checkArgs(argc, argv);
-	mainSocketNum = udpServerSetup(portNumber);
+	checkArgs(argc, argv, &config);
+	if (config.workers > 0) {
+		mainSocketNum = shardSetup(config.portNumber);
+	} else {
+		mainSocketNum = udpServerSetup(config.portNumber);
+	}
 
 	// Initialize sendError
-	errorRate = getErrorRate(argc, argv);
-	sendErr_init(errorRate, DROP_ON, FLIP_ON, DEBUG_ON, RSEED_OFF);
+	config.errorRate = getErrorRate(argc, argv);
+	sendErr_init(config.errorRate, DROP_ON, FLIP_ON, DEBUG_ON, RSEED_OFF);
+	sendmmsgErr_init(config.errorRate);
 	//sendErr_init(errorRate, DROP_OFF, FLIP_OFF, DEBUG_ON, RSEED_OFF);
 
 	// Where everything starts 
-	processServer(argv, mainSocketNum);
+	if (config.workers > 0) {
+		processServerWorkers(&config, mainSocketNum);
+	} else if (config.eventLoop) {
+		processServerEvents(&config, mainSocketNum, NULL);
+	} else {
+		processServer(&config, mainSocketNum);
+	}
 	
 	// Close socketi
 	close(mainSocketNum);
@@ -85,7 +240,7 @@ int main (int argc, char *argv[]) {
 	return 0;
 }
 
-void processServer(char *argv[], int socketNum) {
+void processServer(ServerConfig *config, int socketNum) {
 	pid_t pid = 0;
 	uint8_t buffer[MAXBUF];
 	uint8_t flag = 0;
@@ -109,16 +264,17 @@ void processServer(char *argv[], int socketNum) {
 			continue;
 		}
 
-		// Check Flag
+		// Check Flag, a corrupted request is dropped (the client asks again)
 		flag = buffer[6];
-		if (flag == 8) {
+		if (flag == 8 && checkPDU(buffer, bytesRecv, PDU_HEADER_LEN)) {
 			pid = fork();
 			if (pid < 0) {
 				printf("ERROR: pid failed.\n");
 				exit(-1);
 			} else if (pid == 0) {
 				// ----- Child -----
-				processClient(argv, clientAddr, socketNum, buffer, bytesRecv);
+				processClient(config, clientAddr, socketNum, buffer, bytesRecv);
+				exit(0);
 			} else {
 				// ----- Parent -----
 				continue;
@@ -128,84 +284,436 @@ void processServer(char *argv[], int socketNum) {
 }
 
 
-void processClient(char *argv[], struct sockaddr_in6 clientAddr, int socketNum, uint8_t *buffer, int bytesRecv) {
-	STATE state = START; // State Transition
- 
+// One forked child runs one session: sleep until its socket is readable or
+// its deadline passes, run the state for that, repeat
+void processClient(ServerConfig *config, struct sockaddr_in6 clientAddr, int socketNum, uint8_t *buffer, int bytesRecv) {
 	// -----Setup Struct-----
 	ServerInfo info = {0};
 	info.clientAddr = clientAddr;
+	RttEstimator_init(&info.rtt);
+	close(socketNum); // close main socket
 
-	// -----Initialize CircularQueue-----
-	CircularQueue window;
-	//CircularQueue_init(&window, info.windowSize);
+	RecvBatch ackBatch;
+	if (RecvBatch_init(&ackBatch, -1, MAXBUF + 7, NULL) < 0) {
+		printf("ERROR: Unable to allocate the ACK buffers.\n");
+		return;
+	}
+	info.ackBatch = &ackBatch;
 
-	while (state != DONE) {
-		switch (state) {
-			case START:
-				state = FILENAME;
-				break;
-			case FILENAME:
-				state = filename_state(argv, socketNum, buffer, bytesRecv, &info);
-				break;
+	Uring ring;
+	if (config->uring) {
+		if (Uring_init(&ring) < 0) {
+			printf("WARNING: io_uring not available, using plain system calls.\n");
+		} else {
+			info.ring = &ring;
+		}
+	}
+
+	enter_state(&info, filename_state(config, buffer, bytesRecv, &info));
+	setupPollSet();
+	addToPollSet(info.childSocket);
+
+	while (info.state != DONE) {
+		EVENT event = TIMER;
+		uint64_t now = RttEstimator_now();
+		if (info.deadline == 0) {
+			event = (pollCall(POLL_WAIT_FOREVER) > 0) ? READABLE : TIMER;
+		} else if (info.deadline <= now) {
+			event = (pollCall(0) > 0) ? READABLE : TIMER;
+		} else if (info.deadline - now < 1000) {
+			// Sub-millisecond pacing holds are slept, poll() can't time them
+			if (pollCall(0) > 0) {
+				event = READABLE;
+			} else {
+				Pacer_sleep(info.deadline - now);
+			}
+		} else {
+			event = (pollCall((info.deadline - now) / 1000) > 0) ? READABLE : TIMER;
+		}
+		run_session(&info, event);
+	}
+
+	finish_session(&info);
+	RecvBatch_free(&ackBatch);
+	if (info.ring != NULL) {
+		Uring_free(info.ring);
+	}
+}
+
+// ----- Event Loop Server (-e) -----
+// A single process serves every client.  Each session's state machine runs
+// when epoll says its socket is readable and when its deadline passes; one
+// timerfd is set to the earliest deadline of all sessions.  A worker
+// thread (-w) runs one of these on its listener shard and reports to load.
+void processServerEvents(ServerConfig *config, int socketNum, WorkerLoad *load) {
+	uint8_t buffer[MAXBUF];
+	struct sockaddr_in6 clientAddr;
+	int clientLen;
+	int bytesRecv;
+	ServerInfo **sessions = NULL;
+	int sessionCount = 0;
+	int sessionMax = 0;
+	uint64_t finishedBytes = 0;
+
+	int epollFd = epoll_create1(0);
+	int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (epollFd < 0 || timerFd < 0) {
+		perror("epoll");
+		exit(-1);
+	}
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // new requests
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, socketNum, &ev);
+	ev.data.ptr = &timerFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+
+	// Sessions run one at a time, so they all drain ACKs through one ring
+	// of buffers and share one io_uring
+	RecvBatch ackBatch;
+	if (RecvBatch_init(&ackBatch, -1, MAXBUF + 7, NULL) < 0) {
+		printf("ERROR: Unable to allocate the ACK buffers.\n");
+		exit(-1);
+	}
+	Uring ring;
+	Uring *sharedRing = NULL;
+	if (config->uring) {
+		if (Uring_init(&ring) < 0) {
+			printf("WARNING: io_uring not available, using plain system calls.\n");
+		} else {
+			sharedRing = &ring;
+		}
+	}
+
+	while (1) {
+		struct epoll_event events[EVENT_MAX];
+		int count = epoll_wait(epollFd, events, EVENT_MAX, -1);
+		if (count < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(-1);
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.ptr == &timerFd) {
+				uint64_t expirations;
+				if (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+					// already drained
+				}
+			} else if (events[i].data.ptr != NULL) {
+				ServerInfo *info = events[i].data.ptr;
+				if (info->state != DONE) {
+					run_session(info, READABLE);
+				}
+			} else {
+				// Every request queued on the main socket starts a session
+				clientLen = sizeof(clientAddr);
+				while ((bytesRecv = recvfrom(socketNum, buffer, MAXBUF, MSG_DONTWAIT, (struct sockaddr *) &clientAddr, (socklen_t *) &clientLen)) >= 0) {
+					printf("received filename.\n");
+					if (buffer[6] != 8 || !checkPDU(buffer, bytesRecv, PDU_HEADER_LEN)) {
+						continue;
+					}
+					if (sessionCount == sessionMax) {
+						sessionMax = sessionMax ? sessionMax * 2 : 64;
+						sessions = srealloc(sessions, sessionMax * sizeof(ServerInfo *));
+					}
+					ServerInfo *info = sCalloc(1, sizeof(ServerInfo));
+					info->clientAddr = clientAddr;
+					info->ackBatch = &ackBatch;
+					info->ring = sharedRing;
+					RttEstimator_init(&info->rtt);
+					enter_state(info, filename_state(config, buffer, bytesRecv, info));
+					ev.data.ptr = info;
+					if (info->childSocket > 0) {
+						epoll_ctl(epollFd, EPOLL_CTL_ADD, info->childSocket, &ev);
+					}
+					sessions[sessionCount++] = info;
+					clientLen = sizeof(clientAddr);
+					if (load != NULL) {
+						__atomic_add_fetch(&load->sessions, 1, __ATOMIC_RELAXED);
+					}
+				}
+			}
+		}
+
+		// Deadlines that passed, finished sessions, and the next deadline
+		uint64_t now = RttEstimator_now();
+		uint64_t next = 0;
+		uint64_t bytes = finishedBytes;
+		for (int s = 0; s < sessionCount; ) {
+			ServerInfo *info = sessions[s];
+			if (info->state != DONE && info->deadline != 0 && info->deadline <= now) {
+				run_session(info, TIMER);
+			}
+			if (info->state == DONE) {
+				finishedBytes += info->stats.bytes;
+				bytes += info->stats.bytes;
+				finish_session(info); // closing the socket takes it out of epoll
+				free(info);
+				sessions[s] = sessions[--sessionCount];
+				continue;
+			}
+			bytes += info->stats.bytes;
+			if (info->deadline != 0 && (next == 0 || info->deadline < next)) {
+				next = info->deadline;
+			}
+			s++;
+		}
+		if (load != NULL) {
+			__atomic_store_n(&load->active, sessionCount, __ATOMIC_RELAXED);
+			__atomic_store_n(&load->bytes, bytes, __ATOMIC_RELAXED);
+		}
+
+		struct itimerspec timer = {0};
+		if (next != 0) {
+			timer.it_value.tv_sec = next / 1000000;
+			timer.it_value.tv_nsec = (next % 1000000) * 1000;
+		}
+		timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+	}
+}
+
+// ----- Worker Threads (-w) -----
+// Every worker owns a SO_REUSEPORT listener on the server port, so the
+// kernel spreads new requests over them by client address, and runs the
+// event loop for the sessions its shard accepts.  The main thread only
+// reports their load.
+void processServerWorkers(ServerConfig *config, int socketNum) {
+	Worker workers[WORKER_MAX];
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	struct sockaddr_in6 addr;
+	socklen_t addrLen = sizeof(addr);
+	getsockname(socketNum, (struct sockaddr *)&addr, &addrLen);
+	printf("Server using Port #: %d  workers: %d\n", ntohs(addr.sin6_port), config->workers);
+
+	// Kernels are picked before the threads race to do it
+	FastChecksum_name();
+
+	for (int i = 0; i < config->workers; i++) {
+		Worker *worker = &workers[i];
+		memset(worker, 0, sizeof(Worker));
+		worker->id = i;
+		worker->config = config;
+		worker->cpu = (config->pinWorkers && cores > 0) ? i % cores : -1;
+		worker->socketNum = (i == 0) ? socketNum : shardSetup(ntohs(addr.sin6_port));
+		if (pthread_create(&worker->thread, NULL, runWorker, worker) != 0) {
+			printf("ERROR: Unable to start worker %d.\n", i);
+			exit(-1);
+		}
+	}
+
+	// Load report: what each worker did over the last interval, printed
+	// while anything is happening
+	uint64_t lastBytes[WORKER_MAX] = {0};
+	uint64_t lastCpu[WORKER_MAX] = {0};
+	uint64_t lastSessions[WORKER_MAX] = {0};
+	while (1) {
+		sleep(LOAD_REPORT_SEC);
+		double rates[WORKER_MAX];
+		double busy[WORKER_MAX];
+		uint64_t sessions[WORKER_MAX];
+		uint64_t active[WORKER_MAX];
+		int idle = 1;
+		for (int i = 0; i < config->workers; i++) {
+			Worker *worker = &workers[i];
+			uint64_t bytes = __atomic_load_n(&worker->load.bytes, __ATOMIC_RELAXED);
+			sessions[i] = __atomic_load_n(&worker->load.sessions, __ATOMIC_RELAXED);
+			active[i] = __atomic_load_n(&worker->load.active, __ATOMIC_RELAXED);
+
+			clockid_t clock;
+			struct timespec ts = {0};
+			if (pthread_getcpuclockid(worker->thread, &clock) == 0) {
+				clock_gettime(clock, &ts);
+			}
+			uint64_t cpu = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+			rates[i] = (bytes - lastBytes[i]) * 8.0 / (LOAD_REPORT_SEC * 1e6);
+			busy[i] = (cpu - lastCpu[i]) / (LOAD_REPORT_SEC * 1e4);
+			if (active[i] > 0 || sessions[i] != lastSessions[i]) {
+				idle = 0;
+			}
+			lastBytes[i] = bytes;
+			lastCpu[i] = cpu;
+			lastSessions[i] = sessions[i];
+		}
+		if (idle) {
+			continue;
+		}
+
+		double total = 0;
+		double peak = 0;
+		for (int i = 0; i < config->workers; i++) {
+			printf("[Worker %d] cpu: %d  sessions: %llu (%llu active)  rate: %.2f Mbit/s  busy: %.1f%%\n", i, workers[i].cpu,
+				(unsigned long long)sessions[i], (unsigned long long)active[i], rates[i], busy[i]);
+			total += rates[i];
+			if (rates[i] > peak) {
+				peak = rates[i];
+			}
+		}
+		// 1.0 = evenly spread, workers = one worker doing everything
+		printf("[Workers] rate: %.2f Mbit/s  imbalance (max/mean): %.2f\n", total,
+			total > 0 ? peak / (total / config->workers) : 0.0);
+		fflush(stdout);
+	}
+}
+
+void *runWorker(void *arg) {
+	Worker *worker = arg;
+	if (worker->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+			printf("WARNING: Unable to pin worker %d to core %d.\n", worker->id, worker->cpu);
+			worker->cpu = -1;
+		}
+	}
+	processServerEvents(worker->config, worker->socketNum, &worker->load);
+	return NULL;
+}
+
+// udpServerSetup() with SO_REUSEPORT set before the bind, so every worker
+// can bind its own socket to the same port
+int shardSetup(int serverPort) {
+	struct sockaddr_in6 serverAddress;
+	int one = 1;
+
+	int socketNum = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (socketNum < 0) {
+		perror("socket() call error");
+		exit(-1);
+	}
+	if (setsockopt(socketNum, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		perror("SO_REUSEPORT");
+		exit(-1);
+	}
+
+	memset(&serverAddress, 0, sizeof(struct sockaddr_in6));
+	serverAddress.sin6_family = AF_INET6;
+	serverAddress.sin6_addr = in6addr_any;
+	serverAddress.sin6_port = htons(serverPort); // if 0 = os picks
+	if (bind(socketNum, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0) {
+		perror("bind() call error");
+		exit(-1);
+	}
+	return socketNum;
+}
+
+// Moves a session to next and enters it, following every state it hands
+// over to straight away, until one waits for its socket or a deadline
+void enter_state(ServerInfo *info, STATE next) {
+	while (next != info->state) {
+		info->state = next;
+		info->deadline = 0;
+		if (next == DONE) {
+			break;
+		}
+		switch (next) {
 			case WRITE_FILE_OK_ACK:
-				state = write_file_ok_ack_state(&info); 
+				next = write_file_ok_ack_state(info, ENTER);
 				break;
-			case SEND_DATA:
-				CircularQueue_init(&window, info.windowSize);
-				state = send_data_state(&window, &info);
+			case PMTU_PROBE:
+				next = pmtu_probe_state(info, ENTER);
 				break;
-			case WAIT_ON_ACK:
-				state = wait_on_ack_state(&window, &info);
+			case SEND_DATA:
+				next = send_data_state(info, ENTER);
 				break;
 			case WAIT_ON_EOF_ACK:
-				state = wait_on_eof_ack_state(&window, &info);
+				next = wait_on_eof_ack_state(info, ENTER);
 				break;
 			case RESEND_EOF:
-				state = resend_eof_state(&window, &info);
+				next = resend_eof_state(info, ENTER);
 				break;
-			case DONE:
-				printf("DONE.\n");
-				return;
 			default:
 				printf("ERROR: You should not be here!\n");
-				state = DONE;
+				next = DONE;
 				break;
 		}
 	}
+}
 	
-	if (info.windowSize > 0) {
-		CircularQueue_free(&window);
+// Runs the session's current state for event
+void run_session(ServerInfo *info, EVENT event) {
+	STATE next = DONE;
+	switch (info->state) {
+		case WRITE_FILE_OK_ACK:
+			next = write_file_ok_ack_state(info, event);
+			break;
+		case PMTU_PROBE:
+			next = pmtu_probe_state(info, event);
+			break;
+		case SEND_DATA:
+			next = send_data_state(info, event);
+			break;
+		case WAIT_ON_EOF_ACK:
+			next = wait_on_eof_ack_state(info, event);
+			break;
+		default:
+			next = DONE;
+			break;
 	}
+	enter_state(info, next);
+}
 
-	//printf("[Server] EOF ACK received and child exiting cleanly.\n");
-	// clean up
-	/*if (info.file) {
-		fclose(info.file);
+// Prints the transfer's stats and lets go of everything it holds
+void finish_session(ServerInfo *info) {
+	if (info->ring != NULL) {
+		Uring_remove_buffer(info->ring, info->window.arena);
+		Uring_remove_file(info->ring, info->childSocket);
+		if (info->file != NULL) {
+			Uring_remove_file(info->ring, fileno(info->file));
+		}
 	}
-	
-	if (info.childSocket != -1) {
-		close(info.childSocket);
-	}*/
-	fclose(info.file);
-	close(info.childSocket); // 1st change before //close(info.childSocket);
-	
+	free(info->readLen);
+	Prefetch_free(&info->prefetch);
+	free(info->deltaRanges);
+	FecEncoder_free(&info->parity);
+	if (info->window.entries != NULL) {
+		CircularQueue_free(&info->window);
+	}
+
+	if (info->stats.packets > 0) {
+		TransferStats_stop(&info->stats);
+		info->stats.fileSyscalls += info->prefetch.reads; // made on the reader's thread
+		TransferStats_print(&info->stats, "Server");
+		RttEstimator_print(&info->rtt, "Server");
+		CongestionControl_print(&info->cc, "Server");
+		Pacer_print(&info->pacer, "Server");
+		if (info->prefetch.blockCount > 0) {
+			Prefetch_print(&info->prefetch, "Server");
+		}
+		if (info->fec) {
+			FecEncoder_print(&info->parity, "Server");
+		}
+	}
+	CongestionControl_free(&info->cc);
+
+	if (info->fileMap != NULL) {
+		munmap(info->fileMap, info->fileSize);
+	}
+	if (info->file != NULL) {
+		fclose(info->file);
+	}
+	free(info->probe); // a probe cut short
+	close(info->childSocket); // 1st change before //close(info.childSocket);
 }
 
 // -----FILENAME STATE-----
-STATE filename_state(char *argv[], int socketNum, uint8_t *buffer, int bytesRecv, ServerInfo *info) {
+STATE filename_state(ServerConfig *config, uint8_t *buffer, int bytesRecv, ServerInfo *info) {
 	STATE returnValue = DONE;
-
-	// ----- Child -----
-	close(socketNum); // close main socket
 			
-	// Initialize sendErr_init
-	sendErr_init(atof(argv[1]), DROP_ON, FLIP_ON, DEBUG_ON, RSEED_ON);	
-	//sendErr_init(atof(argv[1]), DROP_OFF, FLIP_OFF, DEBUG_ON, RSEED_OFF);	
+	// Initialize sendErr_init, a forked child reseeds its own copy; -e and -w
+	// sessions share the process's loss layer that main set up (and -w's
+	// threads would race on it)
+	if (!config->eventLoop && config->workers == 0) {
+		sendErr_init(config->errorRate, DROP_ON, FLIP_ON, DEBUG_ON, RSEED_ON);	
+		sendmmsgErr_init(config->errorRate);
+	}
+	//sendErr_init(config->errorRate, DROP_OFF, FLIP_OFF, DEBUG_ON, RSEED_OFF);	
 
 	info->childSocket = udpServerSetup(0);// socket(AF_INET6, SOCK_DGRAM, 0);
 	if (info->childSocket < 0) {
 		printf("ERROR: Child Socket failed.\n");
-		exit(-1);
+		return DONE;
 	}	
 
 	// Passing the child socket for the specific client
@@ -219,12 +727,78 @@ STATE filename_state(char *argv[], int socketNum, uint8_t *buffer, int bytesRecv
 	memcpy(&bufferSize, buffer + 9, 2);
 	info->windowSize = ntohs(windowSize);
 	info->bufferSize = ntohs(bufferSize);
+	if (info->windowSize == 0) {
+		// Nothing could ever be in flight, don't start a session that can't move
+		printf("ERROR: client asked for a window of 0 packets.\n");
+		return DONE;
+	}
+	if (info->bufferSize == 0) {
+		info->bufferSize = MAXBUF;
+	} else if (info->bufferSize > MAX_PAYLOAD) {
+		info->bufferSize = MAX_PAYLOAD;
+	}
 
-	// Extract filename
+	// Extract filename, options follow it when it is NUL terminated
 	int filenameLen = bytesRecv - 11; // bytes after the header
-	char filename[100]; // filename length of 100
+	uint8_t *options = memchr(buffer + 11, '\0', filenameLen);
+	int optionsLen = 0;
+	if (options != NULL) {
+		optionsLen = filenameLen - (options + 1 - (buffer + 11));
+		filenameLen = options - (buffer + 11);
+		options++;
+	}
+	if (filenameLen > 100) {
+		filenameLen = 100;
+	}
+	char filename[101]; // filename length of 100
 	memcpy(filename, buffer + 11, filenameLen);
 	filename[filenameLen] = '\0';
+
+	// Congestion controller: the client's pick, else the server default
+	char ccName[32];
+	int optionLen = 0;
+	uint8_t *ccOption = findOption(options, optionsLen, OPT_CONGESTION, &optionLen);
+	snprintf(ccName, sizeof(ccName), "%s", config->congestion);
+	if (ccOption != NULL && optionLen < sizeof(ccName)) {
+		memcpy(ccName, ccOption, optionLen);
+		ccName[optionLen] = '\0';
+	}
+	if (CongestionControl_init(&info->cc, ccName, info->windowSize) < 0) {
+		printf("WARNING: unknown congestion control %s, using %s.\n", ccName, config->congestion);
+		CongestionControl_init(&info->cc, config->congestion, info->windowSize);
+	}
+	if (config->traceCwnd) {
+		// The event loop runs every session in one process, tell them apart by client port
+		char tracePath[64];
+		if (config->eventLoop) {
+			snprintf(tracePath, sizeof(tracePath), "cwnd-%d-%d.trace", (int)getpid(), ntohs(info->clientAddr.sin6_port));
+		} else {
+			snprintf(tracePath, sizeof(tracePath), "cwnd-%d.trace", (int)getpid());
+		}
+		if (CongestionControl_trace(&info->cc, tracePath) < 0) {
+			printf("WARNING: unable to open %s.\n", tracePath);
+		}
+	}
+
+	// Pacing: the client may lower the rate cap for its transfer, never raise it
+	double rateCap = config->rateCap;
+	uint32_t capKbps;
+	uint8_t *capOption = findOption(options, optionsLen, OPT_RATE_CAP, &optionLen);
+	if (capOption != NULL && optionLen == 4) {
+		memcpy(&capKbps, capOption, 4);
+		double clientCap = ntohl(capKbps) * 1000.0 / 8;
+		if (clientCap > 0 && (rateCap == 0 || clientCap < rateCap)) {
+			rateCap = clientCap;
+		}
+	}
+	PACE_MODE pacing = config->pacing;
+	if (pacing == PACE_TXTIME && TxTime_enable(info->childSocket) < 0) {
+		printf("WARNING: SO_TXTIME not available, pacing with timers.\n");
+		pacing = PACE_TIMER;
+	}
+	info->headerLen = findOption(options, optionsLen, OPT_CRC32C, &optionLen) ? CRC_HEADER_LEN : PDU_HEADER_LEN;
+	Pacer_init(&info->pacer, pacing, rateCap, info->bufferSize + info->headerLen);
+	info->pmtuProbe = (findOption(options, optionsLen, OPT_PMTU_PROBE, &optionLen) != NULL);
 	
 	//printf("Received request:\n  Window Size: %d\n  Buffer Size: %d\n  Filename: %s\n", 
 	//	info->windowSize, info->bufferSize, filename);
@@ -241,250 +815,815 @@ STATE filename_state(char *argv[], int socketNum, uint8_t *buffer, int bytesRecv
 		printf("filename: %s can't be open! sending file error 33 ack.\n", filename);
 		return DONE;
 	} else {
+		// A striped (or resumed) request gets its share of the file, the
+		// client learns where it starts, and what the file is, from the file OK
+		uint8_t okPayload[MAXBUF];
+		int okPayloadLen = strlen(filename);
+		memcpy(okPayload, filename, okPayloadLen);
+		info->rangeEnd = UINT64_MAX;
+
+		uint16_t stripe[2];
+		uint64_t resume[2];
+		struct stat fileStat;
+		int ranged = 0;
+		int stripeLen = 0;
+		int resumeLen = 0;
+		uint8_t *stripeOption = findOption(options, optionsLen, OPT_STRIPE, &stripeLen);
+		uint8_t *resumeOption = findOption(options, optionsLen, OPT_RESUME, &resumeLen);
+		if (stripeOption != NULL && stripeLen == 4 && fstat(fileno(file), &fileStat) == 0) {
+			memcpy(stripe, stripeOption, 4);
+			uint64_t index = ntohs(stripe[0]);
+			uint64_t count = ntohs(stripe[1]);
+			uint64_t share = (count > 0) ? (fileStat.st_size + count - 1) / count : fileStat.st_size;
+			info->rangeStart = (index * share < fileStat.st_size) ? index * share : fileStat.st_size;
+			info->rangeEnd = (info->rangeStart + share < fileStat.st_size) ? info->rangeStart + share : fileStat.st_size;
+			ranged = 1;
+		} else if (resumeOption != NULL && resumeLen == 16 && fstat(fileno(file), &fileStat) == 0) {
+			// What a partial copy is still missing, cut to the file as it is now
+			memcpy(resume, resumeOption, 16);
+			info->rangeStart = be64toh(resume[0]);
+			info->rangeEnd = be64toh(resume[1]);
+			if (info->rangeEnd > fileStat.st_size) {
+				info->rangeEnd = fileStat.st_size;
+			}
+			if (info->rangeStart > info->rangeEnd) {
+				info->rangeStart = info->rangeEnd;
+			}
+			ranged = 1;
+		}
+		// A delta copy asks for the signatures of every block, then for the
+		// blocks it couldn't find in its own copy
+		uint32_t deltaBlock;
+		int deltaLen = 0;
+		uint8_t *deltaOption = findOption(options, optionsLen, OPT_DELTA, &deltaLen);
+		if (deltaOption != NULL && deltaLen == 4 && fstat(fileno(file), &fileStat) == 0) {
+			memcpy(&deltaBlock, deltaOption, 4);
+			deltaBlock = ntohl(deltaBlock);
+			if (deltaBlock >= DELTA_MIN_BLOCK && deltaBlock <= DELTA_MAX_BLOCK && (deltaBlock & (deltaBlock - 1)) == 0) {
+				info->deltaBlock = deltaBlock;
+			}
+			info->deltaRanges = (info->deltaBlock > 0) ? parseBlocks(options, optionsLen, deltaBlock, fileStat.st_size, &info->deltaRangeCount) : NULL;
+		}
+		// Compression is per packet, signatures don't get any (they don't compress)
+		int compressLen = 0;
+		uint8_t *compressOption = findOption(options, optionsLen, OPT_COMPRESS, &compressLen);
+		if (compressOption != NULL && compressLen == 1 && compressOption[0] == COMPRESS_LZ &&
+				info->bufferSize > COMPRESS_HEADER_LEN && (info->deltaBlock == 0 || info->deltaRanges != NULL)) {
+			info->compress = 1;
+			info->cacheDir = config->cacheDir;
+		}
+		// Parity can't go out with MSG_ZEROCOPY, its completions would
+		// throw off the window's
+		info->fec = (findOption(options, optionsLen, OPT_FEC, &optionLen) != NULL && !config->msgZeroCopy);
+		if (ranged || info->deltaBlock > 0 || info->compress || info->fec) {
+			okPayload[okPayloadLen++] = '\0';
+			if (ranged) {
+				fseeko(file, info->rangeStart, SEEK_SET);
+				uint64_t range[2] = { htobe64(info->rangeStart), htobe64(info->rangeEnd - info->rangeStart) };
+				okPayloadLen = addOption(okPayload, okPayloadLen, OPT_RANGE, range, 16);
+			}
+			if (ranged || info->deltaBlock > 0) {
+				uint64_t source[2] = { htobe64(fileStat.st_size), htobe64(fileStat.st_mtime) };
+				okPayloadLen = addOption(okPayload, okPayloadLen, OPT_SOURCE, source, 16);
+			}
+			if (info->compress) {
+				uint8_t codec = COMPRESS_LZ;
+				okPayloadLen = addOption(okPayload, okPayloadLen, OPT_COMPRESS, &codec, 1);
+			}
+			if (info->fec) {
+				okPayloadLen = addOption(okPayload, okPayloadLen, OPT_FEC, "", 0);
+			}
+		}
+
 		// Send OK flag 9
 		uint8_t okPDU[MAXBUF];
-		int okLen = createPDU(okPDU, 0, 9, (uint8_t *)filename, strlen(filename));
+		int okLen = createPDU(okPDU, 0, 9, okPayload, okPayloadLen);
 		sendtoErr(info->childSocket, okPDU, okLen, 0, (struct sockaddr *)&(info->clientAddr), clientLen);	
+		info->ctrlSentTime = RttEstimator_now();
 		//printf("[Server] filename: %s can be open. Sending Filenam OK ACK (flag 9).\n", filename);
 		returnValue = WRITE_FILE_OK_ACK;
 	}
 	
+	// Zero-copy mode: map the file, payloads are sent straight from the mapping
+	struct stat fileStat;
+	if (config->zeroCopy && info->deltaBlock == 0 && !info->compress && fstat(fileno(file), &fileStat) == 0 && fileStat.st_size > 0) {
+		info->fileMap = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+		if (info->fileMap == MAP_FAILED) {
+			printf("WARNING: mmap of %s failed, falling back to fread.\n", filename);
+			info->fileMap = NULL;
+		} else {
+			info->fileSize = fileStat.st_size;
+			madvise(info->fileMap, info->fileSize, MADV_SEQUENTIAL);
+			if (config->msgZeroCopy) {
+				info->msgZeroCopy = (ZeroCopy_enable(info->childSocket) == 0);
+			}
+		}
+	}
+
+	// GSO hands the kernel one MSG_ZEROCOPY id per run instead of per
+	// packet, which the window's completion tracking can't follow
+	info->gso = config->gso && !info->msgZeroCopy && GSO_enable(info->childSocket) == 0;
+
+	// The mapping and io_uring have their own read ahead; a delta copy's
+	// data and compressed packets only come out of the readers
+	info->readAhead = (config->readAhead && info->fileMap == NULL && info->ring == NULL) || info->deltaBlock > 0 || info->compress;
+
 	// Updating Server information
 	info->file = file; // Passing file pointer back to processClient
-	info->windowSize = windowSize;
-	info->bufferSize = bufferSize;
 	return returnValue;
 }
 
 // -----WRITE FILE OK ACK STATE-----
-STATE write_file_ok_ack_state(ServerInfo *info) {
-	STATE returnValue = DONE;
+STATE write_file_ok_ack_state(ServerInfo *info, EVENT event) {
 	uint8_t buffer[MAXBUF];
 	socklen_t clientLen = sizeof(info->clientAddr);
-	int count = 0;
 
-	setupPollSet();
-	addToPollSet(info->childSocket);
-
-	while (count < 10) {
-		int socketReady = pollCall(1000);
-		if (socketReady != -1) {
-			int bytesRecv = safeRecvfrom(info->childSocket, buffer, MAXBUF, 0, (struct sockaddr *)&(info->clientAddr), (int *) &clientLen);
-			if (bytesRecv < 0) {
-				continue;
-			}
+	// Nothing is resent from here, so no backoff: the client repeats its
+	// request if our file OK got lost
+	if (event == ENTER || event == TIMER) {
+		if (event == TIMER && ++info->ctrlTimeouts >= CTRL_TIMEOUTS) {
+			//printf("WRITE_FILE_OK_ACT: Timed out waiting for File OK ACK.\n");
+			return DONE;
+		}
+		info->deadline = RttEstimator_now() + RttEstimator_timeout(&info->rtt) * 1000ULL;
+		return WRITE_FILE_OK_ACK;
+	}
 	
-			
-			// Check Flag
-			uint8_t flag = buffer[6];
-			if (flag == 34) {
-				return SEND_DATA;
-			} else {
-				continue;
-			}			
-	} else {
-			count++;
+	int bytesRecv;
+	while ((bytesRecv = recvfrom(info->childSocket, buffer, MAXBUF, MSG_DONTWAIT, (struct sockaddr *)&(info->clientAddr), &clientLen)) >= 0) {
+		// Check Flag
+		uint8_t flag = buffer[6];
+		if (bytesRecv >= 7 && flag == 34) {
+			RttEstimator_sample(&info->rtt, info->ctrlSentTime);
+			return info->pmtuProbe ? PMTU_PROBE : SEND_DATA;
 		}
 	}	
+	return WRITE_FILE_OK_ACK;
+}
 	
-	//printf("WRITE_FILE_OK_ACT: Timed out waiting for File OK ACK.\n");
-	return returnValue;
+// Sends the probe being tried and gives its echo one RTO
+static STATE send_probe(ServerInfo *info) {
+	while (info->probeLow < info->probeHigh) {
+		if (info->probeTries == 0) {
+			info->probeSize = (info->probeLow + info->probeHigh + 1) / 2;
+			createPDUHeader(info->probe, info->probeSize, 11, info->probe + 7, info->probeSize - 7);
+		}
+		if (sendtoErr(info->childSocket, info->probe, info->probeSize, 0, (struct sockaddr *)&(info->clientAddr), sizeof(info->clientAddr)) < 0) {
+			info->probeHigh = info->probeSize - 1; // EMSGSIZE, bigger than our own link
+			info->probeTries = 0;
+			continue;
+		}
+		info->deadline = RttEstimator_now() + RttEstimator_timeout(&info->rtt) * 1000ULL;
+		return PMTU_PROBE;
+	}
+
+	// Data is sized to fit now, let the kernel handle DF as usual again
+	DontFragment_set(info->childSocket, 0);
+	free(info->probe);
+	info->probe = NULL;
+
+	// Parity payloads are a little longer than data ones, and have to fit too
+	int payload = info->probeLow - info->headerLen;
+	if (info->fec && payload > FEC_PARITY_OVERHEAD) {
+		payload -= FEC_PARITY_OVERHEAD;
+	}
+	printf("[Server] path MTU probe: %d byte PDUs, payload %d of %d asked for\n", info->probeLow, payload, info->bufferSize);
+	info->bufferSize = payload;
+	info->pacer.packetSize = info->probeLow;
+	return SEND_DATA;
+}
+
+// -----PMTU PROBE STATE-----
+// Binary search for the largest PDU that reaches the client unfragmented.
+// A size gets PMTU_PROBE_TRIES chances so one lost probe (or echo) doesn't
+// shrink the transfer, EMSGSIZE from our own interface settles it at once.
+STATE pmtu_probe_state(ServerInfo *info, EVENT event) {
+	if (event == ENTER) {
+		info->probeHigh = info->bufferSize + info->headerLen;
+		info->probeLow = (info->probeHigh < PMTU_MIN_PDU) ? info->probeHigh : PMTU_MIN_PDU; // always fits
+		info->probeTries = 0;
+		info->probe = calloc(1, info->probeHigh);
+		if (info->probe == NULL || DontFragment_set(info->childSocket, 1) < 0) {
+			printf("WARNING: unable to set DF, skipping the path MTU probe.\n");
+			free(info->probe);
+			info->probe = NULL;
+			return SEND_DATA;
+		}
+		return send_probe(info);
+	}
+
+	if (event == TIMER) {
+		// No echo within an RTO: try the size again, or give up on it
+		if (++info->probeTries >= PMTU_PROBE_TRIES) {
+			info->probeHigh = info->probeSize - 1;
+			info->probeTries = 0;
+		}
+		return send_probe(info);
+	}
+
+	// Anything but the echo of this size (stale echoes, RRs) is dropped
+	uint8_t reply[MAXBUF];
+	struct sockaddr_in6 replyAddr;
+	socklen_t replyLen = sizeof(replyAddr);
+	int bytesRecv;
+	while ((bytesRecv = recvfrom(info->childSocket, reply, sizeof(reply), MSG_DONTWAIT, (struct sockaddr *)&replyAddr, &replyLen)) >= 0) {
+		uint32_t seq;
+		memcpy(&seq, reply, 4);
+		if (bytesRecv >= 7 && reply[6] == 12 && ntohl(seq) == info->probeSize &&
+				checkPDU(reply, bytesRecv, PDU_HEADER_LEN)) {
+			info->probeLow = info->probeSize;
+			info->probeTries = 0;
+			return send_probe(info);
+		}
+		replyLen = sizeof(replyAddr);
+	}
+	return PMTU_PROBE;
 }
 
 // -----SEND DATA STATE-----
-STATE send_data_state(CircularQueue *window, ServerInfo *info) {
-	// Initialize variables
+// Each run retransmits what a timeout left presumed lost, fills the open part
+// of the window and sets the deadline: the pacer's hold, or one RTO once the
+// window or cwnd is full.  ACKs arrive as READABLE events.
+STATE send_data_state(ServerInfo *info, EVENT event) {
+	CircularQueue *window = &info->window;
 	socklen_t clientLen = sizeof(info->clientAddr);
-	uint32_t sequenceNum = 1;
-	int eofReached = 0;
-	int timeoutCount = 0;
-	info->eofResendCount = 0;
-
-	while (!eofReached) {
-		// Fill the window while it is open
-		while (!CircularQueue_is_full(window) && !eofReached) {
-			
-			// Read data from file
-			uint8_t payload[MAXBUF];
-			//int bytesRead = fread(payload, 1, MAXBUF, info->file);
-			int bytesRead = fread(payload, 1, info->bufferSize, info->file); // 2nd change
-			if (bytesRead <= 0) {
-				eofReached = 1; // finsihed reading
-				break;
-			}
-			
-			// Create PDU (flag 16)
-			uint8_t pduToSend[MAXBUF + 7];
-			int pduLen = createPDU(pduToSend, sequenceNum, 16, payload, bytesRead);
-	
-			// Store in circular buffer
-			CircularQueue_insert(window, sequenceNum, pduToSend, pduLen);
-			printf("PDU LEN %d", pduLen);		
-			// Send to client
-			sendtoErr(info->childSocket, pduToSend, pduLen, 0, (struct sockaddr *)&(info->clientAddr), clientLen);
-			sequenceNum++;
+	uint64_t now = RttEstimator_now();
 
-			// Check for RR/SREJ responses in non-blocking
-			while (pollCall(0) > 0) {
-				wait_on_ack_state(window, info);
-			}
+	if (event == ENTER) {
+		// Zero-copy slots only hold the header, the payload stays in the mapping
+		if (CircularQueue_init(window, info->windowSize, info->fileMap ? info->headerLen : info->bufferSize + info->headerLen) < 0) {
+			printf("ERROR: Unable to allocate the send window.\n");
+			return DONE;
+		}
+		info->nextSeq = 1;
+		info->eofReached = 0;
+		info->eofResendCount = 0;
+		info->lastHeard = now;
+		info->rtoDeadline = 0;
+		info->rwnd = info->windowSize;
+		info->fileOffset = info->rangeStart;
+		info->fileEnd = info->rangeEnd; // end of the stripe, or the whole file
+		if (info->fileMap != NULL && info->fileEnd > info->fileSize) {
+			info->fileEnd = info->fileSize;
+		}
 
-			timeoutCount = 0;
+		// io_uring: the socket and file are fixed files, the slots one
+		// registered buffer that the payloads are read ahead into
+		if (info->ring != NULL) {
+			Uring_add_file(info->ring, info->childSocket);
+			if (info->fileMap == NULL && !info->readAhead) {
+				struct stat fileStat;
+				info->readLen = calloc(info->windowSize, sizeof(int));
+				if (info->readLen == NULL || fstat(fileno(info->file), &fileStat) < 0) {
+					printf("ERROR: Unable to set up the read ahead.\n");
+					return DONE;
+				}
+				if (info->fileEnd > fileStat.st_size) {
+					info->fileEnd = fileStat.st_size;
+				}
+				info->readNext = info->nextSeq;
+				info->readOffset = info->fileOffset;
+				Uring_add_file(info->ring, fileno(info->file));
+				Uring_add_buffer(info->ring, window->arena, window->ArenaSize);
+			}
 		}
 
-		// Window is full, wait for space
-		while(CircularQueue_is_full(window) && !eofReached) {
-			int poll = pollCall(1000);
-			if (poll > 0) {
-				wait_on_ack_state(window, info);
-				timeoutCount = 0;
-			} else {
-				// Timeout: resend oldest packet
-				for (int i = 0; i < window->WindowSize; i++) {
-					QueueEntry *entry = &window->entries[i];
-					if (entry->valid) {
-						// Create PDU flag 18
-						uint32_t resentSeq;
-						memcpy(&resentSeq, entry->packet, 4);
-						resentSeq = ntohl(resentSeq);
-						
-						uint8_t timeoutPDU[MAXBUF + 7];
-						int timeoutLen = createPDU(timeoutPDU, resentSeq, 18, entry->packet + 7, entry-> packetLen - 7);
-						sendtoErr(info->childSocket, timeoutPDU, timeoutLen, 0, (struct sockaddr *)&(info->clientAddr), clientLen);
-						//printf("[Server] Timeout: resent packet seq#%u flag 18.\n", resentSeq);
-						break;
+		// Read-ahead thread: the range is read in blocks of up to 1 MB, about
+		// two windows ahead of the send cursor.  A delta copy gets the
+		// signatures of the file (hashed by a reader per core) or the blocks
+		// it asked for back to back, and its data starts at 0 of that.
+		// Compressed packets are packed by a reader per core too, chunks
+		// sized so a packet that doesn't shrink still fits the payload.
+		if (info->readAhead) {
+			struct stat fileStat;
+			if (fstat(fileno(info->file), &fileStat) == 0) {
+				if (info->fileEnd > fileStat.st_size) {
+					info->fileEnd = fileStat.st_size;
+				}
+				PrefetchRange whole = { info->fileOffset, info->fileEnd };
+				uint64_t windowBytes = (uint64_t)info->windowSize * info->bufferSize;
+				PrefetchMode mode = { 0, 0, NULL, 1 };
+				if (info->compress) {
+					mode.chunk = info->bufferSize - COMPRESS_HEADER_LEN;
+					mode.threads = Delta_threads();
+					if (info->deltaBlock == 0 && info->fileOffset == 0 && info->fileEnd == (uint64_t)fileStat.st_size) {
+						mode.cacheDir = info->cacheDir; // only whole files line up with the cache
 					}
 				}
-				timeoutCount++;
-				if (timeoutCount >= 10) {
-					//printf("ERROR: Timeouts >= 10, exiting.\n");
+				int started;
+				if (info->deltaBlock > 0 && info->deltaRanges == NULL) {
+					mode.sigBlock = info->deltaBlock;
+					mode.threads = Delta_threads();
+					started = Prefetch_init(&info->prefetch, fileno(info->file), &whole, 1, windowBytes, &mode);
+				} else if (info->deltaBlock > 0) {
+					started = Prefetch_init(&info->prefetch, fileno(info->file), info->deltaRanges, info->deltaRangeCount, windowBytes, &mode);
+				} else {
+					started = Prefetch_init(&info->prefetch, fileno(info->file), &whole, 1, windowBytes, &mode);
+				}
+				if (started < 0 && (info->deltaBlock > 0 || info->compress)) {
+					printf("ERROR: Unable to start the read-ahead threads for a %s.\n", info->compress ? "compressed transfer" : "delta copy");
 					return DONE;
+				} else if (started < 0) {
+					printf("WARNING: Unable to start the read-ahead thread, reading in the send loop.\n");
+				} else if (info->deltaBlock > 0) {
+					info->fileOffset = 0;
+					info->fileEnd = Prefetch_size(&info->prefetch);
 				}
 			}
 		}
+
+		// -f: parity is coded as the new packets go out
+		if (info->fec && FecEncoder_init(&info->parity, info->bufferSize, info->headerLen, info->windowSize) < 0) {
+			printf("WARNING: Unable to allocate the parity groups, sending without FEC.\n");
+			info->fec = 0;
+		}
+
+		// Large PDUs fill the default send buffer after a handful of packets
+		SocketBuffer_reserve(info->childSocket, SO_SNDBUF, (long)info->windowSize * (info->bufferSize + info->headerLen));
+		TransferStats_start(&info->stats);
+		update_pacing_rate(info);
+	}
+
+	SendBatch batch;
+	SendBatch_init(&batch, info->childSocket, (struct sockaddr *)&(info->clientAddr), clientLen, &info->stats);
+	batch.pacer = &info->pacer;
+	batch.gso = info->gso;
+	batch.ring = info->ring;
+	if (info->msgZeroCopy) {
+		batch.flags = MSG_ZEROCOPY;
+	}
+
+	if (event == READABLE) {
+		// RR/SREJs (and zero-copy completions) waiting on the socket
+		wait_on_ack_state(window, info);
+		info->lastHeard = now;
+		info->rtoDeadline = 0;
+	} else if (event == TIMER && info->rtoDeadline != 0 && now >= info->rtoDeadline) {
+		info->rtoDeadline = 0;
+		if (now - info->lastHeard >= RTT_GIVE_UP_MS * 1000ULL) {
+			//printf("ERROR: client silent, exiting.\n");
+			return DONE;
+		}
+
+		// Nothing lost, only the receive window held us back and its
+		// update hasn't come: just wait for it (or the give-up) again
+		if (window->Next == window->Base) {
+			info->deadline = now + RttEstimator_timeout(&info->rtt) * 1000ULL;
+			info->rtoDeadline = info->deadline;
+			return SEND_DATA;
+		}
+
+		// Timeout: back the timer off, collapse cwnd and presume everything
+		// outstanding lost; the oldest goes out now with flag 18, the rest
+		// as ACKs open cwnd again
+		RttEstimator_backoff(&info->rtt);
+		CongestionControl_on_timeout(&info->cc, window->Next, window->Next - window->Base);
+		QueueEntry *entry = CircularQueue_get(window, window->Base);
+		if (entry != NULL) {
+			resend_packet(window, info, &batch, entry, 18);
+			SendBatch_flush(&batch);
+			//printf("[Server] Timeout: resent packet seq#%u flag 18.\n", entry->sequenceNum);
+		}
+		info->lostNext = window->Base + 1;
+		info->lostEnd = window->Next;
+		update_pacing_rate(info);
 	}
 
+	uint64_t pacingDelay = 0;
+	int slotBusy = 0;
+	int readMiss = 0;
+
+	// Packets presumed lost at the last timeout go before any new data
+	if (info->lostNext < window->Base) {
+		info->lostNext = window->Base;
+	}
+	while (info->lostNext < info->lostEnd && in_flight(window, info) < CongestionControl_window(&info->cc)) {
+		QueueEntry *entry = CircularQueue_get(window, info->lostNext++);
+		if (entry != NULL) {
+			resend_packet(window, info, &batch, entry, 18);
+		}
+	}
+
+	// Fill the open part of the window (as far as cwnd allows), then
+	// flush it in one go
+	now = RttEstimator_now();
+	while (!CircularQueue_is_full(window) && !info->eofReached &&
+			in_flight(window, info) < CongestionControl_window(&info->cc) &&
+			window->Next - window->Base < info->rwnd &&
+			(pacingDelay = Pacer_delay(&info->pacer, info->bufferSize + info->headerLen)) == 0) {
+		uint32_t sequenceNum = info->nextSeq;
+		if (info->msgZeroCopy && !CircularQueue_slot_ready(window, sequenceNum)) {
+			// Kernel still owns this slot's header, wait for the completion
+			ZeroCopy_reap(info->childSocket, &window->ZeroCopyDone);
+			if (!CircularQueue_slot_ready(window, sequenceNum)) {
+				slotBusy = 1;
+				break;
+			}
+		}
+
+		if (info->fileMap != NULL) {
+			// Zero-copy: slot gets the header, payload is referenced in the mapping
+			if (info->fileOffset >= info->fileEnd) {
+				info->eofReached = 1;
+				break;
+			}
+			int bytesRead = info->bufferSize;
+			if (info->fileOffset + bytesRead > info->fileEnd) {
+				bytesRead = info->fileEnd - info->fileOffset;
+			}
+			uint8_t *payload = info->fileMap + info->fileOffset;
+			uint8_t *header = CircularQueue_slot(window, sequenceNum);
+			int headerLen = createDataPDUHeader(header, sequenceNum, 16, payload, bytesRead, info->headerLen);
+			CircularQueue_commit(window, sequenceNum, headerLen + bytesRead);
+			SendBatch_addv(&batch, header, headerLen, payload, bytesRead);
+			if (info->msgZeroCopy) {
+				CircularQueue_zero_copy_sent(window, sequenceNum);
+			}
+			QueueEntry *entry = CircularQueue_get(window, sequenceNum);
+			entry->fileOffset = info->fileOffset;
+			entry->sentTime = now;
+			if (info->fec && FecEncoder_add(&info->parity, sequenceNum, payload, bytesRead)) {
+				FecEncoder_send(&info->parity, &batch);
+			}
+			info->fileOffset += bytesRead;
+			info->stats.bytes += bytesRead;
+			info->nextSeq++;
+			continue;
+		}
+
+		// Read data from file straight into its window slot (sized for
+		// bufferSize), it stays put until ACKed
+		uint8_t *pduToSend = CircularQueue_slot(window, sequenceNum);
+		int bytesRead;
+		int rawLen = 0; // file bytes behind the payload, when it is compressed
+		int bytesWanted = info->bufferSize;
+		if (info->fileEnd - info->fileOffset < bytesWanted) {
+			bytesWanted = info->fileEnd - info->fileOffset; // last packet of a stripe
+		}
+		if (info->compress) {
+			// The readers have whole packets ready, the raw length up front
+			bytesRead = Prefetch_take_packet(&info->prefetch, pduToSend + info->headerLen);
+			if (bytesRead < 0) {
+				readMiss = 1;
+				break;
+			}
+			rawLen = (bytesRead > 0) ? Compress_raw_len(pduToSend + info->headerLen) : 0;
+		} else if (info->prefetch.blocks != NULL) {
+			// Only what the readers already have, the disk is never waited on
+			bytesRead = Prefetch_take(&info->prefetch, pduToSend + info->headerLen, bytesWanted);
+			if (bytesRead < 0) {
+				readMiss = 1;
+				break;
+			}
+		} else if (info->ring != NULL) {
+			// io_uring: read ahead together with the rest of the open window
+			if (info->readNext == sequenceNum) {
+				read_ahead(info);
+			}
+			bytesRead = (info->readNext > sequenceNum) ? info->readLen[sequenceNum % info->windowSize] : 0;
+		} else {
+			bytesRead = fread(pduToSend + info->headerLen, 1, bytesWanted, info->file); // 2nd change
+		}
+		if (bytesRead <= 0) {
+			info->eofReached = 1; // finsihed reading
+			break;
+		}
+
+		// Create PDU (flag 16) header in front of it
+		int pduLen = createDataPDUHeader(pduToSend, sequenceNum, 16, pduToSend + info->headerLen, bytesRead, info->headerLen) + bytesRead;
+		CircularQueue_commit(window, sequenceNum, pduLen);
+		SendBatch_add(&batch, pduToSend, pduLen);
+		QueueEntry *entry = CircularQueue_get(window, sequenceNum);
+		entry->fileOffset = info->fileOffset;
+		entry->sentTime = now;
+		if (info->fec && FecEncoder_add(&info->parity, sequenceNum, pduToSend + info->headerLen, bytesRead)) {
+			FecEncoder_send(&info->parity, &batch);
+		}
+		info->fileOffset += info->compress ? rawLen : bytesRead;
+		info->stats.bytes += info->compress ? rawLen : bytesRead;
+		info->nextSeq++;
+	}
+	if (info->fec && info->eofReached) {
+		FecEncoder_send(&info->parity, &batch); // the last group, however short
+	}
+	SendBatch_flush(&batch);
+
 	// -----Send EOF----- 
-	if (eofReached) {
-		uint8_t eofPDU[7]; // no payload
-		int eofLen = createPDU(eofPDU, sequenceNum, 10, NULL, 0);
-		sendtoErr(info->childSocket, eofPDU, eofLen, 0, (struct sockaddr *)&(info->clientAddr), clientLen);
-		//printf("[Server] sent EOF packet with seq #%u (flag 10)\n", sequenceNum);
-
-		// Save PDU to resend later		
-		memcpy(info->eofPacket, eofPDU, eofLen);
+	// The whole file is read and every packet is ACKed
+	if (info->eofReached && CircularQueue_is_empty(window)) {
+		// Only a delta copy's signatures have a payload: the digest of the
+		// whole source, for rcopy to check the file it puts together
+		uint8_t digest[DELTA_DIGEST_LEN];
+		int digestLen = 0;
+		if (info->deltaBlock > 0 && info->deltaRanges == NULL && Prefetch_digest(&info->prefetch, digest) == 0) {
+			digestLen = DELTA_DIGEST_LEN;
+		}
+		int eofLen = createPDU(info->eofPacket, info->nextSeq, 10, digest, digestLen);
+		sendtoErr(info->childSocket, info->eofPacket, eofLen, 0, (struct sockaddr *)&(info->clientAddr), clientLen);
+		info->ctrlSentTime = RttEstimator_now();
+		//printf("[Server] sent EOF packet with seq #%u (flag 10)\n", info->nextSeq);
+
+		// Saved to resend later
 		info->eofLen = eofLen;
-		info->eofSeq = sequenceNum;
+		info->eofSeq = info->nextSeq;
+		return WAIT_ON_EOF_ACK;
 	}
 
-	//CircularQueue_free(window);
-	return WAIT_ON_EOF_ACK;
+	// Window, cwnd or the receiver's window is full (or the whole file is
+	// out), wait for ACKs for at most one RTO; otherwise come back when the
+	// pacer lets the next go
+	int blocked = CircularQueue_is_full(window) || info->eofReached ||
+		in_flight(window, info) >= CongestionControl_window(&info->cc) ||
+		window->Next - window->Base >= info->rwnd;
+	if (blocked) {
+		if (info->rtoDeadline == 0) {
+			info->rtoDeadline = now + RttEstimator_timeout(&info->rtt) * 1000ULL;
+		}
+		info->deadline = info->rtoDeadline;
+	} else if (slotBusy) {
+		info->deadline = now + 1000000; // the completion makes the socket readable first
+	} else if (readMiss) {
+		info->deadline = now + PREFETCH_RETRY_US; // the reader is behind, look again shortly
+	} else {
+		info->deadline = now + pacingDelay;
+	}
+	return SEND_DATA;
 }
 
 
 // ----- WAIT ON ACK STATE -----
+// Drains every RR/SREJ already queued on the socket in one pass.  Only the
+// highest RR matters (ACK compression), it slides the window once; every
+// distinct SREJ still in the window is resent in one burst.
 STATE wait_on_ack_state(CircularQueue *window, ServerInfo *info) {
-	uint8_t recvBuff[MAXBUF];
-	int clientLen = sizeof(info->clientAddr);
-	
-	// Polling
-	setupPollSet();
-	addToPollSet(info->childSocket);
-	int packetAckPoll = pollCall(1000);
-	if (packetAckPoll <= 0) {
-		if (packetAckPoll == 0) {
-			printf("[Server] pollling timeout for RR/SREJ.\n");
-		} else {
-			printf("ERROR: poll failed.\n");
+	uint32_t highestRR = 0;
+	uint32_t rwndAck = 0; // ACK the newest receive window came with
+	uint32_t rebuilt = 0; // -f: the receiver's count of packets rebuilt from parity
+	uint32_t resent = 0;
+	SackBlock lost[SREJ_LIST_MAX];
+	int lostCount = 0;
+
+	// With MSG_ZEROCOPY the socket also polls ready for completions on
+	// its error queue, so pick those up too
+	if (info->msgZeroCopy) {
+		ZeroCopy_reap(info->childSocket, &window->ZeroCopyDone);
+	}
+
+	int count = 0;
+	info->ackBatch->socketNum = info->childSocket;
+	info->ackBatch->ring = info->ring;
+	while ((count = RecvBatch_recv(info->ackBatch, MSG_DONTWAIT)) > 0) {
+		for (int i = 0; i < count; i++) {
+			int bytesRecv;
+			uint8_t *recvBuff = RecvBatch_packet(info->ackBatch, i, &bytesRecv);
+			if (!checkPDU(recvBuff, bytesRecv, PDU_HEADER_LEN)) {
+				continue; // corrupted on the way
+			}
+				
+			// Extract the flag and sequence number
+			uint8_t flag = recvBuff[6];
+			uint32_t ackSequence;
+			memcpy(&ackSequence, recvBuff, 4);
+			ackSequence = ntohl(ackSequence);
+
+			// Check flag value
+			if (flag == 5 || flag == 7) { // RR, SACK carries one too
+				if (ackSequence > highestRR) {
+					highestRR = ackSequence;
+				}
+				uint32_t rwnd;
+				if (ackSequence >= rwndAck && parseRwnd(recvBuff, bytesRecv, &rwnd)) {
+					rwndAck = ackSequence;
+					info->rwnd = rwnd;
+				}
+				uint32_t heard;
+				if (info->fec && parseRebuilt(recvBuff, bytesRecv, &heard) && heard > rebuilt) {
+					rebuilt = heard;
+				}
+				if (flag == 7) {
+					lostCount += parseSack(recvBuff, bytesRecv, lost + lostCount, SREJ_LIST_MAX - lostCount);
+				}
+			} else if (flag == 6) { // SREJ, a single missing packet
+				if (lostCount < SREJ_LIST_MAX) {
+					lost[lostCount].start = ackSequence;
+					lost[lostCount].end = ackSequence;
+					lostCount++;
+				}
+			} else {
+				printf("[Server] SREJ Unexpected Flag %d)\n", flag);
+			}
+		}
+		if (count < BATCH_MAX) {
+			break; // socket is empty
 		}
-		return SEND_DATA; // Send again
 	}
-	
-	int bytesRecv = safeRecvfrom(info->childSocket, recvBuff, 7/*MAXBUF*/, 0, (struct sockaddr *)&(info->clientAddr), (int *)&clientLen);
-	if (bytesRecv < 0) {
-		printf("ERROR: failed to recv RR/SREJ");
-		return DONE;
+
+	if (highestRR > window->Base) {
+		// Time the newest packet this ACK covers, unless it was resent or
+		// went out before a retransmission the ACK may have waited for
+		QueueEntry *newest = CircularQueue_get(window, highestRR - 1);
+		if (newest != NULL && !newest->retransmitted && newest->sequenceNum >= info->resendMark) {
+			RttEstimator_sample(&info->rtt, newest->sentTime);
+		}
+		uint32_t inflight = window->Next - window->Base;
+		uint32_t acked = highestRR - window->Base;
+		CircularQueue_slide(window, highestRR);
+		CongestionControl_on_ack(&info->cc, acked, inflight - acked, info->rtt.srtt);
+		update_pacing_rate(info);
 	}
-		
-	// Extract the flag and sequence number
-	uint8_t flag = recvBuff[6];
-	uint32_t ackSequence;
-	memcpy(&ackSequence, recvBuff, 4);
-	ackSequence = ntohl(ackSequence);
-
-	// Check flag value
-	if (flag == 5) { // RR
-		printf("RR seq #%u\n", ackSequence);
-		for (uint32_t i = 1; i < ackSequence; i++) {
-			//CircularQueue_remove(window, ackSequence);
-			CircularQueue_remove(window, i);
-		}	
-	} else if (flag == 6) { // SREJ
-		printf("SREJ seq #%u\n", ackSequence);
-		QueueEntry *entry = CircularQueue_get(window, ackSequence);
-		if (entry) {
-			uint8_t srejPDU[MAXBUF + 7];
-			int srejLen = createPDU(srejPDU, ackSequence, 17, entry->packet + 7, entry->packetLen - 7);
-			sendtoErr(info->childSocket, srejPDU, srejLen, 0, (struct sockaddr *)&(info->clientAddr), clientLen);
+
+	SendBatch batch;
+	SendBatch_init(&batch, info->childSocket, (struct sockaddr *)&(info->clientAddr), sizeof(info->clientAddr), &info->stats);
+	batch.pacer = &info->pacer;
+	batch.ring = info->ring;
+	for (int i = 0; i < lostCount; i++) {
+		// Clip to what is still outstanding
+		uint32_t start = (lost[i].start > window->Base) ? lost[i].start : window->Base;
+		uint32_t end = (lost[i].end < window->Next - 1) ? lost[i].end : window->Next - 1;
+		if (start <= end) {
+			CongestionControl_on_loss(&info->cc, start, window->Next, window->Next - window->Base);
+		}
+		for (uint32_t seq = start; seq <= end; seq++) {
+			// Several ACKs in one drain can name the same hole, send it once
+			int seen = 0;
+			for (int j = 0; j < i && !seen; j++) {
+				seen = (seq >= lost[j].start && seq <= lost[j].end);
+			}
+			QueueEntry *entry = CircularQueue_get(window, seq);
+			if (!seen && entry != NULL) {
+				resend_packet(window, info, &batch, entry, 17);
+				resent++;
+			}
 		}
-	} else {
-		printf("[Server] SREJ Unexpected Flag %d)\n", flag);
+	}
+	SendBatch_flush(&batch);
+
+	// What was lost on the way, rebuilt or not, sets the parity to come
+	if (info->fec) {
+		FecEncoder_feedback(&info->parity, resent, rebuilt);
 	}
 	return SEND_DATA;
 }
 
+// Queues one window entry on batch with a new flag (17 = SREJ, 18 = timeout)
+void resend_packet(CircularQueue *window, ServerInfo *info, SendBatch *batch, QueueEntry *entry, uint8_t flag) {
+	uint8_t *packet = CircularQueue_slot(window, entry->sequenceNum);
+	int payloadLen = entry->packetLen - info->headerLen;
+
+	// Only the flag changes, the checksum (or CRC) is patched to match
+	// instead of being recomputed over the payload
+	if (info->fileMap != NULL) {
+		// Payload is re-referenced from the mapping.  The slot's own header
+		// may still be in use by a zero-copy send, so re-flag a copy of it
+		// in the batch's scratch space
+		uint8_t *header = SendBatch_header(batch);
+		uint8_t *payload = info->fileMap + entry->fileOffset;
+		memcpy(header, packet, info->headerLen);
+		reflagPDUHeader(header, flag, payload, payloadLen, info->headerLen);
+		SendBatch_addv(batch, header, info->headerLen, payload, payloadLen);
+	} else {
+		// Re-flag the stored PDU in place
+		reflagPDUHeader(packet, flag, packet + info->headerLen, payloadLen, info->headerLen);
+		SendBatch_add(batch, packet, entry->packetLen);
+	}
+	entry->retransmitted = 1;
+	info->resendMark = window->Next;
+	info->stats.retransmits++;
+}
+
+
+// io_uring: reads the payload of every free window slot from readNext on
+// in one submission, each straight into its slot
+void read_ahead(ServerInfo *info) {
+	CircularQueue *window = &info->window;
+	int ids[URING_ENTRIES];
+	int space = Uring_space(info->ring);
+	uint32_t first = info->readNext;
+	int count = 0;
+
+	while (info->readNext < window->Base + info->windowSize && info->readOffset < info->fileEnd && count < space) {
+		int len = info->bufferSize;
+		if (info->fileEnd - info->readOffset < len) {
+			len = info->fileEnd - info->readOffset;
+		}
+		uint8_t *payload = CircularQueue_slot(window, info->readNext) + info->headerLen;
+		ids[count++] = Uring_read(info->ring, fileno(info->file), payload, len, info->readOffset);
+		info->readLen[info->readNext % info->windowSize] = len;
+		info->readOffset += len;
+		info->readNext++;
+	}
+	Uring_submit(info->ring, &info->stats.syscalls);
+
+	// A short read means the file shrank, nothing after it is valid
+	int shortRead = 0;
+	for (int i = 0; i < count; i++) {
+		int *len = &info->readLen[(first + i) % info->windowSize];
+		int res = Uring_result(info->ring, ids[i]);
+		if (shortRead || res < 0) {
+			res = 0;
+		}
+		shortRead = shortRead || res < *len;
+		*len = res;
+	}
+}
+
+// Delta copy: the byte ranges of every OPT_BLOCKS run in the request, cut
+// to the file; NULL if there are none (the client wants the signatures)
+PrefetchRange *parseBlocks(uint8_t *options, int optionsLen, uint32_t blockSize, uint64_t fileSize, int *count) {
+	PrefetchRange *ranges = NULL;
+	*count = 0;
+	int runsLen = 0;
+	uint8_t *runs;
+	while ((runs = findOption(options, optionsLen, OPT_BLOCKS, &runsLen)) != NULL) {
+		ranges = srealloc(ranges, (*count + runsLen / 8 + 1) * sizeof(PrefetchRange));
+		for (int i = 0; i + 8 <= runsLen; i += 8) {
+			uint32_t run[2];
+			memcpy(run, runs + i, 8);
+			uint64_t start = (uint64_t)ntohl(run[0]) * blockSize;
+			uint64_t end = start + (uint64_t)ntohl(run[1]) * blockSize;
+			ranges[*count].start = (start < fileSize) ? start : fileSize;
+			ranges[*count].end = (end < fileSize) ? end : fileSize;
+			(*count)++;
+		}
+		optionsLen -= runs + runsLen - options;
+		options = runs + runsLen;
+	}
+	return ranges;
+}
+
+// Pacing rate: the congestion window spread over one smoothed RTT, with
+// extra headroom in slow start so the window can still double
+void update_pacing_rate(ServerInfo *info) {
+	if (info->rtt.samples == 0 || info->rtt.srtt <= 0) {
+		return; // nothing to spread it over yet
+	}
+	double gain = (info->cc.cwnd < info->cc.ssthresh) ? PACER_GAIN_SLOW_START : PACER_GAIN;
+	Pacer_set_rate(&info->pacer, gain * info->cc.cwnd * (info->bufferSize + info->headerLen) * 1e6 / info->rtt.srtt);
+}
+
+// Packets sent and not yet ACKed, minus those presumed lost after a
+// timeout that haven't been resent yet
+uint32_t in_flight(CircularQueue *window, ServerInfo *info) {
+	uint32_t inflight = window->Next - window->Base;
+	if (info->lostNext < info->lostEnd) {
+		uint32_t from = (info->lostNext > window->Base) ? info->lostNext : window->Base;
+		if (info->lostEnd > from) {
+			inflight -= info->lostEnd - from;
+		}
+	}
+	return inflight;
+}
 
-STATE wait_on_eof_ack_state(CircularQueue *window, ServerInfo *info) {
+// -----WAIT ON EOF ACK STATE-----
+STATE wait_on_eof_ack_state(ServerInfo *info, EVENT event) {
 	uint8_t recvEofBuff[MAXBUF +7];
 	socklen_t clientLen = sizeof(info->clientAddr);	
 	
-	int pollCallTimer = pollCall(1000);
-	if (pollCallTimer > 0) {
-		int bytesRecv = safeRecvfrom(info->childSocket, recvEofBuff, MAXBUF, 0, (struct sockaddr*)&(info->clientAddr), (int *)&clientLen);
-		if (bytesRecv < 0) {
-			//return RESEND_EOF;
-			return WAIT_ON_EOF_ACK;
-		}
+	if (event == ENTER) {
+		info->deadline = RttEstimator_now() + RttEstimator_timeout(&info->rtt) * 1000ULL;
+		return WAIT_ON_EOF_ACK;
+	}
+	if (event == TIMER) {
+		return RESEND_EOF;
+	}
 	
-  		uint8_t flag = recvEofBuff[6];
+	// Completions of the last zero-copy sends keep the socket readable
+	if (info->msgZeroCopy) {
+		ZeroCopy_reap(info->childSocket, &info->window.ZeroCopyDone);
+	}
+
+	int bytesRecv;
+	while ((bytesRecv = recvfrom(info->childSocket, recvEofBuff, MAXBUF, MSG_DONTWAIT, (struct sockaddr*)&(info->clientAddr), &clientLen)) >= 0) {
+		uint8_t flag = recvEofBuff[6];
 		uint32_t eofSequence;
 		memcpy(&eofSequence, recvEofBuff, 4);
 		eofSequence = ntohl(eofSequence);
 
-		// Calculate checksum
-		uint16_t recvChecksum;
-		memcpy(&recvChecksum, recvEofBuff + 4, 2);	
-		recvChecksum = ntohs(recvChecksum);
-
-
-		// Compute checksum for validation
-	    	uint8_t tempBuf[MAXBUF + 7];
-                memcpy(tempBuf, recvEofBuff, bytesRecv);
-                memset(tempBuf + 4, 0, 2); // zero checksum field
-		uint16_t calcChecksum = in_cksum((unsigned short *)tempBuf, bytesRecv);
-	        int checksum_valid = (recvChecksum == calcChecksum);
+		// Checksum over the whole PDU (checksum field included) comes out 0 when valid
+		int checksum_valid = checkPDU(recvEofBuff, bytesRecv, PDU_HEADER_LEN);
 		                            
 
 		if (flag == 35 && (eofSequence == info->eofSeq) && (checksum_valid)) {
+			if (info->eofResendCount == 0) {
+				RttEstimator_sample(&info->rtt, info->ctrlSentTime);
+			}
 			//printf("[Server] received EOF ACK (flag 35) for seq #%u.\n", eofSequence);
 			return DONE;			
-		} else { 
-			//printf("[Server] unexpected flag %d while waiting for EOF ACK.\n", eofSequence);
-			return WAIT_ON_EOF_ACK;
 		}
+		//printf("[Server] unexpected flag %d while waiting for EOF ACK.\n", eofSequence);
 	}
-	
-	// Poll timed out
-	return RESEND_EOF;
+	return WAIT_ON_EOF_ACK;
 }
 
-STATE resend_eof_state(CircularQueue *window, ServerInfo *info) {
-	if (info->eofResendCount >= 10) {
+// -----RESEND EOF STATE-----
+STATE resend_eof_state(ServerInfo *info, EVENT event) {
+	if (info->eofResendCount >= CTRL_TIMEOUTS) {
 		//printf("[ERROR] EOF ACK not received after 10 attemped. Exiting...\n");
 		return DONE;
 	}
 
 	// Resending EOF
+	RttEstimator_backoff(&info->rtt);
 	sendtoErr(info->childSocket, info->eofPacket, info->eofLen, 0, (struct sockaddr*)&(info->clientAddr), sizeof(info->clientAddr));
 	info->eofResendCount++;
 	//printf("[Server] resending EOF packet (attempt #%d)\n", info->eofResendCount);
@@ -500,28 +1639,102 @@ STATE resend_eof_state(CircularQueue *window, ServerInfo *info) {
 
 
 
-int checkArgs(int argc, char *argv[]) {
-	// Checks args and returns port number
-	int portNumber = 0;
 
-	if ((argc > 3) || argc == 1) {
-		fprintf(stderr, "Usage %s [error rate] [optional port number]\n", argv[0]);
+
+
+
+
+int checkArgs(int argc, char *argv[], ServerConfig *config) {
+	// Checks args, fills in the options and returns port number
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "zZc:Tp:r:Geuw:aFk:")) != -1) {
+		switch (opt) {
+			case 'z':
+				config->zeroCopy = 1;
+				break;
+			case 'Z':
+				config->zeroCopy = 1;
+				config->msgZeroCopy = 1;
+				break;
+			case 'c':
+				if (CongestionControl_find(optarg) == NULL) {
+					fprintf(stderr, "Unknown congestion control %s (none, reno, cubic)\n", optarg);
+					exit(-1);
+				}
+				config->congestion = optarg;
+				break;
+			case 'T':
+				config->traceCwnd = 1;
+				break;
+			case 'p':
+				if (strcmp(optarg, "off") == 0) {
+					config->pacing = PACE_OFF;
+				} else if (strcmp(optarg, "timer") == 0) {
+					config->pacing = PACE_TIMER;
+				} else if (strcmp(optarg, "txtime") == 0) {
+					config->pacing = PACE_TXTIME;
+				} else {
+					fprintf(stderr, "Unknown pacing mode %s (off, timer, txtime)\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'r':
+				config->rateCap = atof(optarg) * 1e6 / 8; // Mbit/s
+				if (config->rateCap <= 0) {
+					fprintf(stderr, "Invalid rate cap %s\n", optarg);
+					exit(-1);
+				}
+				break;
+			case 'G':
+				config->gso = 0;
+				break;
+			case 'e':
+				config->eventLoop = 1;
+				break;
+			case 'u':
+				config->uring = 1;
+				break;
+			case 'w':
+				config->workers = atoi(optarg);
+				if (config->workers < 1 || config->workers > WORKER_MAX) {
+					fprintf(stderr, "Invalid number of workers %s (1 to %d)\n", optarg, WORKER_MAX);
+					exit(-1);
+				}
+				break;
+			case 'a':
+				config->pinWorkers = 1;
+				break;
+			case 'F':
+				config->readAhead = 0;
+				break;
+			case 'k':
+				config->cacheDir = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage %s [-z] [-Z] [-c none|reno|cubic] [-T] [-p off|timer|txtime] [-r Mbit/s] [-G] [-e] [-u] [-w workers] [-a] [-F] [-k cache-dir] [error rate] [optional port number]\n", argv[0]);
+				exit(-1);
+		}
+	}
+
+	if ((argc - optind > 2) || argc == optind) {
+		fprintf(stderr, "Usage %s [-z] [-Z] [-c none|reno|cubic] [-T] [-p off|timer|txtime] [-r Mbit/s] [-G] [-e] [-u] [-w workers] [-a] [-F] [-k cache-dir] [error rate] [optional port number]\n", argv[0]);
 		exit(-1);
 	}
 	
-	if (argc == 3) { // 2	{
-		portNumber = atoi(argv[2]);
+	if (argc - optind == 2) {
+		config->portNumber = atoi(argv[optind + 1]);
 	}
 
-	return portNumber;
+	return config->portNumber;
 }
 
 float getErrorRate(int argc, char *argv[]) {
-	// Check args and return error rate
+	// Check args and return error rate (checkArgs() has run getopt already)
 	float errorRate = 0.0;
 
-	if ((argc == 3) || (argc == 2)) {
-		errorRate = atof(argv[1]);
+	if (argc > optind) {
+		errorRate = atof(argv[optind]);
 		if (errorRate < 0 || errorRate >= 1) {
 			fprintf(stderr, "Invalid error rate!\n");
 			exit(-1);
@@ -530,6 +1743,3 @@ float getErrorRate(int argc, char *argv[]) {
 	
 	return errorRate;	
 }
-
-
-
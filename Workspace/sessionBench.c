@@ -0,0 +1,256 @@
+// Session benchmark: server memory per session and how many sessions it
+// holds at once, fork-per-client against the epoll event loop (-e).
+//
+// Starts ./server in each mode and opens N concurrent sessions on it: every
+// client sends a file request, ACKs the file OK and then stays silent, so
+// the session sits in SEND_DATA with a full window until the server gives
+// up on it (RTT_GIVE_UP_MS).  With all N open, the proportional set size
+// (Pss) of the server and its children is read from /proc.
+//
+// Usage: sessionBench [max sessions]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "functions.h"
+#include "rttEstimator.h"
+
+#define BENCH_FILE "sessionBench.dat"
+#define BENCH_FILE_SIZE (1 << 20)
+#define BENCH_WINDOW 64
+#define HANDSHAKE_BATCH 32   // requests in flight at once
+#define HANDSHAKE_WAIT_MS 2000
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// -----Server under test-----
+// Runs in its own process group so its forked children go down with it
+static pid_t start_server(int eventLoop, int port) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		setpgid(0, 0);
+		int devNull = open("/dev/null", O_WRONLY);
+		dup2(devNull, STDOUT_FILENO);
+		dup2(devNull, STDERR_FILENO);
+		char portArg[16];
+		snprintf(portArg, sizeof(portArg), "%d", port);
+		if (eventLoop) {
+			execl("./server", "server", "-e", "0", portArg, (char *)NULL);
+		} else {
+			execl("./server", "server", "0", portArg, (char *)NULL);
+		}
+		_exit(127);
+	}
+	usleep(300000);
+	return pid;
+}
+
+static void stop_server(pid_t pid) {
+	kill(-pid, SIGKILL);
+	while (waitpid(pid, NULL, 0) < 0 && kill(pid, 0) == 0);
+}
+
+// Pss of one process in KB, 0 if it is gone
+static long pss_kb(int pid) {
+	char path[64], line[256];
+	long kb = 0;
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "Pss: %ld", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(file);
+	return kb;
+}
+
+// Pss of every process in the server's group (the server and, in fork
+// mode, one child per session)
+static long server_pss_kb(pid_t server, int *processes) {
+	long total = 0;
+	*processes = 0;
+	DIR *proc = opendir("/proc");
+	struct dirent *entry;
+	while (proc != NULL && (entry = readdir(proc)) != NULL) {
+		int pid = atoi(entry->d_name);
+		if (pid <= 0) {
+			continue;
+		}
+		char path[64], stat[512];
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		FILE *file = fopen(path, "r");
+		if (file == NULL) {
+			continue;
+		}
+		int len = fread(stat, 1, sizeof(stat) - 1, file);
+		fclose(file);
+		stat[len > 0 ? len : 0] = '\0';
+
+		// "pid (comm) state ppid pgrp ...", comm may hold spaces
+		char *rest = strrchr(stat, ')');
+		int ppid, pgrp;
+		char state;
+		if (rest != NULL && sscanf(rest + 1, " %c %d %d", &state, &ppid, &pgrp) == 3 && pgrp == server && state != 'Z') {
+			total += pss_kb(pid);
+			(*processes)++;
+		}
+	}
+	if (proc != NULL) {
+		closedir(proc);
+	}
+	return total;
+}
+
+// -----Clients-----
+// Opens count sessions, HANDSHAKE_BATCH at a time.  Returns how many got a
+// file OK (and were sent the file OK ACK); the sockets stay open.
+static int open_sessions(int *sockets, int count, int port) {
+	struct sockaddr_in server = {0};
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+
+	uint8_t request[MAXBUF];
+	uint8_t payload[MAXBUF];
+	uint16_t windowSize = htons(BENCH_WINDOW);
+	uint16_t bufferSize = htons(MAXBUF);
+	memcpy(payload, &windowSize, 2);
+	memcpy(payload + 2, &bufferSize, 2);
+	memcpy(payload + 4, BENCH_FILE, strlen(BENCH_FILE));
+	int requestLen = createPDU(request, 0, 8, payload, 4 + strlen(BENCH_FILE));
+	uint8_t ack[PDU_HEADER_LEN];
+	int ackLen = createPDU(ack, 0, 34, NULL, 0);
+
+	int established = 0;
+	struct pollfd fds[HANDSHAKE_BATCH];
+	for (int first = 0; first < count; first += HANDSHAKE_BATCH) {
+		int batch = (count - first < HANDSHAKE_BATCH) ? count - first : HANDSHAKE_BATCH;
+		for (int i = 0; i < batch; i++) {
+			sockets[first + i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+			fds[i].fd = sockets[first + i];
+			fds[i].events = POLLIN;
+			if (fds[i].fd < 0 || sendto(fds[i].fd, request, requestLen, 0, (struct sockaddr *)&server, sizeof(server)) < 0) {
+				fds[i].fd = -1;
+			}
+		}
+
+		int waiting = batch;
+		double deadline = now() + HANDSHAKE_WAIT_MS / 1000.0;
+		while (waiting > 0 && now() < deadline) {
+			if (poll(fds, batch, (deadline - now()) * 1000 + 1) <= 0) {
+				continue;
+			}
+			for (int i = 0; i < batch; i++) {
+				if (fds[i].fd < 0 || !(fds[i].revents & POLLIN)) {
+					continue;
+				}
+				uint8_t reply[MAXBUF];
+				struct sockaddr_in6 from;
+				socklen_t fromLen = sizeof(from);
+				int len = recvfrom(fds[i].fd, reply, sizeof(reply), 0, (struct sockaddr *)&from, &fromLen);
+				if (len >= PDU_HEADER_LEN && reply[6] == 9 && checkPDU(reply, len, PDU_HEADER_LEN)) {
+					sendto(fds[i].fd, ack, ackLen, 0, (struct sockaddr *)&from, fromLen);
+					fds[i].fd = -1; // data that follows is left unread
+					established++;
+					waiting--;
+				}
+			}
+		}
+	}
+	return established;
+}
+
+static void run(int eventLoop, int sessions, int port) {
+	pid_t server = start_server(eventLoop, port);
+	int processes;
+	long idleKb = server_pss_kb(server, &processes);
+
+	int *sockets = malloc(sessions * sizeof(int));
+	double start = now();
+	int established = open_sessions(sockets, sessions, port);
+	double elapsed = now() - start;
+	usleep(300000); // sessions allocate their windows on entering SEND_DATA
+	long pssKb = server_pss_kb(server, &processes);
+
+	printf("%-6s %9d %12d %14.0f %10d %10.1f %11.1f\n", eventLoop ? "epoll" : "fork", sessions, established,
+		established / elapsed, processes, pssKb / 1024.0, established ? (double)(pssKb - idleKb) / established : 0);
+	if (elapsed * 1000 > RTT_GIVE_UP_MS) {
+		printf("WARNING: handshakes took longer than the server's give-up time, early sessions may have ended.\n");
+	}
+
+	stop_server(server);
+	for (int i = 0; i < sessions; i++) {
+		if (sockets[i] >= 0) {
+			close(sockets[i]);
+		}
+	}
+	free(sockets);
+}
+
+int main(int argc, char *argv[]) {
+	int maxSessions = 1000;
+	if (argc > 1) {
+		maxSessions = atoi(argv[1]);
+	}
+	if (maxSessions < 1) {
+		fprintf(stderr, "Usage: %s [max sessions]\n", argv[0]);
+		return 1;
+	}
+
+	// Each session costs the bench one socket and the server two descriptors
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	FILE *file = fopen(BENCH_FILE, "wb");
+	if (file == NULL) {
+		perror(BENCH_FILE);
+		return 1;
+	}
+	for (int i = 0; i < BENCH_FILE_SIZE; i++) {
+		fputc(i, file);
+	}
+	fclose(file);
+
+	printf("Server memory with N concurrent sessions open (window %d x %d bytes, Pss from /proc)\n", BENCH_WINDOW, MAXBUF);
+	printf("%-6s %9s %12s %14s %10s %10s %11s\n", "mode", "sessions", "established", "handshakes/s", "processes", "Pss MB", "KB/session");
+	int port = 47000 + getpid() % 10000;
+	for (int sessions = 1; ; sessions *= 10) {
+		if (sessions > maxSessions) {
+			sessions = maxSessions;
+		}
+		run(0, sessions, port++);
+		run(1, sessions, port++);
+		if (sessions == maxSessions) {
+			break;
+		}
+	}
+
+	unlink(BENCH_FILE);
+	return 0;
+}
@@ -0,0 +1,71 @@
+// ----- Transfer Statistics -----
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "transferStats.h"
+
+// read and write type system calls of this process so far (syscr + syscw),
+// which io_uring's file operations don't go through
+static uint64_t file_syscalls(void) {
+	unsigned long long reads = 0, writes = 0;
+	char line[128];
+	FILE *io = fopen("/proc/thread-self/io", "r");
+	if (io == NULL) {
+		io = fopen("/proc/self/io", "r"); // before Linux 3.17
+	}
+	if (io == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), io) != NULL) {
+		sscanf(line, "syscr: %llu", &reads);
+		sscanf(line, "syscw: %llu", &writes);
+	}
+	fclose(io);
+	return reads + writes;
+}
+
+void TransferStats_start(TransferStats *stats) {
+	memset(stats, 0, sizeof(TransferStats));
+	gettimeofday(&stats->start, NULL);
+	stats->fileSyscallsAtStart = file_syscalls();
+}
+
+void TransferStats_stop(TransferStats *stats) {
+	gettimeofday(&stats->end, NULL);
+	stats->fileSyscalls = file_syscalls() - stats->fileSyscallsAtStart;
+}
+
+// Seconds between start and stop (or now if the transfer is still running)
+double TransferStats_elapsed(TransferStats *stats) {
+	struct timeval end = stats->end;
+	if (end.tv_sec == 0 && end.tv_usec == 0) {
+		gettimeofday(&end, NULL);
+	}
+	return (end.tv_sec - stats->start.tv_sec) + (end.tv_usec - stats->start.tv_usec) / 1e6;
+}
+
+void TransferStats_print(TransferStats *stats, const char *who) {
+	double seconds = TransferStats_elapsed(stats);
+	double perCall = stats->syscalls ? (double)stats->packets / stats->syscalls : 0.0;
+	double mbps = seconds > 0 ? (stats->bytes * 8.0) / (seconds * 1e6) : 0.0;
+	double perGB = stats->bytes ? (stats->syscalls + stats->fileSyscalls) * 1e9 / stats->bytes : 0.0;
+
+	printf("[%s] -----Transfer Stats-----\n", who);
+	printf("[%s] bytes: %llu  packets: %llu  retransmits: %llu\n", who,
+		(unsigned long long)stats->bytes, (unsigned long long)stats->packets,
+		(unsigned long long)stats->retransmits);
+	printf("[%s] syscalls: %llu  packets/syscall: %.2f  file syscalls: %llu  syscalls/GB: %.0f\n", who,
+		(unsigned long long)stats->syscalls, perCall, (unsigned long long)stats->fileSyscalls, perGB);
+	printf("[%s] elapsed: %.3f s  throughput: %.2f Mbit/s\n", who, seconds, mbps);
+	if (stats->gsoSends > 0) {
+		printf("[%s] gso: %llu sends  segments/send: %.2f\n", who, (unsigned long long)stats->gsoSends,
+			(double)stats->gsoSegments / stats->gsoSends);
+	}
+	if (stats->groReceives > 0) {
+		printf("[%s] gro: %llu receives  segments/receive: %.2f\n", who, (unsigned long long)stats->groReceives,
+			(double)stats->groSegments / stats->groReceives);
+	}
+}
@@ -0,0 +1,36 @@
+// 
+// Per-transfer counters for the sender and receiver.
+//
+// Every transfer owns one TransferStats.  The data path bumps the
+// counters as it goes and TransferStats_print() dumps a summary when
+// the transfer finishes.  File reads and writes are counted by the kernel
+// (/proc/thread-self/io), for the whole thread: with several transfers in
+// one event loop they include each other's.
+
+#ifndef __TRANSFERSTATS_H__
+#define __TRANSFERSTATS_H__
+
+#include <stdint.h>
+#include <sys/time.h>
+
+typedef struct {
+	struct timeval start;
+	struct timeval end;
+	uint64_t bytes;       // payload bytes moved (first transmission / first receipt)
+	uint64_t packets;     // datagrams handed to / taken from the socket
+	uint64_t syscalls;    // socket calls used to move those datagrams (io_uring_enter()s with -u)
+	uint64_t fileSyscalls; // read()/write() calls the thread made meanwhile, i.e. stdio's file I/O
+	uint64_t fileSyscallsAtStart;
+	uint64_t retransmits; // datagrams sent again (SREJ + timeout)
+	uint64_t gsoSends;    // UDP_SEGMENT messages handed to the kernel
+	uint64_t gsoSegments; // datagrams they were split into
+	uint64_t groReceives; // coalesced (UDP_GRO) receives
+	uint64_t groSegments; // datagrams they carried
+} TransferStats;
+
+void TransferStats_start(TransferStats *stats);
+void TransferStats_stop(TransferStats *stats);
+double TransferStats_elapsed(TransferStats *stats);
+void TransferStats_print(TransferStats *stats, const char *who);
+
+#endif
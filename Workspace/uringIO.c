@@ -0,0 +1,324 @@
+// ----- io_uring Backend -----
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uringIO.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Sets up the rings and the (empty) fixed file and buffer tables.  Returns
+// -1 when the kernel has no io_uring (or it is disabled), callers then stay
+// on the plain system calls.
+int Uring_init(Uring *ring) {
+	struct io_uring_params params;
+	memset(ring, 0, sizeof(Uring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = uring_setup(URING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		return -1;
+	}
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqRingSize > ring->sqRingSize) {
+			ring->sqRingSize = ring->cqRingSize;
+		}
+		ring->cqRingSize = ring->sqRingSize;
+	}
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cqRing = ring->sqRing;
+	if (ring->sqRing != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+
+	uint8_t *sq = ring->sqRing;
+	uint8_t *cq = ring->cqRing;
+	ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+	ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// Sparse tables, filled in as transfers register their fds and buffers
+	for (int i = 0; i < URING_FILES; i++) {
+		ring->files[i] = -1;
+	}
+	ring->fixedFiles = (uring_register(ring->fd, IORING_REGISTER_FILES, ring->files, URING_FILES) == 0);
+
+	struct io_uring_rsrc_register sparse;
+	memset(&sparse, 0, sizeof(sparse));
+	sparse.nr = URING_BUFFERS;
+	sparse.flags = IORING_RSRC_REGISTER_SPARSE;
+	ring->fixedBuffers = (uring_register(ring->fd, IORING_REGISTER_BUFFERS2, &sparse, sizeof(sparse)) == 0);
+	return 0;
+}
+
+void Uring_free(Uring *ring) {
+	if (ring->fd < 0) {
+		return;
+	}
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd); // drops the fixed files and buffers with it
+	ring->fd = -1;
+}
+
+// -----Fixed files and registered buffers-----
+static int file_index(Uring *ring, int fd) {
+	for (int i = 0; ring->fixedFiles && i < URING_FILES; i++) {
+		if (ring->files[i] == fd) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int update_file(Uring *ring, int index, int fd) {
+	struct io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = index;
+	update.fds = (uint64_t)(uintptr_t)&fd;
+	return uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
+
+// Puts fd in the fixed file table, returns its index or -1 if it won't be
+// used as a fixed file
+int Uring_add_file(Uring *ring, int fd) {
+	int index = file_index(ring, -1);
+	if (fd < 0 || index < 0 || update_file(ring, index, fd) < 0) {
+		return -1;
+	}
+	ring->files[index] = fd;
+	return index;
+}
+
+// Takes fd out of the table, before it gets closed
+void Uring_remove_file(Uring *ring, int fd) {
+	int index = file_index(ring, fd);
+	if (fd >= 0 && index >= 0) {
+		update_file(ring, index, -1);
+		ring->files[index] = -1;
+	}
+}
+
+static int buffer_index(Uring *ring, const void *address, size_t len) {
+	const uint8_t *start = address;
+	for (int i = 0; ring->fixedBuffers && i < URING_BUFFERS; i++) {
+		const uint8_t *base = ring->buffers[i].iov_base;
+		if (base != NULL && start >= base && start + len <= base + ring->buffers[i].iov_len) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int update_buffer(Uring *ring, int index, void *base, size_t len) {
+	struct iovec iov = { base, len };
+	struct io_uring_rsrc_update2 update;
+	memset(&update, 0, sizeof(update));
+	update.offset = index;
+	update.data = (uint64_t)(uintptr_t)&iov;
+	update.nr = 1;
+	return uring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1 ? 0 : -1;
+}
+
+// Registers [base, base + len) so reads and writes inside it are fixed
+// buffer operations.  Returns its index, or -1 if it stays unregistered
+// (table full, or over RLIMIT_MEMLOCK).
+int Uring_add_buffer(Uring *ring, void *base, size_t len) {
+	int index = -1;
+	for (int i = 0; ring->fixedBuffers && i < URING_BUFFERS && index < 0; i++) {
+		if (ring->buffers[i].iov_base == NULL) {
+			index = i;
+		}
+	}
+	if (base == NULL || index < 0 || update_buffer(ring, index, base, len) < 0) {
+		return -1;
+	}
+	ring->buffers[index].iov_base = base;
+	ring->buffers[index].iov_len = len;
+	return index;
+}
+
+// Unregisters a buffer, before its memory is freed
+void Uring_remove_buffer(Uring *ring, void *base) {
+	for (int i = 0; ring->fixedBuffers && i < URING_BUFFERS; i++) {
+		if (base != NULL && ring->buffers[i].iov_base == base) {
+			update_buffer(ring, i, NULL, 0);
+			ring->buffers[i].iov_base = NULL;
+			ring->buffers[i].iov_len = 0;
+		}
+	}
+}
+
+// -----Queueing-----
+// Next free SQE with the file filled in (as a fixed file when it is one),
+// NULL when URING_ENTRIES operations are already queued
+static struct io_uring_sqe *get_sqe(Uring *ring, uint8_t opcode, int fd) {
+	if (ring->queued >= URING_ENTRIES) {
+		return NULL;
+	}
+	unsigned tail = *ring->sqTail + ring->queued;
+	unsigned index = tail & *ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sqArray[index] = index;
+
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	int fixed = file_index(ring, fd);
+	if (fixed >= 0) {
+		sqe->fd = fixed;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+	if (ring->fence) {
+		sqe->flags |= IOSQE_IO_DRAIN;
+		ring->fence = 0;
+	}
+	sqe->user_data = ring->queued;
+	ring->expected[ring->queued] = -1;
+	return sqe;
+}
+
+// Each returns the operation's id, or -1 if the ring is full (submit first)
+int Uring_sendmsg(Uring *ring, int fd, struct msghdr *msg, int flags) {
+	struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_SENDMSG, fd);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	return ring->queued++;
+}
+
+// With MSG_DONTWAIT an empty socket completes at once with -EAGAIN
+// instead of leaving the receive pending in the kernel
+int Uring_recvmsg(Uring *ring, int fd, struct msghdr *msg, int flags) {
+	struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_RECVMSG, fd);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	return ring->queued++;
+}
+
+int Uring_read(Uring *ring, int fd, void *buf, unsigned len, uint64_t offset) {
+	int fixed = buffer_index(ring, buf, len);
+	struct io_uring_sqe *sqe = get_sqe(ring, fixed >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ, fd);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = (fixed >= 0) ? fixed : 0;
+	return ring->queued++;
+}
+
+int Uring_write(Uring *ring, int fd, const void *buf, unsigned len, uint64_t offset) {
+	int fixed = buffer_index(ring, buf, len);
+	struct io_uring_sqe *sqe = get_sqe(ring, fixed >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = (fixed >= 0) ? fixed : 0;
+	ring->expected[ring->queued] = len;
+	return ring->queued++;
+}
+
+// The next operation queued starts only once everything queued before it
+// has completed (e.g. a receive into buffers that writes still read from)
+void Uring_fence(Uring *ring) {
+	ring->fence = (ring->queued > 0);
+}
+
+// Operations that can still be queued before a submit
+int Uring_space(Uring *ring) {
+	return URING_ENTRIES - ring->queued;
+}
+
+// -----Submitting-----
+// Hands every queued operation to the kernel and waits until all of them
+// completed.  *syscalls is bumped per io_uring_enter().  Returns the number
+// of operations, or -1 if the kernel refused the submission.
+int Uring_submit(Uring *ring, uint64_t *syscalls) {
+	unsigned count = ring->queued;
+	unsigned submitted = 0;
+	unsigned reaped = 0;
+	if (count == 0) {
+		return 0;
+	}
+	__atomic_store_n(ring->sqTail, *ring->sqTail + count, __ATOMIC_RELEASE);
+	ring->queued = 0;
+	ring->fence = 0;
+
+	while (reaped < count) {
+		int ret = uring_enter(ring->fd, count - submitted, count - reaped, IORING_ENTER_GETEVENTS);
+		if (syscalls != NULL) {
+			(*syscalls)++;
+		}
+		if (ret < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			return -1;
+		}
+		if (ret > 0) {
+			submitted += ret;
+		}
+
+		unsigned head = *ring->cqHead;
+		unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+			int id = cqe->user_data;
+			ring->results[id] = cqe->res;
+			if (ring->expected[id] >= 0 && cqe->res != ring->expected[id]) {
+				printf("ERROR: io_uring write of %d bytes returned %d.\n", ring->expected[id], cqe->res);
+				ring->errors++;
+			}
+			reaped++;
+		}
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+
+// Result of operation id from the last submit: bytes moved or -errno
+int Uring_result(Uring *ring, int id) {
+	return ring->results[id];
+}
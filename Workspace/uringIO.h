@@ -0,0 +1,67 @@
+//
+// io_uring backend for the data path, on the raw system calls (no liburing).
+//
+// Operations are queued with Uring_sendmsg/recvmsg/read/write and handed to
+// the kernel together by Uring_submit(): one io_uring_enter() that also
+// waits for all of them, so a submit works like one big batched system
+// call.  Every queue call returns an id; Uring_result() gives that
+// operation's result (bytes, or -errno) after the submit.  Failed writes are
+// reported by the submit itself.
+//
+// Sockets and files passed to Uring_add_file() go in the fixed file table
+// and memory passed to Uring_add_buffer() is registered, so reads and
+// writes inside it use READ_FIXED / WRITE_FIXED and skip the per-operation
+// fd lookup and page pinning.  Both tables are sparse so transfers can come
+// and go on one ring; when one is full (or the kernel can't register)
+// operations simply go without.
+
+#ifndef __URINGIO_H__
+#define __URINGIO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256 // operations per submit
+#define URING_FILES 256   // fixed file table slots
+#define URING_BUFFERS 64  // registered buffer slots
+
+typedef struct {
+	int fd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqRing, *cqRing;
+	size_t sqRingSize, cqRingSize, sqesSize;
+	unsigned queued;              // operations queued since the last submit
+	int fence;                    // next operation waits for everything before it
+	int results[URING_ENTRIES];   // by id, valid after Uring_submit()
+	int expected[URING_ENTRIES];  // writes: their length, -1 = any result is fine
+	int files[URING_FILES];       // fixed file table, -1 = free
+	struct iovec buffers[URING_BUFFERS]; // registered buffers, iov_base NULL = free
+	int fixedFiles;               // the tables could be registered
+	int fixedBuffers;
+	uint64_t errors;              // writes that failed or came up short
+} Uring;
+
+int Uring_init(Uring *ring);
+void Uring_free(Uring *ring);
+
+int Uring_add_file(Uring *ring, int fd);
+void Uring_remove_file(Uring *ring, int fd);
+int Uring_add_buffer(Uring *ring, void *base, size_t len);
+void Uring_remove_buffer(Uring *ring, void *base);
+
+int Uring_sendmsg(Uring *ring, int fd, struct msghdr *msg, int flags);
+int Uring_recvmsg(Uring *ring, int fd, struct msghdr *msg, int flags);
+int Uring_read(Uring *ring, int fd, void *buf, unsigned len, uint64_t offset);
+int Uring_write(Uring *ring, int fd, const void *buf, unsigned len, uint64_t offset);
+void Uring_fence(Uring *ring);
+int Uring_space(Uring *ring);
+int Uring_submit(Uring *ring, uint64_t *syscalls);
+int Uring_result(Uring *ring, int id);
+
+#endif